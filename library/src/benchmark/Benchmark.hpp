@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BENCHMARK_HPP
+#define BENCHMARK_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * Minimal harness with the shape of Google Benchmark, so the suite builds without fetching it.
+ * A benchmark runs `for (auto _ : state)` on every thread of a run, the iterations are doubled
+ * until a run lasts BENCHMARK_MIN_TIME ms. Latency benchmarks hand their own timings to
+ * state.sample() and get percentiles instead of a mean.
+ */
+#define BENCHMARK_MIN_TIME 200
+#define BENCHMARK_MAX_ITERATIONS ((uint64_t) 1 << 30)
+
+static inline uint64_t benchmark_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+// cost of the two clock reads around a sampled operation, taken off every sample
+static inline uint64_t clock_overhead() {
+    static uint64_t sOverhead = 0;
+    static bool sCalibrated = false;
+    if (!sCalibrated) {
+        uint64_t best = UINT64_MAX;
+        for (int i = 0; i < 1000; i++) {
+            uint64_t begin = benchmark_now();
+            uint64_t end = benchmark_now();
+            best = std::min(best, end - begin);
+        }
+        sOverhead = best;
+        sCalibrated = true;
+    }
+    return sOverhead;
+}
+
+class State {
+public:
+    struct Iterator {
+        uint64_t remain;
+        bool operator!=(const Iterator &end) const { return remain != 0; }
+        void operator++() { remain--; }
+        int operator*() const { return 0; }
+    };
+public:
+    State(uint64_t iterations, int64_t arg, int index, int threads)
+            : mIterations(iterations), mArg(arg), mIndex(index), mThreads(threads), mOverhead(clock_overhead()) {}
+    Iterator begin() { return Iterator{mIterations}; }
+    Iterator end() { return Iterator{0}; }
+    uint64_t iterations() const { return mIterations; }
+    int64_t range() const { return mArg; }
+    int thread_index() const { return mIndex; }
+    int threads() const { return mThreads; }
+    void sample(uint64_t nanos) { mSamples.push_back(nanos > mOverhead ? nanos - mOverhead : 0); }
+    std::vector<uint64_t> &samples() { return mSamples; }
+private:
+    uint64_t              mIterations;
+    int64_t               mArg;
+    int                   mIndex;
+    int                   mThreads;
+    uint64_t              mOverhead;
+    std::vector<uint64_t> mSamples;
+};
+
+struct Benchmark {
+    const char *       name;
+    void               (*function)(State &state);
+    void               (*setup)(int64_t arg);
+    void               (*teardown)(int64_t arg);
+    std::vector<int>   threads;
+    std::vector<int64_t> args;
+    bool               latency;
+
+    Benchmark *Threads(int count) { threads.push_back(count); return this; }
+    Benchmark *ThreadRange(int low, int high) {
+        for (int count = low; count <= high; count *= 2) {
+            threads.push_back(count);
+        }
+        return this;
+    }
+    Benchmark *Arg(int64_t arg) { args.push_back(arg); return this; }
+    Benchmark *Setup(void (*function)(int64_t)) { setup = function; return this; }
+    Benchmark *Teardown(void (*function)(int64_t)) { teardown = function; return this; }
+    Benchmark *Latency() { latency = true; return this; }
+};
+
+static std::vector<Benchmark *> &benchmarks() {
+    static std::vector<Benchmark *> sBenchmarks;
+    return sBenchmarks;
+}
+
+static inline Benchmark *register_benchmark(const char *name, void (*function)(State &)) {
+    Benchmark *benchmark = new Benchmark{name, function, nullptr, nullptr, {}, {}, false};
+    benchmarks().push_back(benchmark);
+    return benchmark;
+}
+
+#define BENCHMARK_CONCAT_(a, b) a##b
+#define BENCHMARK_CONCAT(a, b) BENCHMARK_CONCAT_(a, b)
+#define BENCHMARK(function) \
+    static Benchmark *BENCHMARK_CONCAT(sBenchmark, __LINE__) __attribute__((unused)) = register_benchmark(#function, function)
+
+template<typename T>
+static inline void DoNotOptimize(T const &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+//**************************************************************************************************
+struct BenchmarkRun {
+    Benchmark *               benchmark;
+    uint64_t                  iterations;
+    int64_t                   arg;
+    int                       threads;
+    std::atomic<int>          ready;
+    std::atomic<bool>         go;
+    std::vector<State *>      states;
+    std::vector<uint64_t>     elapsed;
+};
+
+struct BenchmarkThread {
+    BenchmarkRun *run;
+    int           index;
+};
+
+static void *benchmark_thread(void *arg) {
+    BenchmarkThread *thread = (BenchmarkThread *) arg;
+    BenchmarkRun *run = thread->run;
+    State *state = run->states[thread->index];
+
+    run->ready.fetch_add(1, std::memory_order_acq_rel);
+    while (!run->go.load(std::memory_order_acquire));
+    uint64_t begin = benchmark_now();
+    run->benchmark->function(*state);
+    run->elapsed[thread->index] = benchmark_now() - begin;
+    return nullptr;
+}
+
+// wall time of the slowest thread, in ns
+static uint64_t run_once(BenchmarkRun *run) {
+    run->ready.store(0, std::memory_order_relaxed);
+    run->go.store(false, std::memory_order_relaxed);
+    run->states.clear();
+    run->elapsed.assign(run->threads, 0);
+    for (int i = 0; i < run->threads; i++) {
+        run->states.push_back(new State(run->iterations, run->arg, i, run->threads));
+    }
+
+    if (run->benchmark->setup != nullptr) {
+        run->benchmark->setup(run->arg);
+    }
+    std::vector<pthread_t> ids(run->threads);
+    std::vector<BenchmarkThread> threads(run->threads);
+    for (int i = 0; i < run->threads; i++) {
+        threads[i] = BenchmarkThread{run, i};
+        pthread_create(&ids[i], nullptr, benchmark_thread, &threads[i]);
+    }
+    while (run->ready.load(std::memory_order_acquire) != run->threads);
+    run->go.store(true, std::memory_order_release);
+    for (int i = 0; i < run->threads; i++) {
+        pthread_join(ids[i], nullptr);
+    }
+    if (run->benchmark->teardown != nullptr) {
+        run->benchmark->teardown(run->arg);
+    }
+    return *std::max_element(run->elapsed.begin(), run->elapsed.end());
+}
+
+static void report(BenchmarkRun *run, uint64_t wall) {
+    char name[256];
+    int length = snprintf(name, sizeof(name), "%s", run->benchmark->name);
+    if (!run->benchmark->args.empty()) {
+        length += snprintf(name + length, sizeof(name) - length, "/%lld", (long long) run->arg);
+    }
+    snprintf(name + length, sizeof(name) - length, "/threads:%d", run->threads);
+
+    if (!run->benchmark->latency) {
+        double per = (double) wall / run->iterations;
+        double total = (double) run->iterations * run->threads * 1000.0 / wall;
+        printf("%-48s %12.1f ns %12.2f Mops/s %14llu\n", name, per, total, (unsigned long long) run->iterations);
+        return;
+    }
+
+    std::vector<uint64_t> samples;
+    for (State *state : run->states) {
+        samples.insert(samples.end(), state->samples().begin(), state->samples().end());
+    }
+    if (samples.empty()) {
+        printf("%-48s no samples\n", name);
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    printf("%-48s p50 %6llu  p90 %6llu  p99 %6llu  p99.9 %7llu  max %8llu ns %10zu\n", name,
+           (unsigned long long) samples[n * 50 / 100], (unsigned long long) samples[n * 90 / 100],
+           (unsigned long long) samples[n * 99 / 100], (unsigned long long) samples[n * 999 / 1000],
+           (unsigned long long) samples[n - 1], n);
+}
+
+static void run_benchmark(Benchmark *benchmark, int64_t arg, int threads) {
+    BenchmarkRun run;
+    run.benchmark = benchmark;
+    run.arg = arg;
+    run.threads = threads;
+    run.iterations = 1;
+
+    uint64_t wall;
+    while (1) {
+        wall = run_once(&run);
+        if (wall >= BENCHMARK_MIN_TIME * 1000000ull || run.iterations >= BENCHMARK_MAX_ITERATIONS) {
+            break;
+        }
+        // aim a little past the minimum, so one more run is usually enough
+        uint64_t next = wall == 0 ? run.iterations * 100
+                : run.iterations * BENCHMARK_MIN_TIME * 1400000ull / wall;
+        run.iterations = std::min(std::max(next, run.iterations * 2), BENCHMARK_MAX_ITERATIONS);
+        for (State *state : run.states) {
+            delete state;
+        }
+    }
+    report(&run, wall);
+    for (State *state : run.states) {
+        delete state;
+    }
+}
+
+// runs every benchmark whose name contains filter, all of them without one
+static inline int run_benchmarks(int argc, char **argv) {
+    const char *filter = argc > 1 ? argv[1] : nullptr;
+    for (Benchmark *benchmark : benchmarks()) {
+        if (filter != nullptr && strstr(benchmark->name, filter) == nullptr) {
+            continue;
+        }
+        std::vector<int> threads = benchmark->threads.empty() ? std::vector<int>{1} : benchmark->threads;
+        std::vector<int64_t> args = benchmark->args.empty() ? std::vector<int64_t>{0} : benchmark->args;
+        for (int64_t arg : args) {
+            for (int count : threads) {
+                run_benchmark(benchmark, arg, count);
+            }
+        }
+    }
+    return 0;
+}
+
+#endif //BENCHMARK_HPP
@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Guard.h"
+#include "HookProxy.h"
+#include "MemoryCache.h"
+#include "LockFreeCache.h"
+#include "AggregateCache.h"
+#include "AllocPool.hpp"
+#include "AddressFilter.hpp"
+#include "thread_stack.h"
+#include "Benchmark.hpp"
+
+//**************************************************************************************************
+#ifndef __ANDROID__
+__thread uint32_t guard GUARD_TLS_MODEL = 0;
+#else
+pthread_key_t guard;
+#endif
+
+#define TRACKED_SIZE 64
+
+static Cache *sCache = nullptr;
+static AllocPool *sPool = nullptr;
+
+static void attach(uint32_t params) {
+    sCache = new MemoryCache(".", ALLOC_STRIPE_SIZE);
+    sCache->reset();
+    filter.reset();
+    update_configs(sCache, params);
+}
+
+static void attach_off(int64_t arg) {
+    attach(0);
+}
+
+static void attach_below(int64_t arg) {
+    attach(ALLOC_MODE | (TRACKED_SIZE * 16));
+}
+
+static void attach_above(int64_t arg) {
+    attach(ALLOC_MODE | (16 << 16) | TRACKED_SIZE);
+}
+
+static void attach_sampled(int64_t arg) {
+    attach(SAMPLE_MODE | ALLOC_MODE | (16 << 16) | 4096);
+}
+
+static void detach(int64_t arg) {
+    update_configs(nullptr, 0);
+    delete sCache;
+    sCache = nullptr;
+}
+
+//**************************************************************************************************
+// malloc and free of the libc, the floor every proxy is compared to
+static void BM_Detached(State &state) {
+    for (auto _ : state) {
+        void *address = malloc(TRACKED_SIZE);
+        DoNotOptimize(address);
+        free(address);
+    }
+}
+BENCHMARK(BM_Detached)->ThreadRange(1, 16);
+
+static void proxy_malloc_free(State &state) {
+    for (auto _ : state) {
+        void *address = malloc_proxy(TRACKED_SIZE);
+        DoNotOptimize(address);
+        free_proxy(address);
+    }
+}
+
+static void BM_ProxyOff(State &state) {
+    proxy_malloc_free(state);
+}
+BENCHMARK(BM_ProxyOff)->Setup(attach_off)->Teardown(detach)->ThreadRange(1, 16);
+
+static void BM_ProxyBelowLimit(State &state) {
+    proxy_malloc_free(state);
+}
+BENCHMARK(BM_ProxyBelowLimit)->Setup(attach_below)->Teardown(detach)->ThreadRange(1, 16);
+
+static void BM_ProxyAboveLimit(State &state) {
+    proxy_malloc_free(state);
+}
+BENCHMARK(BM_ProxyAboveLimit)->Setup(attach_above)->Teardown(detach)->ThreadRange(1, 16);
+
+static void BM_ProxySampled(State &state) {
+    proxy_malloc_free(state);
+}
+BENCHMARK(BM_ProxySampled)->Setup(attach_sampled)->Teardown(detach)->ThreadRange(1, 16);
+
+//**************************************************************************************************
+// arg live blocks are in the cache before the run, so probes and chains have their usual length
+template<typename T>
+static void fill_cache(int64_t arg) {
+    sCache = new T(".");
+    sCache->reset();
+    Backtrace backtrace;
+    backtrace.depth = MAX_TRACE_DEPTH;
+    for (int64_t i = 0; i < arg; i++) {
+        for (uint32_t j = 0; j < MAX_TRACE_DEPTH; j++) {
+            backtrace.trace[j] = 0x10000 + (uintptr_t) ((i % 64) * MAX_TRACE_DEPTH + j) * 4;
+        }
+        sCache->insert(0x100000000ull + (uintptr_t) i * 64, TRACKED_SIZE, &backtrace);
+    }
+}
+
+static void empty_cache(int64_t arg) {
+    delete sCache;
+    sCache = nullptr;
+}
+
+static inline uintptr_t latency_address(State &state, uint64_t i) {
+    return 0x200000000ull + ((uintptr_t) state.thread_index() << 32) + (uintptr_t) (i & 0xFFFFFF) * 64;
+}
+
+static inline void latency_backtrace(Backtrace *backtrace, uint64_t i) {
+    backtrace->depth = MAX_TRACE_DEPTH;
+    for (uint32_t j = 0; j < MAX_TRACE_DEPTH; j++) {
+        backtrace->trace[j] = 0x10000 + (uintptr_t) ((i % 256) * MAX_TRACE_DEPTH + j) * 4;
+    }
+}
+
+static void cache_insert(State &state) {
+    Backtrace backtrace;
+    uint64_t i = 0;
+    for (auto _ : state) {
+        uintptr_t address = latency_address(state, i);
+        latency_backtrace(&backtrace, i++);
+        uint64_t begin = benchmark_now();
+        sCache->insert(address, TRACKED_SIZE, &backtrace);
+        state.sample(benchmark_now() - begin);
+        sCache->remove(address);
+    }
+}
+
+static void cache_remove(State &state) {
+    Backtrace backtrace;
+    uint64_t i = 0;
+    for (auto _ : state) {
+        uintptr_t address = latency_address(state, i);
+        latency_backtrace(&backtrace, i++);
+        sCache->insert(address, TRACKED_SIZE, &backtrace);
+        uint64_t begin = benchmark_now();
+        sCache->remove(address);
+        state.sample(benchmark_now() - begin);
+    }
+}
+
+static void BM_MemoryCacheInsert(State &state) {
+    cache_insert(state);
+}
+BENCHMARK(BM_MemoryCacheInsert)->Setup(fill_cache<MemoryCache>)->Teardown(empty_cache)
+        ->Latency()->Arg(0)->Arg(1 << 18)->Threads(1)->Threads(4);
+
+static void BM_MemoryCacheRemove(State &state) {
+    cache_remove(state);
+}
+BENCHMARK(BM_MemoryCacheRemove)->Setup(fill_cache<MemoryCache>)->Teardown(empty_cache)
+        ->Latency()->Arg(0)->Arg(1 << 18)->Threads(1)->Threads(4);
+
+static void BM_LockFreeCacheInsert(State &state) {
+    cache_insert(state);
+}
+BENCHMARK(BM_LockFreeCacheInsert)->Setup(fill_cache<LockFreeCache>)->Teardown(empty_cache)
+        ->Latency()->Arg(0)->Arg(1 << 16)->Threads(1)->Threads(4);
+
+static void BM_LockFreeCacheRemove(State &state) {
+    cache_remove(state);
+}
+BENCHMARK(BM_LockFreeCacheRemove)->Setup(fill_cache<LockFreeCache>)->Teardown(empty_cache)
+        ->Latency()->Arg(0)->Arg(1 << 16)->Threads(1)->Threads(4);
+
+static void BM_AggregateCacheInsert(State &state) {
+    cache_insert(state);
+}
+BENCHMARK(BM_AggregateCacheInsert)->Setup(fill_cache<AggregateCache>)->Teardown(empty_cache)
+        ->Latency()->Arg(0)->Arg(1 << 18)->Threads(1)->Threads(4);
+
+static void BM_AggregateCacheRemove(State &state) {
+    cache_remove(state);
+}
+BENCHMARK(BM_AggregateCacheRemove)->Setup(fill_cache<AggregateCache>)->Teardown(empty_cache)
+        ->Latency()->Arg(0)->Arg(1 << 18)->Threads(1)->Threads(4);
+
+//**************************************************************************************************
+static void create_pool(int64_t arg) {
+    sPool = new AllocPool(ALLOC_CACHE_LIMIT);
+    sPool->reset();
+}
+
+static void delete_pool(int64_t arg) {
+    delete sPool;
+    sPool = nullptr;
+}
+
+static void BM_AllocPool(State &state) {
+    for (auto _ : state) {
+        AllocNode *node = sPool->apply();
+        DoNotOptimize(node);
+        sPool->recycle(node);
+    }
+}
+BENCHMARK(BM_AllocPool)->Setup(create_pool)->Teardown(delete_pool)->ThreadRange(1, 16);
+
+static void BM_Guard(State &state) {
+    for (auto _ : state) {
+        if (!is_guarded()) {
+            set_guard(true);
+            DoNotOptimize(is_guarded());
+            set_guard(false);
+        }
+    }
+}
+BENCHMARK(BM_Guard)->ThreadRange(1, 16);
+
+static void reset_filter(int64_t arg) {
+    filter.reset();
+}
+
+// most frees are of blocks that were never recorded, only the filter sees them
+static void BM_FilterMiss(State &state) {
+    uintptr_t address = 0x300000000ull + ((uintptr_t) state.thread_index() << 32);
+    for (auto _ : state) {
+        DoNotOptimize(filter.contains(address));
+        address += 64;
+    }
+}
+BENCHMARK(BM_FilterMiss)->Setup(reset_filter)->ThreadRange(1, 16);
+
+//**************************************************************************************************
+// what every stack word read by the armv7 unwinder used to pay, before the bounds were cached
+static void BM_StackBoundsLookup(State &state) {
+    for (auto _ : state) {
+        void *address;
+        size_t size;
+        pthread_attr_t attr;
+        pthread_getattr_np(pthread_self(), &attr);
+        pthread_attr_getstack(&attr, &address, &size);
+        pthread_attr_destroy(&attr);
+        DoNotOptimize(address);
+    }
+}
+BENCHMARK(BM_StackBoundsLookup);
+
+static void BM_StackBoundsCached(State &state) {
+    uintptr_t top, bottom;
+    for (auto _ : state) {
+        DoNotOptimize(get_thread_stack_range(&top, &bottom));
+    }
+}
+BENCHMARK(BM_StackBoundsCached);
+
+// a distinct function per frame, unwind_backtrace folds repeated return addresses into one
+typedef size_t (*Unwinder)(uintptr_t *stack, size_t max_depth);
+
+template<int FRAMES>
+static __attribute__((noinline)) size_t unwind_below(State &state, Unwinder unwind) {
+    size_t depth = unwind_below<FRAMES - 1>(state, unwind);
+    DoNotOptimize(depth);
+    return depth;
+}
+
+template<>
+__attribute__((noinline)) size_t unwind_below<0>(State &state, Unwinder unwind) {
+    uintptr_t trace[MAX_TRACE_DEPTH];
+    size_t depth = 0;
+    for (auto _ : state) {
+        depth = unwind(trace, MAX_TRACE_DEPTH);
+        DoNotOptimize(trace);
+    }
+    return depth;
+}
+
+static void BM_Unwind(State &state) {
+    unwind_below<MAX_TRACE_DEPTH>(state, unwind_backtrace);
+}
+BENCHMARK(BM_Unwind)->ThreadRange(1, 4);
+
+// the benchmark itself is always unwound by its CFI, the tables are compiled by the first run
+static void BM_UnwindCfi(State &state) {
+    unwind_below<MAX_TRACE_DEPTH>(state, unwind_backtrace_cfi);
+}
+BENCHMARK(BM_UnwindCfi)->ThreadRange(1, 4);
+
+// an unbroken chain, so this is the price of checking each return address against the modules
+static size_t unwind_hybrid(uintptr_t *stack, size_t max_depth) {
+    return unwind_backtrace_hybrid(stack, max_depth, false);
+}
+
+static void BM_UnwindHybrid(State &state) {
+    unwind_below<MAX_TRACE_DEPTH>(state, unwind_hybrid);
+}
+BENCHMARK(BM_UnwindHybrid)->ThreadRange(1, 4);
+
+//**************************************************************************************************
+int main(int argc, char **argv) {
+    create_guard();
+    create_sampler();
+#ifndef __arm__
+    init_arm64_unwind();
+#endif
+    printf("%-48s %15s %19s %14s\n", "benchmark", "time", "throughput", "iterations");
+    return run_benchmarks(argc, argv);
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SHIM_ANDROID_API_LEVEL_H
+#define SHIM_ANDROID_API_LEVEL_H
+
+#define __ANDROID_API_N__ 24
+#define __ANDROID_API_O__ 26
+#define __ANDROID_API_Q__ 29
+
+// the host behaves like a current device, so no bionic workaround is taken
+static inline int android_get_device_api_level() {
+    return __ANDROID_API_Q__;
+}
+
+#endif //SHIM_ANDROID_API_LEVEL_H
@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SHIM_ANDROID_LOG_H
+#define SHIM_ANDROID_LOG_H
+
+#include <stdio.h>
+
+// host stand-in used by Logger.h, the tag and priority are dropped
+#define ANDROID_LOG_DEBUG 3
+#define ANDROID_LOG_ERROR 6
+
+#define __android_log_print(priority, tag, fmt, ...) fprintf(stderr, tag ": " fmt "\n", ##__VA_ARGS__)
+
+#endif //SHIM_ANDROID_LOG_H
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <link.h>
+#include <stddef.h>
+
+// the benchmarks call the proxies directly, nothing is hooked, modules come from the host linker
+void A64HookFunction(void *const symbol, void *const replace, void **result) {}
+
+int xh_core_register(const char *pathname_regex_str, const char *symbol, void *new_func, void **old_func) {
+    return 0;
+}
+
+int xh_core_ignore(const char *pathname_regex_str, const char *symbol) {
+    return 0;
+}
+
+int xh_core_refresh(int async) {
+    return 0;
+}
+
+void xh_core_clear() {}
+
+void *xdl_open(const char *filename) {
+    return NULL;
+}
+
+void xdl_close(void *handle) {}
+
+void *xdl_sym(void *handle, const char *symbol) {
+    return NULL;
+}
+
+int xdl_addr(void *addr, Dl_info *info, void **cache) {
+    return dladdr(addr, info);
+}
+
+void xdl_addr_clean(void **cache) {}
+
+int xdl_iterate_phdr(int (*callback)(struct dl_phdr_info *, size_t, void *), void *data, int flags) {
+    return dl_iterate_phdr(callback, data);
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SHIM_JNI_H
+#define SHIM_JNI_H
+
+#include <stdint.h>
+
+// only what the headers under benchmark mention, nothing calls into a VM
+typedef int32_t jint;
+typedef uint8_t jboolean;
+typedef void *  jobject;
+typedef jobject jstring;
+
+struct JNIEnv {
+    const char *GetStringUTFChars(jstring string, jboolean *copy) { return (const char *) string; }
+    void ReleaseStringUTFChars(jstring string, const char *chars) {}
+};
+
+#endif //SHIM_JNI_H
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ADDRESS_FILTER_H
+#define ADDRESS_FILTER_H
+
+#include <atomic>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define FILTER_INDEX_BITS 20
+#define FILTER_INDEX_SIZE (1 << FILTER_INDEX_BITS)
+#define FILTER_STICKY     0xFF
+
+/**
+ * Counting filter of the recorded addresses, one byte per hash bucket. A zero counter proves the
+ * address was never recorded, so free() of an untracked block costs a single load. Counters that
+ * reach FILTER_STICKY stay there, they may only answer "maybe" from then on.
+ */
+class AddressFilter {
+public:
+    AddressFilter() {
+        void *counters = mmap(nullptr, FILTER_INDEX_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        mCounters = (std::atomic<uint8_t> *) (counters == MAP_FAILED ? nullptr : counters);
+    }
+
+    ~AddressFilter() {
+        if (mCounters != nullptr) {
+            munmap(mCounters, FILTER_INDEX_SIZE);
+        }
+    }
+public:
+    void reset() {
+        if (mCounters != nullptr) {
+            madvise(mCounters, FILTER_INDEX_SIZE, MADV_DONTNEED);
+        }
+    }
+
+    // without its counters the filter answers "maybe" for every address
+    bool contains(uintptr_t address) {
+        return mCounters == nullptr || mCounters[hash(address)].load(std::memory_order_acquire) != 0;
+    }
+
+    void add(uintptr_t address) {
+        if (mCounters == nullptr) {
+            return;
+        }
+        std::atomic<uint8_t> *counter = &mCounters[hash(address)];
+        uint8_t count = counter->load(std::memory_order_relaxed);
+        while (count != FILTER_STICKY
+               && !counter->compare_exchange_weak(count, count + 1, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // only for an address that was added and actually removed from the cache
+    void del(uintptr_t address) {
+        if (mCounters == nullptr) {
+            return;
+        }
+        std::atomic<uint8_t> *counter = &mCounters[hash(address)];
+        uint8_t count = counter->load(std::memory_order_relaxed);
+        while (count != FILTER_STICKY && count != 0
+               && !counter->compare_exchange_weak(count, count - 1, std::memory_order_relaxed, std::memory_order_relaxed));
+    }
+private:
+    static inline uint32_t hash(uintptr_t address) {
+        return ((uint32_t) (address >> ADDR_HASH_OFFSET) * 0x9E3779B1u) >> (32 - FILTER_INDEX_BITS);
+    }
+private:
+    std::atomic<uint8_t> *mCounters;
+};
+
+#endif //ADDRESS_FILTER_H
@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <vector>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <xdl.h>
+
+#include "Logger.h"
+#include "MemoryCache.h"
+#include "AggregateCache.h"
+#include "BinaryReport.h"
+
+//**************************************************************************************************
+static inline uint32_t site_hash(uint32_t stack) {
+    return (stack * 0x9E3779B1u) >> (32 - SITE_INDEX_BITS);
+}
+
+// stripes take the low bits of the address like MemoryCache, the bits above pick the slot. Four
+// neighbouring blocks of a stripe share one cache line of slots, as allocators hand out a size
+// class in order, the lines themselves are scattered so that dense ranges don't pile up
+static inline uint32_t block_hash(uintptr_t address, uint shift) {
+    uintptr_t key = address >> (ADDR_HASH_OFFSET + shift);
+    return (uint32_t) (((uint64_t) (key >> 2) * 0x9E3779B97F4A7C15ull) >> 32) << 2 | (uint32_t) (key & 3);
+}
+
+static SiteBlock *map_blocks(uint32_t slots) {
+    void *blocks = mmap(nullptr, slots * sizeof(SiteBlock), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (SiteBlock *) (blocks == MAP_FAILED ? nullptr : blocks);
+}
+
+static void unmap_blocks(SiteMap *map) {
+    if (map->blocks != nullptr) {
+        munmap(map->blocks, (map->mask + 1) * sizeof(SiteBlock));
+    }
+    map->blocks = nullptr;
+    map->mask = 0;
+    map->count = 0;
+}
+
+AggregateCache::AggregateCache(const char *space, uint stripes) : Cache(space) {
+    alloc_depot = new StackDepot();
+    alloc_stripes = new SiteStripe[stripes];
+    alloc_mask = stripes - 1;
+    alloc_shift = __builtin_ctz(stripes);
+    for (uint i = 0; i < stripes; i++) {
+        pthread_mutex_init(&alloc_stripes[i].map.mutex, NULL);
+        alloc_stripes[i].map.blocks = nullptr;
+        alloc_stripes[i].map.mask = 0;
+        alloc_stripes[i].map.count = 0;
+    }
+    void *sites = mmap(nullptr, SITE_INDEX_SIZE * sizeof(CallSite), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    alloc_sites = (CallSite *) (sites == MAP_FAILED ? nullptr : sites);
+}
+
+AggregateCache::~AggregateCache() {
+    for (uint i = 0; i <= alloc_mask; i++) {
+        unmap_blocks(&alloc_stripes[i].map);
+        pthread_mutex_destroy(&alloc_stripes[i].map.mutex);
+    }
+    delete[] alloc_stripes;
+    delete alloc_depot;
+    if (alloc_sites != nullptr) {
+        munmap(alloc_sites, SITE_INDEX_SIZE * sizeof(CallSite));
+    }
+}
+
+void AggregateCache::reset() {
+    alloc_depot->reset();
+    for (uint i = 0; i <= alloc_mask; i++) {
+        unmap_blocks(&alloc_stripes[i].map);
+    }
+    if (alloc_sites != nullptr) {
+        madvise(alloc_sites, SITE_INDEX_SIZE * sizeof(CallSite), MADV_DONTNEED);
+    }
+}
+
+bool AggregateCache::insert(uintptr_t address, size_t size, Backtrace *backtrace) {
+    uint depth = backtrace->depth > 2 ? backtrace->depth - 2 : 1;
+    uint32_t stack = alloc_depot->intern(backtrace->trace + 2, depth);
+    CallSite *site = stack == 0 ? nullptr : site_of(stack, true);
+    if (site == nullptr) {
+        return false;
+    }
+
+    SiteBlock block = {address, stack, (uint32_t) size};
+    SiteBlock replaced = {0, 0, 0};
+    SiteMap *map = map_of(address);
+    pthread_mutex_lock(&map->mutex);
+    bool recorded = put(map, block, &replaced);
+    pthread_mutex_unlock(&map->mutex);
+    if (!recorded) {
+        LOGGER("Site map is full!!!!!!!!");
+        return false;
+    }
+
+    // a free that was never seen, the block it left behind is no longer live
+    CallSite *stale = replaced.addr == 0 ? nullptr : site_of(replaced.stack, false);
+    if (stale != nullptr) {
+        stale->count.fetch_sub(1, std::memory_order_relaxed);
+        stale->size.fetch_sub(replaced.size, std::memory_order_relaxed);
+    }
+
+    site->count.fetch_add(1, std::memory_order_relaxed);
+    site->total.fetch_add(size, std::memory_order_relaxed);
+    uint64_t live = site->size.fetch_add(size, std::memory_order_relaxed) + size;
+    uint64_t peak = site->peak.load(std::memory_order_relaxed);
+    while (live > peak && !site->peak.compare_exchange_weak(peak, live, std::memory_order_relaxed, std::memory_order_relaxed));
+    return true;
+}
+
+bool AggregateCache::remove(uintptr_t address) {
+    SiteMap *map = map_of(address);
+    if (__atomic_load_n(&map->count, __ATOMIC_RELAXED) == 0) {
+        return false;
+    }
+
+    SiteBlock block;
+    pthread_mutex_lock(&map->mutex);
+    bool found = take(map, address, &block);
+    pthread_mutex_unlock(&map->mutex);
+    if (!found) {
+        return false;
+    }
+
+    CallSite *site = site_of(block.stack, false);
+    if (site != nullptr) {
+        site->count.fetch_sub(1, std::memory_order_relaxed);
+        site->size.fetch_sub(block.size, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+SiteMap *AggregateCache::map_of(uintptr_t address) {
+    return &alloc_stripes[(address >> ADDR_HASH_OFFSET) & alloc_mask].map;
+}
+
+// must hold the map's mutex, replaced is the block that was still recorded at the address
+bool AggregateCache::put(SiteMap *map, const SiteBlock &block, SiteBlock *replaced) {
+    if ((map->count + 1) * 4 > (map->mask + 1) * 3 && !grow(map)) {
+        return false;
+    }
+    uint32_t i = block_hash(block.addr, alloc_shift) & map->mask;
+    for (; map->blocks[i].addr != 0; i = (i + 1) & map->mask) {
+        if (map->blocks[i].addr == block.addr) {
+            *replaced = map->blocks[i];
+            map->blocks[i] = block;
+            return true;
+        }
+    }
+    map->blocks[i] = block;
+    __atomic_store_n(&map->count, map->count + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+// must hold the map's mutex, later blocks of the probe are shifted back, so no tombstone is left
+bool AggregateCache::take(SiteMap *map, uintptr_t address, SiteBlock *taken) {
+    if (map->blocks == nullptr) {
+        return false;
+    }
+    uint32_t i = block_hash(address, alloc_shift) & map->mask;
+    for (; map->blocks[i].addr != address; i = (i + 1) & map->mask) {
+        if (map->blocks[i].addr == 0) {
+            return false;
+        }
+    }
+    *taken = map->blocks[i];
+    for (uint32_t j = i;;) {
+        map->blocks[i].addr = 0;
+        uint32_t home;
+        do {
+            j = (j + 1) & map->mask;
+            if (map->blocks[j].addr == 0) {
+                __atomic_store_n(&map->count, map->count - 1, __ATOMIC_RELAXED);
+                return true;
+            }
+            home = block_hash(map->blocks[j].addr, alloc_shift) & map->mask;
+            // j stays while its home is in (i, j], cyclically
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        map->blocks[i] = map->blocks[j];
+        i = j;
+    }
+}
+
+bool AggregateCache::grow(SiteMap *map) {
+    uint32_t slots = map->blocks == nullptr ? SITE_MAP_INITIAL : (map->mask + 1) * 2;
+    SiteBlock *blocks = map_blocks(slots);
+    if (blocks == nullptr) {
+        return false;
+    }
+    uint32_t mask = slots - 1;
+    for (uint32_t i = 0; map->blocks != nullptr && i <= map->mask; i++) {
+        if (map->blocks[i].addr == 0) {
+            continue;
+        }
+        uint32_t j = block_hash(map->blocks[i].addr, alloc_shift) & mask;
+        while (blocks[j].addr != 0) {
+            j = (j + 1) & mask;
+        }
+        blocks[j] = map->blocks[i];
+    }
+    uint32_t count = map->count;
+    unmap_blocks(map);
+    map->blocks = blocks;
+    map->mask = mask;
+    map->count = count;
+    return true;
+}
+
+CallSite *AggregateCache::site_of(uint32_t stack, bool create) {
+    if (alloc_sites == nullptr) {
+        return nullptr;
+    }
+    uint32_t hash = site_hash(stack);
+    for (uint i = 0; i < SITE_PROBE_SIZE; i++) {
+        CallSite *site = &alloc_sites[(hash + i) & (SITE_INDEX_SIZE - 1)];
+        uint32_t key = site->stack.load(std::memory_order_acquire);
+        if (key == stack) {
+            return site;
+        } else if (key != 0) {
+            continue;
+        } else if (!create) {
+            return nullptr;
+        }
+        // sites are never released before reset, a lost race may still be for the same stack
+        if (site->stack.compare_exchange_strong(key, stack, std::memory_order_acq_rel, std::memory_order_acquire) || key == stack) {
+            return site;
+        }
+    }
+    if (create) {
+        LOGGER("Call site table is full!!!!!!!!");
+    }
+    return nullptr;
+}
+
+void AggregateCache::print() {
+    char path[MAX_BUFFER_SIZE];
+    sprintf(path, mBinary ? "%s/report.bin" : "%s/report", mSpace);
+
+    FILE *report = fopen(path, mBinary ? "wb" : "w");
+    if (report == nullptr) {
+        LOGGER("print report failed, can't open report file");
+        return;
+    }
+    std::vector<ReportSite> records;
+
+    // counters are read one by one without a lock, a site may be off by the calls in flight
+    for (uint i = 0; alloc_sites != nullptr && i < SITE_INDEX_SIZE; i++) {
+        CallSite *site = &alloc_sites[i];
+        ReportSite record;
+        record.stack = site->stack.load(std::memory_order_acquire);
+        record.count = site->count.load(std::memory_order_relaxed);
+        if (record.stack == 0 || record.count == 0) {
+            continue;
+        }
+        record.size = site->size.load(std::memory_order_relaxed);
+        record.total = site->total.load(std::memory_order_relaxed);
+        record.peak = site->peak.load(std::memory_order_relaxed);
+        records.push_back(record);
+    }
+    std::sort(records.begin(), records.end(), [](const ReportSite &a, const ReportSite &b) {
+        return a.size > b.size;
+    });
+
+    if (mBinary) {
+        write_binary(report, alloc_depot, records.data(), records.size());
+        fclose(report);
+        return;
+    }
+
+    void *dl_cache = nullptr;
+    char *buffer = (char *) malloc(MAX_TRACE_DEPTH * MAX_BUFFER_SIZE);
+    for (auto &record : records) {
+        const uintptr_t *trace;
+        uint32_t depth = alloc_depot->fetch(record.stack, &trace);
+        write_trace(buffer, MAX_TRACE_DEPTH * MAX_BUFFER_SIZE, trace, depth, &dl_cache);
+        fprintf(report, STACK_FORMAT_SITE, record.stack, (unsigned long long) record.size, record.count,
+                (unsigned long long) record.total, (unsigned long long) record.peak);
+        fputs(buffer, report);
+    }
+    free(buffer);
+    xdl_addr_clean(&dl_cache);
+
+    fclose(report);
+}
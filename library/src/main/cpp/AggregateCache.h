@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AGGREGATE_CACHE_H
+#define AGGREGATE_CACHE_H
+
+#include <atomic>
+#include <pthread.h>
+
+#include "Cache.h"
+#include "StackDepot.h"
+
+#define SITE_INDEX_BITS 14
+#define SITE_INDEX_SIZE (1 << SITE_INDEX_BITS)
+#define SITE_PROBE_SIZE 64
+
+// slots of a stripe's address map when it is first used, 4KB on LP64
+#define SITE_MAP_INITIAL 256
+
+typedef struct {
+    std::atomic<uint32_t> stack;
+    std::atomic<uint32_t> count;
+    std::atomic<uint64_t> size;
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> peak;
+} CallSite;
+
+// a live block, only what its free needs to find the call site
+typedef struct {
+    uintptr_t addr;       // 0 is an empty slot
+    uint32_t  stack;
+    uint32_t  size;
+} SiteBlock;
+
+// open-addressed by address, mmap'ed, doubled when 3/4 full
+typedef struct {
+    pthread_mutex_t mutex;
+    SiteBlock *     blocks;
+    uint32_t        mask;
+    uint32_t        count;
+} SiteMap;
+
+typedef union {
+    SiteMap map;
+    char    align[64];
+} SiteStripe;
+
+/**
+ * Keeps live bytes, live count, total and peak bytes per call stack. Blocks are only kept as
+ * address, stack id and size, so that a free decrements the right call site, the stacks are
+ * interned once in the depot. print() writes one record per call site, largest live size first.
+ */
+class AggregateCache : public Cache {
+public:
+    AggregateCache(const char *space, uint stripes = 1);
+    ~AggregateCache();
+public:
+    void reset();
+    bool insert(uintptr_t address, size_t size, Backtrace *backtrace);
+    bool remove(uintptr_t address);
+    void print();
+private:
+    CallSite *site_of(uint32_t stack, bool create);
+    SiteMap *map_of(uintptr_t address);
+    bool put(SiteMap *map, const SiteBlock &block, SiteBlock *replaced);
+    bool take(SiteMap *map, uintptr_t address, SiteBlock *taken);
+    bool grow(SiteMap *map);
+private:
+    SiteStripe *alloc_stripes;
+    uint alloc_mask;
+    uint alloc_shift;
+    StackDepot *alloc_depot;
+    CallSite *alloc_sites;
+};
+
+#endif //AGGREGATE_CACHE_H
@@ -19,55 +19,362 @@
 
 #include <atomic>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 //**************************************************************************************************
+#define SEGMENT_HEAD_SIZE 64
+#define SEGMENT_NODE_SIZE ((ALLOC_SEGMENT_SIZE - SEGMENT_HEAD_SIZE) / sizeof(AllocNode))
+
+// state word of a segment: free head (offset + 1) | bumped | freed | tag | status
+#define SEGMENT_HEAD(s)   ((uint32_t) ((s) & 0xFFFF))
+#define SEGMENT_BUMP(s)   ((uint32_t) (((s) >> 16) & 0xFFFF))
+#define SEGMENT_FREE(s)   ((uint32_t) (((s) >> 32) & 0xFFFF))
+#define SEGMENT_TAG(s)    ((uint32_t) (((s) >> 48) & 0x3FFF))
+#define SEGMENT_STATUS(s) ((uint32_t) ((s) >> 62))
+#define SEGMENT_STATE(head, bump, free, tag, status) \
+    ((uint64_t) (head) | ((uint64_t) (bump) << 16) | ((uint64_t) (free) << 32) \
+    | ((uint64_t) ((tag) & 0x3FFF) << 48) | ((uint64_t) (status) << 62))
+
+#define MAGAZINE_SIZE 32
+
+#define SEGMENT_ACTIVE   0
+#define SEGMENT_RETIRING 1
+#define SEGMENT_RETIRED  2
+
+class AllocPool;
+
+/**
+ * A segment is one ALLOC_SEGMENT_SIZE aligned mapping, so the segment of any node is found by
+ * masking its address. All of its bookkeeping lives in a single 64-bit state word, the tag makes
+ * the free stack immune to ABA and lets a fully free segment be retired by one CAS.
+ */
+struct AllocSegment {
+    std::atomic<uint64_t> state;
+    uint32_t              index;
+    AllocNode             nodes[0] __attribute__((aligned(SEGMENT_HEAD_SIZE)));
+};
+
+/**
+ * Free nodes cached by one thread, so that most apply/recycle calls touch no shared cache line.
+ * Magazines are never freed while the pool lives, a thread that exits hands its one back.
+ */
+struct AllocMagazine {
+    AllocPool *           pool;
+    AllocMagazine *       link;
+    std::atomic<bool>     owned;
+    uint32_t              epoch;
+    uint32_t              count;
+    AllocNode *           nodes[MAGAZINE_SIZE];
+};
+
 class AllocPool {
 public:
-    AllocPool(size_t count) {
-        mCache = (AllocNode *) malloc(count * sizeof(AllocNode));
-        mCount = count;
+    AllocPool(size_t limit) {
+        mLimit = (uint32_t) ((limit + SEGMENT_NODE_SIZE - 1) / SEGMENT_NODE_SIZE);
+        mLimit = mLimit > ALLOC_SEGMENT_MAX ? ALLOC_SEGMENT_MAX : mLimit;
+        mCount.store(0, std::memory_order_relaxed);
+        mHint.store(0, std::memory_order_relaxed);
+        mEpoch.store(0, std::memory_order_relaxed);
+        mMagazines.store(nullptr, std::memory_order_relaxed);
+        for (uint i = 0; i < ALLOC_SEGMENT_MAX; i++) {
+            mSegments[i].store(nullptr, std::memory_order_relaxed);
+        }
+        mKeyed = pthread_key_create(&mKey, detach) == 0;
     }
 
     ~AllocPool() {
-        free(mCache);
-        mCache = nullptr;
+        if (mKeyed) {
+            pthread_key_delete(mKey);
+        }
+        AllocMagazine *magazine = mMagazines.load(std::memory_order_relaxed);
+        while (magazine != nullptr) {
+            AllocMagazine *link = magazine->link;
+            free(magazine);
+            magazine = link;
+        }
+        for (uint i = 0; i < ALLOC_SEGMENT_MAX; i++) {
+            AllocSegment *segment = mSegments[i].load(std::memory_order_relaxed);
+            if (segment != nullptr) {
+                munmap(segment, ALLOC_SEGMENT_SIZE);
+            }
+        }
     }
 public:
     void reset() {
-        mIndex.store(0, std::memory_order_relaxed);
-        mStack.store(nullptr, std::memory_order_relaxed);
+        // magazines filled before the reset notice the new epoch and drop their nodes
+        mEpoch.fetch_add(1, std::memory_order_relaxed);
+        uint count = mCount.load(std::memory_order_relaxed);
+        for (uint i = 0; i < count; i++) {
+            mSegments[i].load(std::memory_order_relaxed)->state.store(0, std::memory_order_relaxed);
+        }
+        mHint.store(0, std::memory_order_relaxed);
     }
 
     AllocNode* apply() {
-        AllocNode *p = mStack.load(std::memory_order_relaxed);
-        while (p != nullptr) {
-            if (mStack.compare_exchange_weak(p, p->next, std::memory_order_release, std::memory_order_relaxed)) {
-                return p;
+        AllocMagazine *magazine = magazine_of_thread();
+        if (magazine == nullptr) {
+            AllocNode *p;
+            return fetch(&p, 1) == 0 ? nullptr : p;
+        }
+        if (magazine->count == 0) {
+            magazine->count = fetch(magazine->nodes, MAGAZINE_SIZE / 2);
+            if (magazine->count == 0) {
+                return nullptr;
             }
         }
+        return magazine->nodes[--magazine->count];
+    }
 
-        uint ii = mIndex.load(std::memory_order_relaxed);
-        while (ii < mCount) {
-            if (mIndex.compare_exchange_weak(ii, ii + 1, std::memory_order_release, std::memory_order_relaxed)) {
-                return mCache + ii;
+    uint32_t index(AllocNode *p) {
+        AllocSegment *segment = owner(p);
+        return segment->index * SEGMENT_NODE_SIZE + (uint32_t) (p - segment->nodes);
+    }
+
+    AllocNode* at(uint32_t index) {
+        return mSegments[index / SEGMENT_NODE_SIZE].load(std::memory_order_relaxed)->nodes + index % SEGMENT_NODE_SIZE;
+    }
+
+    void recycle(AllocNode *p) {
+        AllocMagazine *magazine = magazine_of_thread();
+        if (magazine == nullptr) {
+            release(&p, 1);
+            return;
+        }
+        if (magazine->count == MAGAZINE_SIZE) {
+            // the oldest half goes back, the most recently freed nodes stay warm
+            release(magazine->nodes, MAGAZINE_SIZE / 2);
+            memmove(magazine->nodes, magazine->nodes + MAGAZINE_SIZE / 2, (MAGAZINE_SIZE / 2) * sizeof(AllocNode *));
+            magazine->count = MAGAZINE_SIZE / 2;
+        }
+        magazine->nodes[magazine->count++] = p;
+    }
+private:
+    AllocMagazine* magazine_of_thread() {
+        if (!mKeyed) {
+            return nullptr;
+        }
+        uint32_t epoch = mEpoch.load(std::memory_order_relaxed);
+        AllocMagazine *magazine = (AllocMagazine *) pthread_getspecific(mKey);
+        if (magazine == nullptr) {
+            magazine = adopt();
+            if (magazine == nullptr) {
+                return nullptr;
+            }
+            magazine->epoch = epoch;
+            pthread_setspecific(mKey, magazine);
+        } else if (magazine->epoch != epoch) {
+            magazine->epoch = epoch;
+            magazine->count = 0;
+        }
+        return magazine;
+    }
+
+    AllocMagazine* adopt() {
+        AllocMagazine *magazine = mMagazines.load(std::memory_order_acquire);
+        for (; magazine != nullptr; magazine = magazine->link) {
+            bool owned = false;
+            if (!magazine->owned.load(std::memory_order_relaxed)
+                && magazine->owned.compare_exchange_strong(owned, true, std::memory_order_acquire, std::memory_order_relaxed)) {
+                magazine->count = 0;
+                return magazine;
             }
         }
 
-        return nullptr;
+        magazine = (AllocMagazine *) calloc(1, sizeof(AllocMagazine));
+        if (magazine == nullptr) {
+            return nullptr;
+        }
+        magazine->pool = this;
+        magazine->owned.store(true, std::memory_order_relaxed);
+        magazine->link = mMagazines.load(std::memory_order_relaxed);
+        while (!mMagazines.compare_exchange_weak(magazine->link, magazine, std::memory_order_release, std::memory_order_relaxed));
+        return magazine;
     }
 
-    void recycle(AllocNode *p) {
-        p->next = mStack.load(std::memory_order_relaxed);
+    static void detach(void *arg) {
+        AllocMagazine *magazine = (AllocMagazine *) arg;
+        AllocPool *pool = magazine->pool;
+        if (magazine->epoch == pool->mEpoch.load(std::memory_order_relaxed)) {
+            pool->release(magazine->nodes, magazine->count);
+        }
+        magazine->count = 0;
+        magazine->owned.store(false, std::memory_order_release);
+    }
+
+    uint32_t fetch(AllocNode **nodes, uint32_t count) {
+        uint segments = mCount.load(std::memory_order_acquire);
+        uint hint = mHint.load(std::memory_order_relaxed);
+        for (uint i = hint; i < segments; i++) {
+            uint32_t fetched = apply(mSegments[i].load(std::memory_order_relaxed), nodes, count);
+            if (fetched != 0) {
+                if (i != hint) {
+                    mHint.store(i, std::memory_order_relaxed);
+                }
+                return fetched;
+            }
+        }
+
+        // every published segment is in use, publish a new one unless the ceiling is reached
+        while (segments < mLimit) {
+            AllocSegment *segment = mSegments[segments].load(std::memory_order_acquire);
+            if (segment == nullptr) {
+                AllocSegment *created = create(segments);
+                if (created == nullptr) {
+                    return 0;
+                }
+                if (mSegments[segments].compare_exchange_strong(segment, created, std::memory_order_release, std::memory_order_acquire)) {
+                    segment = created;
+                } else {
+                    munmap(created, ALLOC_SEGMENT_SIZE);
+                }
+            }
+            mCount.compare_exchange_strong(segments, segments + 1, std::memory_order_release, std::memory_order_relaxed);
+
+            uint32_t fetched = apply(segment, nodes, count);
+            if (fetched != 0) {
+                return fetched;
+            }
+            segments = mCount.load(std::memory_order_acquire);
+        }
+
+        return 0;
+    }
+
+    void release(AllocNode **nodes, uint32_t count) {
+        // nodes of the same segment are chained and pushed with a single CAS
+        for (uint32_t i = 0; i < count; i++) {
+            if (nodes[i] == nullptr) {
+                continue;
+            }
+            AllocSegment *segment = owner(nodes[i]);
+            AllocNode *first = nodes[i];
+            AllocNode *last = first;
+            uint32_t chained = 1;
+            for (uint32_t j = i + 1; j < count; j++) {
+                if (nodes[j] != nullptr && owner(nodes[j]) == segment) {
+                    last->next = nodes[j];
+                    last = nodes[j];
+                    nodes[j] = nullptr;
+                    chained++;
+                }
+            }
+            recycle(segment, first, last, chained);
+        }
+    }
+
+    void recycle(AllocSegment *segment, AllocNode *first, AllocNode *last, uint32_t count) {
+        uint32_t offset = (uint32_t) (first - segment->nodes) + 1;
+        uint64_t state = segment->state.load(std::memory_order_relaxed);
+        uint64_t value;
         while (1) {
-            if (mStack.compare_exchange_weak(p->next, p, std::memory_order_release, std::memory_order_relaxed)) {
-                return;
+            uint32_t head = SEGMENT_HEAD(state);
+            last->next = head == 0 ? nullptr : segment->nodes + head - 1;
+            value = SEGMENT_STATE(offset, SEGMENT_BUMP(state), SEGMENT_FREE(state) + count, SEGMENT_TAG(state) + 1, SEGMENT_ACTIVE);
+            if (segment->state.compare_exchange_weak(state, value, std::memory_order_release, std::memory_order_relaxed)) {
+                break;
             }
         }
+
+        if (segment->index < mHint.load(std::memory_order_relaxed)) {
+            mHint.store(segment->index, std::memory_order_relaxed);
+        }
+
+        // the first segment is kept, any other one goes back to the system once nothing lives in it
+        if (segment->index != 0 && SEGMENT_FREE(value) == SEGMENT_BUMP(value)) {
+            retire(segment, value);
+        }
+    }
+
+    static AllocSegment* owner(AllocNode *p) {
+        return (AllocSegment *) ((uintptr_t) p & ~((uintptr_t) ALLOC_SEGMENT_SIZE - 1));
+    }
+
+    static AllocSegment* create(uint32_t index) {
+        // over-map, then trim to an ALLOC_SEGMENT_SIZE aligned window
+        void *address = mmap(nullptr, ALLOC_SEGMENT_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (address == MAP_FAILED) {
+            return nullptr;
+        }
+        uintptr_t start = (uintptr_t) address;
+        uintptr_t aligned = (start + ALLOC_SEGMENT_SIZE - 1) & ~((uintptr_t) ALLOC_SEGMENT_SIZE - 1);
+        if (aligned != start) {
+            munmap(address, aligned - start);
+        }
+        munmap((void *) (aligned + ALLOC_SEGMENT_SIZE), start + ALLOC_SEGMENT_SIZE - aligned);
+
+        AllocSegment *segment = (AllocSegment *) aligned;
+        segment->state.store(0, std::memory_order_relaxed);
+        segment->index = index;
+        return segment;
+    }
+
+    static uint32_t apply(AllocSegment *segment, AllocNode **nodes, uint32_t count) {
+        uint64_t state = segment->state.load(std::memory_order_acquire);
+        while (1) {
+            uint32_t status = SEGMENT_STATUS(state);
+            uint32_t tag = SEGMENT_TAG(state) + 1;
+            if (status == SEGMENT_RETIRING) {
+                return 0;
+            } else if (status == SEGMENT_RETIRED) {
+                if (segment->state.compare_exchange_weak(state, SEGMENT_STATE(0, count, 0, tag, SEGMENT_ACTIVE), std::memory_order_acquire, std::memory_order_acquire)) {
+                    for (uint32_t i = 0; i < count; i++) {
+                        nodes[i] = segment->nodes + i;
+                    }
+                    return count;
+                }
+                continue;
+            }
+
+            uint32_t head = SEGMENT_HEAD(state);
+            uint32_t bump = SEGMENT_BUMP(state);
+            uint32_t free = SEGMENT_FREE(state);
+            if (head != 0) {
+                // links may be stale if nodes are popped concurrently, the tag then fails the CAS
+                uint32_t taken = 0;
+                while (head != 0 && head <= SEGMENT_NODE_SIZE && taken < count && taken < free) {
+                    AllocNode *p = segment->nodes + head - 1;
+                    AllocNode *next = p->next;
+                    nodes[taken++] = p;
+                    head = next == nullptr ? 0 : ((uint32_t) (next - segment->nodes) + 1) & 0xFFFF;
+                }
+                if (segment->state.compare_exchange_weak(state, SEGMENT_STATE(head, bump, free - taken, tag, SEGMENT_ACTIVE), std::memory_order_acquire, std::memory_order_acquire)) {
+                    return taken;
+                }
+            } else if (bump < SEGMENT_NODE_SIZE) {
+                uint32_t taken = SEGMENT_NODE_SIZE - bump < count ? SEGMENT_NODE_SIZE - bump : count;
+                if (segment->state.compare_exchange_weak(state, SEGMENT_STATE(0, bump + taken, free, tag, SEGMENT_ACTIVE), std::memory_order_acquire, std::memory_order_acquire)) {
+                    for (uint32_t i = 0; i < taken; i++) {
+                        nodes[i] = segment->nodes + bump + i;
+                    }
+                    return taken;
+                }
+            } else {
+                return 0;
+            }
+        }
+    }
+
+    static void retire(AllocSegment *segment, uint64_t state) {
+        uint32_t tag = SEGMENT_TAG(state) + 1;
+        if (!segment->state.compare_exchange_strong(state, SEGMENT_STATE(0, 0, 0, tag, SEGMENT_RETIRING), std::memory_order_acquire, std::memory_order_relaxed)) {
+            return;
+        }
+        // nobody can pop or revive a retiring segment, so its pages are dropped safely
+        size_t page = (size_t) getpagesize();
+        madvise((char *) segment + page, ALLOC_SEGMENT_SIZE - page, MADV_DONTNEED);
+        segment->state.store(SEGMENT_STATE(0, 0, 0, tag + 1, SEGMENT_RETIRED), std::memory_order_release);
     }
 private:
-    AllocNode *              mCache;
-    size_t                   mCount;
-    std::atomic<uint>        mIndex;
-    std::atomic<AllocNode *> mStack;
+    uint32_t                     mLimit;
+    bool                         mKeyed;
+    pthread_key_t                mKey;
+    std::atomic<uint>            mCount;
+    std::atomic<uint>            mHint;
+    std::atomic<uint32_t>        mEpoch;
+    std::atomic<AllocMagazine *> mMagazines;
+    std::atomic<AllocSegment *>  mSegments[ALLOC_SEGMENT_MAX];
 };
 //**************************************************************************************************
-#endif //NODE_POOL_H
\ No newline at end of file
+#endif //NODE_POOL_H
@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <ctime>
+#include <cstdlib>
+#include <cstring>
+#include <sched.h>
+
+#ifdef __arm__
+#include "backtrace.h"
+#else
+#include "backtrace_64.h"
+#endif
+
+#include "Logger.h"
+#include "AsyncUnwinder.h"
+#include "Guard.h"
+
+// frames of the capture itself in front of the ones a synchronous unwind returns
+#ifdef __arm__
+#define CAPTURE_SKIP 2
+#else
+#define CAPTURE_SKIP 1
+#endif
+
+//**************************************************************************************************
+static inline uint32_t pending_hash(uintptr_t address) {
+    return ((uint32_t) (address >> ADDR_HASH_OFFSET) * 0x9E3779B1u) >> (32 - ASYNC_INDEX_BITS);
+}
+
+AsyncUnwinder::AsyncUnwinder(void (*record)(uintptr_t, size_t, Backtrace *)) {
+    mRecord = record;
+    mBatches.store(nullptr, std::memory_order_relaxed);
+    mPending = new std::atomic<uint16_t>[ASYNC_INDEX_SIZE];
+    for (uint i = 0; i < ASYNC_INDEX_SIZE; i++) {
+        mPending[i].store(0, std::memory_order_relaxed);
+    }
+    mUnwinding.store(0, std::memory_order_relaxed);
+    pthread_mutex_init(&mMutex, NULL);
+    mScratch = (StackCapture *) malloc(sizeof(StackCapture));
+    mRunning.store(false, std::memory_order_relaxed);
+    mDeferred.store(0, std::memory_order_relaxed);
+    mInPlace.store(0, std::memory_order_relaxed);
+    mKeyed = pthread_key_create(&mKey, detach) == 0;
+}
+
+AsyncUnwinder::~AsyncUnwinder() {
+    stop();
+    if (mKeyed) {
+        pthread_key_delete(mKey);
+    }
+    CaptureBatch *batch = mBatches.load(std::memory_order_relaxed);
+    while (batch != nullptr) {
+        CaptureBatch *link = batch->link;
+        free(batch);
+        batch = link;
+    }
+    free(mScratch);
+    delete[] mPending;
+    pthread_mutex_destroy(&mMutex);
+}
+
+bool AsyncUnwinder::start() {
+    if (mScratch == nullptr || !mKeyed) {
+        return false;
+    }
+    mRunning.store(true, std::memory_order_release);
+    if (pthread_create(&mThread, nullptr, loop, this) != 0) {
+        LOGGER("async unwind failed, can't create worker");
+        mRunning.store(false, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void AsyncUnwinder::stop() {
+    if (mRunning.exchange(false, std::memory_order_acq_rel)) {
+        pthread_join(mThread, nullptr);
+        flush();
+        LOGGER("async unwind >>> %llu deferred, %llu in place",
+               (unsigned long long) mDeferred.load(std::memory_order_relaxed),
+               (unsigned long long) mInPlace.load(std::memory_order_relaxed));
+    }
+}
+
+bool AsyncUnwinder::capture(uintptr_t address, size_t size, uint32_t depth) {
+    CaptureBatch *batch = batch_of_thread();
+    if (batch == nullptr) {
+        return false;
+    }
+
+    lock(batch);
+    if (batch->count == ASYNC_BATCH_SIZE) {
+        unlock(batch);
+        mInPlace.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    StackCapture *capture = &batch->captures[batch->count];
+#ifdef __arm__
+    capture->length = (uint32_t) libudf_capture_stack(capture->regs, capture->stack, ASYNC_STACK_SIZE);
+#else
+    capture->length = (uint32_t) capture_stack(&capture->fp, capture->stack, ASYNC_STACK_SIZE);
+#endif
+    if (capture->length == 0) {
+        unlock(batch);
+        mInPlace.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    capture->address = address;
+    capture->size = size;
+    capture->depth = depth;
+    batch->count++;
+    mPending[pending_hash(address)].fetch_add(1, std::memory_order_release);
+    unlock(batch);
+    mDeferred.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool AsyncUnwinder::cancel(uintptr_t address) {
+    if (mPending[pending_hash(address)].load(std::memory_order_acquire) == 0) {
+        return false;
+    }
+
+    CaptureBatch *batch = mBatches.load(std::memory_order_acquire);
+    for (; batch != nullptr; batch = batch->link) {
+        lock(batch);
+        // short-lived blocks are the most recent ones, so search from the end
+        for (uint32_t i = batch->count; i > 0; i--) {
+            if (batch->captures[i - 1].address == address) {
+                batch->count--;
+                if (i - 1 != batch->count) {
+                    memcpy(&batch->captures[i - 1], &batch->captures[batch->count], sizeof(StackCapture));
+                }
+                mPending[pending_hash(address)].fetch_sub(1, std::memory_order_relaxed);
+                unlock(batch);
+                return true;
+            }
+        }
+        unlock(batch);
+    }
+
+    // taken by the worker before the search, it is recorded once mUnwinding moves on
+    while (mUnwinding.load(std::memory_order_acquire) == address) {
+        sched_yield();
+    }
+    return false;
+}
+
+void AsyncUnwinder::flush() {
+    while (drain());
+}
+
+bool AsyncUnwinder::drain() {
+    bool drained = false;
+    pthread_mutex_lock(&mMutex);
+    CaptureBatch *batch = mBatches.load(std::memory_order_acquire);
+    for (; batch != nullptr; batch = batch->link) {
+        lock(batch);
+        if (batch->count == 0) {
+            unlock(batch);
+            continue;
+        }
+        // the copy leaves the batch at once, so its owner never waits for an unwind
+        batch->count--;
+        memcpy(mScratch, &batch->captures[batch->count], sizeof(StackCapture));
+        mUnwinding.store(mScratch->address, std::memory_order_release);
+        unlock(batch);
+
+        unwind(mScratch);
+        mUnwinding.store(0, std::memory_order_release);
+        // pairs with the acquire in cancel, a zero count means the record is visible
+        mPending[pending_hash(mScratch->address)].fetch_sub(1, std::memory_order_release);
+        drained = true;
+    }
+    pthread_mutex_unlock(&mMutex);
+    return drained;
+}
+
+void AsyncUnwinder::unwind(StackCapture *capture) {
+    Backtrace backtrace;
+    uint32_t depth = capture->depth + 1 < MAX_TRACE_DEPTH ? capture->depth + 1 : MAX_TRACE_DEPTH;
+#ifdef __arm__
+    ssize_t frames = libudf_unwind_backtrace_copy(capture->regs, capture->stack, capture->length,
+                                                  backtrace.trace, CAPTURE_SKIP, depth);
+    backtrace.depth = frames > 0 ? (uint32_t) frames : 0;
+#else
+    uintptr_t trace[MAX_TRACE_DEPTH + CAPTURE_SKIP];
+    size_t frames = unwind_backtrace_copy(capture->fp, capture->stack, capture->length, trace, depth + CAPTURE_SKIP);
+    backtrace.depth = frames > CAPTURE_SKIP ? (uint32_t) (frames - CAPTURE_SKIP) : 0;
+    memcpy(backtrace.trace, trace + CAPTURE_SKIP, backtrace.depth * sizeof(uintptr_t));
+#endif
+    mRecord(capture->address, capture->size, &backtrace);
+}
+
+void *AsyncUnwinder::loop(void *arg) {
+    AsyncUnwinder *unwinder = (AsyncUnwinder *) arg;
+    set_guard(true);
+
+    struct timespec interval = {0, ASYNC_IDLE_INTERVAL * 1000000L};
+    while (unwinder->mRunning.load(std::memory_order_acquire)) {
+        if (!unwinder->drain()) {
+            nanosleep(&interval, nullptr);
+        }
+    }
+    return nullptr;
+}
+
+CaptureBatch* AsyncUnwinder::batch_of_thread() {
+    if (!mKeyed) {
+        return nullptr;
+    }
+    CaptureBatch *batch = (CaptureBatch *) pthread_getspecific(mKey);
+    if (batch == nullptr) {
+        batch = adopt();
+        if (batch != nullptr) {
+            pthread_setspecific(mKey, batch);
+        }
+    }
+    return batch;
+}
+
+CaptureBatch* AsyncUnwinder::adopt() {
+    CaptureBatch *batch = mBatches.load(std::memory_order_acquire);
+    for (; batch != nullptr; batch = batch->link) {
+        bool owned = false;
+        if (!batch->owned.load(std::memory_order_relaxed)
+            && batch->owned.compare_exchange_strong(owned, true, std::memory_order_acquire, std::memory_order_relaxed)) {
+            return batch;
+        }
+    }
+
+    batch = (CaptureBatch *) calloc(1, sizeof(CaptureBatch));
+    if (batch == nullptr) {
+        return nullptr;
+    }
+    batch->unwinder = this;
+    batch->owned.store(true, std::memory_order_relaxed);
+    batch->link = mBatches.load(std::memory_order_relaxed);
+    while (!mBatches.compare_exchange_weak(batch->link, batch, std::memory_order_release, std::memory_order_relaxed));
+    return batch;
+}
+
+void AsyncUnwinder::detach(void *arg) {
+    // the stack copies don't depend on the thread, the worker still unwinds them
+    ((CaptureBatch *) arg)->owned.store(false, std::memory_order_release);
+}
+
+void AsyncUnwinder::lock(CaptureBatch *batch) {
+    while (batch->locked.exchange(true, std::memory_order_acquire)) {
+        sched_yield();
+    }
+}
+
+void AsyncUnwinder::unlock(CaptureBatch *batch) {
+    batch->locked.store(false, std::memory_order_release);
+}
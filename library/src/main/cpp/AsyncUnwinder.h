@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ASYNC_UNWINDER_H
+#define ASYNC_UNWINDER_H
+
+#include <atomic>
+#include <pthread.h>
+
+#include "Cache.h"
+
+#define ASYNC_STACK_SIZE (1 << 12)
+#define ASYNC_BATCH_SIZE 32
+#define ASYNC_INDEX_BITS 16
+#define ASYNC_INDEX_SIZE (1 << ASYNC_INDEX_BITS)
+#define ASYNC_IDLE_INTERVAL 1
+
+typedef struct {
+    uintptr_t address;
+    size_t    size;
+    uint32_t  depth;
+    uint32_t  length;
+#ifdef __arm__
+    uint32_t  regs[16];
+#else
+    uintptr_t fp;
+#endif
+    uint8_t   stack[ASYNC_STACK_SIZE];
+} StackCapture;
+
+class AsyncUnwinder;
+
+/**
+ * Captures of one thread waiting to be unwound. Its owner appends, the worker takes the last one
+ * and a free on any thread cancels its own entry, all of them under the lock.
+ */
+struct CaptureBatch {
+    AsyncUnwinder *       unwinder;
+    CaptureBatch *        link;
+    std::atomic<bool>     owned;
+    std::atomic<bool>     locked;
+    uint32_t              count;
+    StackCapture          captures[ASYNC_BATCH_SIZE];
+};
+
+/**
+ * Moves unwinding out of the allocating thread. A capture only saves the registers and the top
+ * ASYNC_STACK_SIZE bytes of the stack, a worker unwinds the copy later and hands the backtrace to
+ * record. A full batch makes the caller unwind in place, frames beyond the copy are cut off.
+ *
+ * mPending counts the captures per address hash until they are recorded, a free that sees a
+ * count searches the batches, then waits for the one capture the worker may be unwinding.
+ */
+class AsyncUnwinder {
+public:
+    AsyncUnwinder(void (*record)(uintptr_t address, size_t size, Backtrace *backtrace));
+    ~AsyncUnwinder();
+public:
+    bool start();
+    void stop();
+    bool capture(uintptr_t address, size_t size, uint32_t depth);
+    bool cancel(uintptr_t address);
+    void flush();
+private:
+    CaptureBatch* batch_of_thread();
+    CaptureBatch* adopt();
+    static void detach(void *arg);
+    static void *loop(void *arg);
+    bool drain();
+    void unwind(StackCapture *capture);
+    static void lock(CaptureBatch *batch);
+    static void unlock(CaptureBatch *batch);
+private:
+    void                      (*mRecord)(uintptr_t address, size_t size, Backtrace *backtrace);
+    pthread_key_t             mKey;
+    bool                      mKeyed;
+    std::atomic<CaptureBatch*> mBatches;
+    std::atomic<uint16_t> *   mPending;
+    std::atomic<uintptr_t>    mUnwinding;
+    pthread_mutex_t           mMutex;
+    StackCapture *            mScratch;
+    std::atomic<bool>         mRunning;
+    pthread_t                 mThread;
+    std::atomic<uint64_t>     mDeferred;
+    std::atomic<uint64_t>     mInPlace;
+};
+
+#endif //ASYNC_UNWINDER_H
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <sched.h>
+
+#include "Logger.h"
+#include "BatchCache.h"
+#include "Guard.h"
+
+//**************************************************************************************************
+static inline uint32_t staged_hash(uintptr_t address) {
+    return ((uint32_t) (address >> ADDR_HASH_OFFSET) * 0x9E3779B1u) >> (32 - BATCH_INDEX_BITS);
+}
+
+BatchCache::BatchCache(const char *space, Cache *cache) : Cache(space) {
+    mCache = cache;
+    mBatches.store(nullptr, std::memory_order_relaxed);
+    mStaged = new std::atomic<uint16_t>[BATCH_INDEX_SIZE];
+    for (uint i = 0; i < BATCH_INDEX_SIZE; i++) {
+        mStaged[i].store(0, std::memory_order_relaxed);
+    }
+    mKeyed = pthread_key_create(&mKey, detach) == 0;
+}
+
+BatchCache::~BatchCache() {
+    if (mKeyed) {
+        pthread_key_delete(mKey);
+    }
+    AllocBatch *batch = mBatches.load(std::memory_order_relaxed);
+    while (batch != nullptr) {
+        AllocBatch *link = batch->link;
+        free(batch);
+        batch = link;
+    }
+    delete[] mStaged;
+    delete mCache;
+}
+
+void BatchCache::reset() {
+    AllocBatch *batch = mBatches.load(std::memory_order_acquire);
+    for (; batch != nullptr; batch = batch->link) {
+        lock(batch);
+        batch->count = 0;
+        unlock(batch);
+    }
+    for (uint i = 0; i < BATCH_INDEX_SIZE; i++) {
+        mStaged[i].store(0, std::memory_order_relaxed);
+    }
+    mCache->reset();
+}
+
+// a staged block counts as recorded, one the wrapped cache drops when it is published is lost
+bool BatchCache::insert(uintptr_t address, size_t size, Backtrace *backtrace) {
+    AllocBatch *batch = batch_of_thread();
+    if (batch == nullptr) {
+        return mCache->insert(address, size, backtrace);
+    }
+
+    lock(batch);
+    if (batch->count == BATCH_SIZE) {
+        publish(batch);
+    }
+    StagedAlloc *alloc = &batch->allocs[batch->count++];
+    alloc->address = address;
+    alloc->size = size;
+    alloc->backtrace.depth = backtrace->depth;
+    memcpy(alloc->backtrace.trace, backtrace->trace, backtrace->depth * sizeof(uintptr_t));
+    mStaged[staged_hash(address)].fetch_add(1, std::memory_order_release);
+    unlock(batch);
+    return true;
+}
+
+bool BatchCache::remove(uintptr_t address) {
+    AllocBatch *batch = batch_of_thread();
+    if (batch != nullptr) {
+        lock(batch);
+        bool cancelled = cancel(batch, address);
+        unlock(batch);
+        if (cancelled) {
+            return true;
+        }
+    }
+
+    if (mStaged[staged_hash(address)].load(std::memory_order_acquire) != 0) {
+        AllocBatch *other = mBatches.load(std::memory_order_acquire);
+        for (; other != nullptr; other = other->link) {
+            if (other == batch) {
+                continue;
+            }
+            lock(other);
+            bool cancelled = cancel(other, address);
+            unlock(other);
+            if (cancelled) {
+                return true;
+            }
+        }
+    }
+    // a batch publishes under its lock, so a block missed above is already in the cache
+    return mCache->remove(address);
+}
+
+void BatchCache::print() {
+    AllocBatch *batch = mBatches.load(std::memory_order_acquire);
+    for (; batch != nullptr; batch = batch->link) {
+        lock(batch);
+        publish(batch);
+        unlock(batch);
+    }
+    mCache->print();
+}
+
+void BatchCache::publish(AllocBatch *batch) {
+    for (uint32_t i = 0; i < batch->count; i++) {
+        StagedAlloc *alloc = &batch->allocs[i];
+        mCache->insert(alloc->address, alloc->size, &alloc->backtrace);
+        // pairs with the acquire in remove, a zero count means the insert above is visible
+        mStaged[staged_hash(alloc->address)].fetch_sub(1, std::memory_order_release);
+    }
+    batch->count = 0;
+}
+
+bool BatchCache::cancel(AllocBatch *batch, uintptr_t address) {
+    // short-lived blocks are the most recent ones, so search from the end
+    for (uint32_t i = batch->count; i > 0; i--) {
+        if (batch->allocs[i - 1].address == address) {
+            batch->count--;
+            if (i - 1 != batch->count) {
+                memcpy(&batch->allocs[i - 1], &batch->allocs[batch->count], sizeof(StagedAlloc));
+            }
+            mStaged[staged_hash(address)].fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+AllocBatch* BatchCache::batch_of_thread() {
+    if (!mKeyed) {
+        return nullptr;
+    }
+    AllocBatch *batch = (AllocBatch *) pthread_getspecific(mKey);
+    if (batch == nullptr) {
+        batch = adopt();
+        if (batch != nullptr) {
+            pthread_setspecific(mKey, batch);
+        }
+    }
+    return batch;
+}
+
+AllocBatch* BatchCache::adopt() {
+    AllocBatch *batch = mBatches.load(std::memory_order_acquire);
+    for (; batch != nullptr; batch = batch->link) {
+        bool owned = false;
+        if (!batch->owned.load(std::memory_order_relaxed)
+            && batch->owned.compare_exchange_strong(owned, true, std::memory_order_acquire, std::memory_order_relaxed)) {
+            return batch;
+        }
+    }
+
+    batch = (AllocBatch *) calloc(1, sizeof(AllocBatch));
+    if (batch == nullptr) {
+        return nullptr;
+    }
+    batch->cache = this;
+    batch->owned.store(true, std::memory_order_relaxed);
+    batch->link = mBatches.load(std::memory_order_relaxed);
+    while (!mBatches.compare_exchange_weak(batch->link, batch, std::memory_order_release, std::memory_order_relaxed));
+    return batch;
+}
+
+void BatchCache::detach(void *arg) {
+    AllocBatch *batch = (AllocBatch *) arg;
+    // the thread is exiting outside of any proxy, what publish allocates is the detector's own
+    bool guarded = is_guarded();
+    set_guard(true);
+    lock(batch);
+    batch->cache->publish(batch);
+    unlock(batch);
+    set_guard(guarded);
+    batch->owned.store(false, std::memory_order_release);
+}
+
+void BatchCache::lock(AllocBatch *batch) {
+    while (batch->locked.exchange(true, std::memory_order_acquire)) {
+        sched_yield();
+    }
+}
+
+void BatchCache::unlock(AllocBatch *batch) {
+    batch->locked.store(false, std::memory_order_release);
+}
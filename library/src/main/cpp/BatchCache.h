@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BATCH_CACHE_H
+#define BATCH_CACHE_H
+
+#include <atomic>
+#include <pthread.h>
+
+#include "Cache.h"
+
+#define BATCH_SIZE 32
+#define BATCH_INDEX_BITS 16
+#define BATCH_INDEX_SIZE (1 << BATCH_INDEX_BITS)
+
+typedef struct {
+    uintptr_t address;
+    size_t    size;
+    Backtrace backtrace;
+} StagedAlloc;
+
+class BatchCache;
+
+/**
+ * Allocations of one thread not yet published. Only its owner appends to it, the lock is taken
+ * by others only to publish it for print() or to cancel an entry freed on another thread.
+ */
+struct AllocBatch {
+    BatchCache *          cache;
+    AllocBatch *          link;
+    std::atomic<bool>     owned;
+    std::atomic<bool>     locked;
+    uint32_t              count;
+    StagedAlloc           allocs[BATCH_SIZE];
+};
+
+/**
+ * Stages inserts per thread in front of another cache. A free of a staged block cancels it
+ * locally, the survivors are published when the batch is full, its thread exits or print()
+ * flushes every batch. Frees of published blocks go straight through.
+ *
+ * mStaged counts the staged blocks per address hash, a free that finds neither its own batch
+ * nor a zero count searches all batches, so a block freed on another thread is never missed.
+ */
+class BatchCache : public Cache {
+public:
+    BatchCache(const char *space, Cache *cache);
+    ~BatchCache();
+public:
+    void reset();
+    bool insert(uintptr_t address, size_t size, Backtrace *backtrace);
+    bool remove(uintptr_t address);
+    void print();
+private:
+    AllocBatch* batch_of_thread();
+    AllocBatch* adopt();
+    static void detach(void *arg);
+    void publish(AllocBatch *batch);
+    bool cancel(AllocBatch *batch, uintptr_t address);
+    static void lock(AllocBatch *batch);
+    static void unlock(AllocBatch *batch);
+private:
+    Cache *                   mCache;
+    pthread_key_t             mKey;
+    bool                      mKeyed;
+    std::atomic<AllocBatch*>  mBatches;
+    std::atomic<uint16_t> *   mStaged;
+};
+
+#endif //BATCH_CACHE_H
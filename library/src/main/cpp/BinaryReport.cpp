@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <unistd.h>
+#include <link.h>
+#include <elf.h>
+#include <xdl.h>
+
+#include "BinaryReport.h"
+
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID 3
+#endif
+
+#define BUILD_ID_SIZE 64
+
+struct ModuleEntry {
+    ReportModule module;
+    uint8_t      id[BUILD_ID_SIZE];
+    std::string  path;
+};
+
+//**************************************************************************************************
+static uint16_t read_build_id(struct dl_phdr_info *info, uintptr_t low, uintptr_t high, uint8_t *id) {
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = info->dlpi_phdr + i;
+        if (phdr->p_type != PT_NOTE) {
+            continue;
+        }
+        // only notes inside a loaded segment are readable
+        uintptr_t note = info->dlpi_addr + phdr->p_vaddr;
+        uintptr_t end = note + phdr->p_memsz;
+        if (note < low || end > high) {
+            continue;
+        }
+        while (note + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *) note;
+            uintptr_t name = note + sizeof(ElfW(Nhdr));
+            uintptr_t desc = name + ((nhdr->n_namesz + 3) & ~3u);
+            uintptr_t next = desc + ((nhdr->n_descsz + 3) & ~3u);
+            if (next > end) {
+                break;
+            }
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && memcmp((void *) name, "GNU", 4) == 0) {
+                uint16_t length = nhdr->n_descsz > BUILD_ID_SIZE ? BUILD_ID_SIZE : (uint16_t) nhdr->n_descsz;
+                memcpy(id, (void *) desc, length);
+                return length;
+            }
+            note = next;
+        }
+    }
+    return 0;
+}
+
+static int collect_module(struct dl_phdr_info *info, size_t, void *data) {
+    uintptr_t low = UINTPTR_MAX;
+    uintptr_t high = 0;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = info->dlpi_phdr + i;
+        if (phdr->p_type == PT_LOAD) {
+            low = std::min(low, (uintptr_t) (info->dlpi_addr + phdr->p_vaddr));
+            high = std::max(high, (uintptr_t) (info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz));
+        }
+    }
+    if (low >= high) {
+        return 0;
+    }
+
+    ModuleEntry entry;
+    entry.module.base = low & ~((uintptr_t) getpagesize() - 1);
+    entry.module.size = high - entry.module.base;
+    entry.module.bias = info->dlpi_addr;
+    entry.module.id_length = read_build_id(info, low, high, entry.id);
+    entry.path = info->dlpi_name == nullptr ? "" : info->dlpi_name;
+    entry.module.path_length = (uint16_t) entry.path.size();
+    ((std::vector<ModuleEntry> *) data)->push_back(entry);
+    return 0;
+}
+
+void write_binary(FILE *output, StackDepot *depot, AllocNode *nodes, size_t count, bool merged) {
+    std::sort(nodes, nodes + count, [](const AllocNode &a, const AllocNode &b) {
+        return a.stack < b.stack;
+    });
+
+    std::vector<ReportRecord> records;
+    records.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        ReportRecord record;
+        record.addr = nodes[i].addr;
+        record.stack = nodes[i].stack;
+        record.count = 1;
+        record.size = nodes[i].size;
+        if (merged) {
+            for (; i + 1 < count && nodes[i + 1].stack == record.stack; i++) {
+                record.count++;
+                record.size += nodes[i + 1].size;
+            }
+        }
+        records.push_back(record);
+    }
+    write_binary(output, depot, records.data(), records.size(), merged);
+}
+
+// everything before the records, stacks lists the stack of each record in any order
+static void write_header(FILE *output, StackDepot *depot, std::vector<uint32_t> &stacks, uint32_t flags) {
+    std::vector<ModuleEntry> modules;
+    xdl_iterate_phdr(collect_module, &modules, XDL_FULL_PATHNAME);
+
+    // records may come in any order, the stack table still lists each stack once
+    size_t count = stacks.size();
+    std::sort(stacks.begin(), stacks.end());
+    stacks.erase(std::unique(stacks.begin(), stacks.end()), stacks.end());
+
+    ReportHeader header;
+    memcpy(header.magic, REPORT_MAGIC, sizeof(header.magic));
+    header.version = REPORT_VERSION;
+    header.width = sizeof(uintptr_t);
+    header.flags = flags;
+    header.modules = (uint32_t) modules.size();
+    header.stacks = (uint32_t) stacks.size();
+    header.records = (uint32_t) count;
+    fwrite(&header, sizeof(header), 1, output);
+
+    for (auto &entry : modules) {
+        fwrite(&entry.module, sizeof(entry.module), 1, output);
+        fwrite(entry.id, 1, entry.module.id_length, output);
+        fwrite(entry.path.data(), 1, entry.module.path_length, output);
+    }
+
+    for (uint32_t id : stacks) {
+        const uintptr_t *trace;
+        ReportStack stack;
+        stack.id = id;
+        stack.depth = depot->fetch(id, &trace);
+        fwrite(&stack, sizeof(stack), 1, output);
+        fwrite(trace, sizeof(uintptr_t), stack.depth, output);
+    }
+}
+
+void write_binary(FILE *output, StackDepot *depot, ReportRecord *records, size_t count, bool merged) {
+    std::vector<uint32_t> stacks;
+    stacks.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        stacks.push_back(records[i].stack);
+    }
+    write_header(output, depot, stacks, merged ? REPORT_MERGED : 0);
+    fwrite(records, sizeof(ReportRecord), count, output);
+}
+
+void write_binary(FILE *output, StackDepot *depot, ReportSite *sites, size_t count) {
+    std::vector<uint32_t> stacks;
+    stacks.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        stacks.push_back(sites[i].stack);
+    }
+    write_header(output, depot, stacks, REPORT_MERGED | REPORT_SITES);
+    fwrite(sites, sizeof(ReportSite), count, output);
+}
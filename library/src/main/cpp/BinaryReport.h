@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BINARY_REPORT_H
+#define BINARY_REPORT_H
+
+#include <stdio.h>
+
+#include "Cache.h"
+#include "StackDepot.h"
+
+/**
+ * Layout of report.bin, all fields are little-endian and packed, pointers are `width` bytes:
+ *   ReportHeader
+ *   ReportModule x modules, each followed by its build-id and path bytes
+ *   ReportStack  x stacks,  each followed by `depth` absolute pcs
+ *   ReportRecord x records, or ReportSite x records with REPORT_SITES
+ * Nothing is symbolized on device, python/report.py turns it back into the text report.
+ */
+#define REPORT_MAGIC   "RPHL"
+#define REPORT_VERSION 2
+#define REPORT_MERGED  0x00000001
+#define REPORT_SITES   0x00000002
+
+typedef struct {
+    char      magic[4];
+    uint16_t  version;
+    uint16_t  width;
+    uint32_t  flags;
+    uint32_t  modules;
+    uint32_t  stacks;
+    uint32_t  records;
+} __attribute__((packed)) ReportHeader;
+
+typedef struct {
+    uintptr_t base;
+    uintptr_t size;
+    uintptr_t bias;
+    uint16_t  id_length;
+    uint16_t  path_length;
+} __attribute__((packed)) ReportModule;
+
+typedef struct {
+    uint32_t  id;
+    uint32_t  depth;
+} __attribute__((packed)) ReportStack;
+
+typedef struct {
+    uintptr_t addr;
+    uint32_t  stack;
+    uint32_t  count;
+    uint64_t  size;
+} __attribute__((packed)) ReportRecord;
+
+// a call site of AggregateCache, size and count are live, total and peak since the reset
+typedef struct {
+    uint32_t  stack;
+    uint32_t  count;
+    uint64_t  size;
+    uint64_t  total;
+    uint64_t  peak;
+} __attribute__((packed)) ReportSite;
+
+void write_binary(FILE *output, StackDepot *depot, AllocNode *nodes, size_t count, bool merged = false);
+
+void write_binary(FILE *output, StackDepot *depot, ReportRecord *records, size_t count, bool merged);
+
+void write_binary(FILE *output, StackDepot *depot, ReportSite *sites, size_t count);
+
+#endif //BINARY_REPORT_H
@@ -35,7 +35,18 @@ extern "C" {
 #define MAX_BUFFER_SIZE 1024
 
 #define ALLOC_INDEX_SIZE 1 << 16
-#define ALLOC_CACHE_SIZE 1 << 15
+#define ALLOC_STRIPE_SIZE (1 << 8)
+#define ALLOC_SEGMENT_SIZE (1 << 20)
+#define ALLOC_SEGMENT_MAX 64
+
+// ceiling of live nodes, AllocPool maps ALLOC_SEGMENT_SIZE segments on demand up to it
+#ifndef ALLOC_CACHE_LIMIT
+#if defined(__LP64__)
+#define ALLOC_CACHE_LIMIT (1 << 21)
+#else
+#define ALLOC_CACHE_LIMIT (1 << 20)
+#endif
+#endif
 
 typedef struct {
     uint32_t          depth;
@@ -44,8 +55,9 @@ typedef struct {
 
 struct AllocNode {
     uint32_t size;
+    uint32_t stack;
+    uint32_t epoch;
     uintptr_t addr;
-    uintptr_t trace[MAX_TRACE_DEPTH];
     AllocNode *next;
 };
 
@@ -55,11 +67,16 @@ public:
     virtual ~Cache() {}
 public:
     virtual void reset() = 0;
-    virtual void insert(uintptr_t address, size_t size, Backtrace *backtrace) = 0;
-    virtual void remove(uintptr_t address) = 0;
+    // false if the block couldn't be recorded, a full pool or table drops it
+    virtual bool insert(uintptr_t address, size_t size, Backtrace *backtrace) = 0;
+    // true only if the address was recorded, frees of untracked blocks return false
+    virtual bool remove(uintptr_t address) = 0;
     virtual void print() = 0;
+public:
+    void binary(bool enable) {this->mBinary = enable;}
 protected:
     const char *mSpace;
+    bool        mBinary = false;
 };
 
 #ifdef __cplusplus
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include "Logger.h"
+#include "DiffCache.h"
+#include "BinaryReport.h"
+
+//**************************************************************************************************
+DiffCache::DiffCache(const char *sdcard, uint stripes) : MemoryCache(sdcard, stripes) {
+}
+
+void DiffCache::print() {
+    char path[MAX_BUFFER_SIZE];
+    sprintf(path, mBinary ? "%s/report.bin" : "%s/report", mSpace);
+
+    FILE *report = fopen(path, mBinary ? "wb" : "w");
+    if (report == nullptr) {
+        LOGGER("print report failed, can't open report file");
+        return;
+    }
+    std::vector<AllocNode> nodes;
+
+    // insert stamps the epoch under its stripe, so no node can straddle the boundary
+    lock_all();
+    for (auto p : alloc_table) {
+        for (; p != nullptr; p = p->next) {
+            if (p->epoch == alloc_epoch) {
+                nodes.push_back(*p);
+            }
+        }
+    }
+    alloc_epoch++;
+    unlock_all();
+
+    if (mBinary) {
+        write_binary(report, alloc_depot, nodes.data(), nodes.size(), true);
+    } else {
+        write_report(report, alloc_depot, nodes.data(), nodes.size(), true);
+    }
+
+    fclose(report);
+}
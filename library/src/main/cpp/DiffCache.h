@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIFF_CACHE_H
+#define DIFF_CACHE_H
+
+#include "MemoryCache.h"
+
+/**
+ * Every print() closes an epoch and reports, merged by stack, only the allocations made during
+ * that epoch which are still alive, i.e. the growth since the previous print().
+ */
+class DiffCache : public MemoryCache {
+public:
+    DiffCache(const char *space, uint stripes = 1);
+public:
+    void print();
+};
+
+#endif //DIFF_CACHE_H
@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Logger.h"
+#include "EventLog.h"
+#include "Guard.h"
+
+#define STACK_ID_LIMIT (STACK_DEPOT_SIZE / sizeof(uintptr_t))
+
+//**************************************************************************************************
+static inline uint64_t event_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+EventLog::EventLog(const char *space) {
+    mSpace = space;
+    mRings.store(nullptr, std::memory_order_relaxed);
+    mLost.store(0, std::memory_order_relaxed);
+    mRunning.store(false, std::memory_order_relaxed);
+    mDepot = new StackDepot();
+    mDepot->reset();
+    // one bit per possible stack id, set once the stack is in the file
+    mWritten = (uint8_t *) calloc(STACK_ID_LIMIT / 8, 1);
+    mFile = -1;
+    mWindow = nullptr;
+    mOffset = 0;
+    mUsed = 0;
+    mDrops = 0;
+    mKeyed = pthread_key_create(&mKey, detach) == 0;
+}
+
+EventLog::~EventLog() {
+    stop();
+    if (mKeyed) {
+        pthread_key_delete(mKey);
+    }
+    EventRing *ring = mRings.load(std::memory_order_relaxed);
+    while (ring != nullptr) {
+        EventRing *link = ring->link;
+        free(ring);
+        ring = link;
+    }
+    free(mWritten);
+    delete mDepot;
+}
+
+bool EventLog::start() {
+    char path[MAX_BUFFER_SIZE];
+    if (mWritten == nullptr || snprintf(path, MAX_BUFFER_SIZE, "%s/events", mSpace) >= MAX_BUFFER_SIZE) {
+        return false;
+    }
+    mkdir(mSpace, 0777);
+
+    mFile = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (mFile < 0 || ftruncate(mFile, EVENT_LOG_CHUNK) != 0) {
+        LOGGER("event log failed, can't open %s", path);
+        stop();
+        return false;
+    }
+    void *window = mmap(nullptr, EVENT_LOG_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED, mFile, 0);
+    if (window == MAP_FAILED) {
+        LOGGER("event log failed, can't map %s", path);
+        stop();
+        return false;
+    }
+    mWindow = (uint8_t *) window;
+
+    EventHeader header;
+    memcpy(header.magic, EVENT_MAGIC, sizeof(header.magic));
+    header.version = EVENT_VERSION;
+    header.width = sizeof(uintptr_t);
+    append(&header, sizeof(header));
+
+    mRunning.store(true, std::memory_order_release);
+    if (pthread_create(&mThread, nullptr, flush, this) != 0) {
+        LOGGER("event log failed, can't create flusher");
+        mRunning.store(false, std::memory_order_relaxed);
+        stop();
+        return false;
+    }
+    return true;
+}
+
+void EventLog::stop() {
+    if (mRunning.exchange(false, std::memory_order_acq_rel)) {
+        pthread_join(mThread, nullptr);
+    }
+    if (mWindow != nullptr) {
+        drain();
+        munmap(mWindow, EVENT_LOG_CHUNK);
+        mWindow = nullptr;
+        uint32_t lost = mLost.load(std::memory_order_relaxed);
+        LOGGER("event log >>> %zu bytes, %llu dropped, %u lost", mOffset + mUsed, (unsigned long long) mDrops, lost);
+    }
+    if (mFile >= 0) {
+        // the last chunk was only reserved, cut the file down to what was written
+        ftruncate(mFile, mOffset + mUsed);
+        close(mFile);
+        mFile = -1;
+    }
+}
+
+void EventLog::insert(uintptr_t address, size_t size, Backtrace *backtrace) {
+    uint32_t depth = backtrace->depth > 2 ? backtrace->depth - 2 : 1;
+    push(address, (uint32_t) size, mDepot->intern(backtrace->trace + 2, depth));
+}
+
+void EventLog::remove(uintptr_t address) {
+    push(address, 0, EVENT_FREE);
+}
+
+void EventLog::push(uintptr_t address, uint32_t size, uint32_t stack) {
+    EventRing *ring = ring_of_thread();
+    if (ring == nullptr) {
+        mLost.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) == EVENT_RING_SIZE) {
+        ring->drops.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    AllocEvent *event = &ring->events[head & (EVENT_RING_SIZE - 1)];
+    event->time = event_time();
+    event->addr = address;
+    event->size = size;
+    event->stack = stack;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+EventRing* EventLog::ring_of_thread() {
+    if (!mKeyed) {
+        return nullptr;
+    }
+    EventRing *ring = (EventRing *) pthread_getspecific(mKey);
+    if (ring == nullptr) {
+        ring = adopt();
+        if (ring != nullptr) {
+            pthread_setspecific(mKey, ring);
+        }
+    }
+    return ring;
+}
+
+EventRing* EventLog::adopt() {
+    EventRing *ring = mRings.load(std::memory_order_acquire);
+    for (; ring != nullptr; ring = ring->link) {
+        bool owned = false;
+        if (!ring->owned.load(std::memory_order_relaxed)
+            && ring->owned.compare_exchange_strong(owned, true, std::memory_order_acquire, std::memory_order_relaxed)) {
+            return ring;
+        }
+    }
+
+    ring = (EventRing *) calloc(1, sizeof(EventRing));
+    if (ring == nullptr) {
+        return nullptr;
+    }
+    ring->log = this;
+    ring->owned.store(true, std::memory_order_relaxed);
+    ring->link = mRings.load(std::memory_order_relaxed);
+    while (!mRings.compare_exchange_weak(ring->link, ring, std::memory_order_release, std::memory_order_relaxed));
+    return ring;
+}
+
+void EventLog::detach(void *arg) {
+    // pending events stay in the ring, the flusher still drains them
+    ((EventRing *) arg)->owned.store(false, std::memory_order_release);
+}
+
+void *EventLog::flush(void *arg) {
+    EventLog *log = (EventLog *) arg;
+    // nothing the flusher maps or allocates belongs in the report
+    set_guard(true);
+
+    struct timespec interval = {0, EVENT_FLUSH_INTERVAL * 1000000L};
+    while (log->mRunning.load(std::memory_order_acquire)) {
+        nanosleep(&interval, nullptr);
+        log->drain();
+    }
+    return nullptr;
+}
+
+void EventLog::drain() {
+    EventRing *ring = mRings.load(std::memory_order_acquire);
+    for (; ring != nullptr; ring = ring->link) {
+        drain(ring);
+    }
+}
+
+void EventLog::drain(EventRing *ring) {
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint32_t head = ring->head.load(std::memory_order_acquire);
+
+    for (uint32_t i = tail; i != head; i++) {
+        uint32_t id = ring->events[i & (EVENT_RING_SIZE - 1)].stack;
+        if (id == EVENT_FREE || id == 0 || id >= STACK_ID_LIMIT || (mWritten[id / 8] & (1u << (id % 8)))) {
+            continue;
+        }
+        const uintptr_t *trace;
+        EventBlock block;
+        block.type = EVENT_BLOCK_STACK;
+        block.count = mDepot->fetch(id, &trace);
+        append(&block, sizeof(block));
+        append(&id, sizeof(id));
+        append(trace, block.count * sizeof(uintptr_t));
+        mWritten[id / 8] |= (uint8_t) (1u << (id % 8));
+    }
+
+    if (head != tail) {
+        EventBlock block;
+        block.type = EVENT_BLOCK_EVENTS;
+        block.count = head - tail;
+        append(&block, sizeof(block));
+
+        uint32_t first = tail & (EVENT_RING_SIZE - 1);
+        uint32_t count = EVENT_RING_SIZE - first < block.count ? EVENT_RING_SIZE - first : block.count;
+        append(&ring->events[first], count * sizeof(AllocEvent));
+        append(&ring->events[0], (block.count - count) * sizeof(AllocEvent));
+        ring->tail.store(head, std::memory_order_release);
+    }
+
+    uint32_t drops = ring->drops.load(std::memory_order_relaxed);
+    if (drops != ring->reported) {
+        EventBlock block;
+        block.type = EVENT_BLOCK_DROPS;
+        block.count = drops - ring->reported;
+        append(&block, sizeof(block));
+        mDrops += block.count;
+        ring->reported = drops;
+    }
+}
+
+void EventLog::append(const void *data, size_t length) {
+    const uint8_t *bytes = (const uint8_t *) data;
+    while (length > 0 && mWindow != nullptr) {
+        if (mUsed == EVENT_LOG_CHUNK) {
+            // slide the window over a freshly reserved chunk, written chunks are never touched again
+            munmap(mWindow, EVENT_LOG_CHUNK);
+            mWindow = nullptr;
+            mOffset += EVENT_LOG_CHUNK;
+            mUsed = 0;
+            if (ftruncate(mFile, mOffset + EVENT_LOG_CHUNK) != 0) {
+                LOGGER("event log failed, can't extend the file");
+                return;
+            }
+            void *window = mmap(nullptr, EVENT_LOG_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED, mFile, mOffset);
+            if (window == MAP_FAILED) {
+                LOGGER("event log failed, can't map the next chunk");
+                return;
+            }
+            mWindow = (uint8_t *) window;
+        }
+        size_t count = EVENT_LOG_CHUNK - mUsed < length ? EVENT_LOG_CHUNK - mUsed : length;
+        memcpy(mWindow + mUsed, bytes, count);
+        mUsed += count;
+        bytes += count;
+        length -= count;
+    }
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <atomic>
+#include <pthread.h>
+
+#include "Cache.h"
+#include "StackDepot.h"
+
+#define EVENT_RING_SIZE (1 << 10)
+#define EVENT_LOG_CHUNK (1 << 22)
+#define EVENT_FLUSH_INTERVAL 20
+
+// stack of an event that releases its address, ids of the depot never reach it
+#define EVENT_FREE 0xFFFFFFFFu
+
+/**
+ * Layout of the events file, packed and little-endian, pointers are `width` bytes:
+ *   EventHeader
+ *   EventBlock EVENT_BLOCK_STACK, count = depth, followed by id and `depth` absolute pcs
+ *   EventBlock EVENT_BLOCK_EVENTS, count = n, followed by n AllocEvent
+ *   EventBlock EVENT_BLOCK_DROPS, count = events lost by one thread since its last block
+ * A stack is always written before the first event that refers to it. Blocks of different
+ * threads interleave, python/events.py orders the events by time.
+ */
+#define EVENT_MAGIC   "RPHE"
+#define EVENT_VERSION 1
+
+#define EVENT_BLOCK_STACK  1
+#define EVENT_BLOCK_EVENTS 2
+#define EVENT_BLOCK_DROPS  3
+
+typedef struct {
+    uint64_t  time;
+    uintptr_t addr;
+    uint32_t  size;
+    uint32_t  stack;
+} AllocEvent;
+
+typedef struct {
+    char      magic[4];
+    uint16_t  version;
+    uint16_t  width;
+} __attribute__((packed)) EventHeader;
+
+typedef struct {
+    uint32_t  type;
+    uint32_t  count;
+} EventBlock;
+
+class EventLog;
+
+/**
+ * Single producer ring of one thread, drained by the flusher. A full ring never blocks the
+ * producer, the event is counted in drops instead. Like magazines, rings live as long as the log.
+ */
+struct EventRing {
+    EventLog *            log;
+    EventRing *           link;
+    std::atomic<bool>     owned;
+    uint32_t              reported;
+    std::atomic<uint32_t> head __attribute__((aligned(64)));
+    std::atomic<uint32_t> drops;
+    std::atomic<uint32_t> tail __attribute__((aligned(64)));
+    AllocEvent            events[EVENT_RING_SIZE] __attribute__((aligned(64)));
+};
+
+/**
+ * Timeline of allocations and frees. Hooks only append to their own ring, a background thread
+ * moves the rings every EVENT_FLUSH_INTERVAL ms to an mmap'd, append-only file under space.
+ */
+class EventLog {
+public:
+    EventLog(const char *space);
+    ~EventLog();
+public:
+    bool start();
+    void stop();
+    void insert(uintptr_t address, size_t size, Backtrace *backtrace);
+    void remove(uintptr_t address);
+private:
+    void push(uintptr_t address, uint32_t size, uint32_t stack);
+    EventRing* ring_of_thread();
+    EventRing* adopt();
+    static void detach(void *arg);
+    static void *flush(void *arg);
+    void drain();
+    void drain(EventRing *ring);
+    void append(const void *data, size_t length);
+private:
+    const char *            mSpace;
+    pthread_key_t           mKey;
+    bool                    mKeyed;
+    std::atomic<EventRing*> mRings;
+    std::atomic<uint32_t>   mLost;
+    StackDepot *            mDepot;
+    uint8_t *               mWritten;
+    std::atomic<bool>       mRunning;
+    pthread_t               mThread;
+    int                     mFile;
+    uint8_t *               mWindow;
+    size_t                  mOffset;
+    size_t                  mUsed;
+    uint64_t                mDrops;
+};
+
+#endif //EVENT_LOG_H
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Logger.h"
+#include "Governor.h"
+#include "Guard.h"
+
+//**************************************************************************************************
+static inline uint64_t tick_frequency() {
+#if defined(__aarch64__)
+    uint64_t value;
+    __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(value));
+    return value;
+#else
+    return 1000000000ull;
+#endif
+}
+
+Governor::Governor(uint32_t limit, uint32_t depth, void (*apply)(uint32_t, uint32_t)) {
+    mLimit = limit;
+    mDepth = depth;
+    mApply = apply;
+    mBudget.store(0, std::memory_order_relaxed);
+    mRunning.store(false, std::memory_order_relaxed);
+    mFrequency = tick_frequency();
+    mStart = ticks();
+    mSpent = 0;
+    mLevel = 0;
+    mCost = 0;
+    mCount = 0;
+    pthread_mutex_init(&mMutex, NULL);
+    for (uint32_t i = 0; i < GOVERNOR_SLOTS; i++) {
+        mSlots[i].ticks.store(0, std::memory_order_relaxed);
+    }
+}
+
+Governor::~Governor() {
+    stop();
+    pthread_mutex_destroy(&mMutex);
+}
+
+bool Governor::start(uint32_t budget) {
+    mBudget.store(budget, std::memory_order_relaxed);
+    mRunning.store(true, std::memory_order_release);
+    if (pthread_create(&mThread, nullptr, loop, this) != 0) {
+        LOGGER("governor failed, can't create thread");
+        mRunning.store(false, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void Governor::stop() {
+    if (mRunning.exchange(false, std::memory_order_acq_rel)) {
+        pthread_join(mThread, nullptr);
+    }
+}
+
+void Governor::budget(uint32_t budget) {
+    mBudget.store(budget, std::memory_order_relaxed);
+}
+
+void Governor::print(FILE *output) {
+    pthread_mutex_lock(&mMutex);
+    fprintf(output, "budget %u, limit %u, depth %u\n", mBudget.load(std::memory_order_relaxed), mLimit, mDepth);
+    fprintf(output, "time(ms), cost(permille), level, limit, depth\n");
+    // once the history wraps only the latest GOVERNOR_HISTORY changes are left
+    uint32_t first = mCount > GOVERNOR_HISTORY ? mCount - GOVERNOR_HISTORY : 0;
+    for (uint32_t i = first; i < mCount; i++) {
+        Adjustment *adjustment = &mHistory[i % GOVERNOR_HISTORY];
+        fprintf(output, "%llu, %u, %u, %u, %u\n", (unsigned long long) adjustment->time, adjustment->cost,
+                adjustment->level, adjustment->limit, adjustment->depth);
+    }
+    pthread_mutex_unlock(&mMutex);
+}
+
+void *Governor::loop(void *arg) {
+    Governor *governor = (Governor *) arg;
+    set_guard(true);
+
+    struct timespec period = {GOVERNOR_PERIOD / 1000, (GOVERNOR_PERIOD % 1000) * 1000000L};
+    uint64_t last = ticks();
+    while (governor->mRunning.load(std::memory_order_acquire)) {
+        nanosleep(&period, nullptr);
+        uint64_t now = ticks();
+        governor->adjust(now - last);
+        last = now;
+    }
+    return nullptr;
+}
+
+void Governor::adjust(uint64_t elapsed) {
+    uint64_t spent = 0;
+    for (uint32_t i = 0; i < GOVERNOR_SLOTS; i++) {
+        spent += mSlots[i].ticks.load(std::memory_order_relaxed);
+    }
+    uint32_t cost = elapsed == 0 ? 0 : (uint32_t) ((spent - mSpent) * 1000 / elapsed);
+    mSpent = spent;
+    mCost = cost;
+
+    uint32_t budget = mBudget.load(std::memory_order_relaxed);
+    uint32_t level = mLevel;
+    if (budget == 0) {
+        level = 0;
+    } else if (cost > budget && level < GOVERNOR_LEVELS) {
+        level++;
+    } else if (cost < budget / 2 && level > 0) {
+        // only half the budget lowers the level again, so it doesn't flip every period
+        level--;
+    }
+    if (level != mLevel) {
+        pthread_mutex_lock(&mMutex);
+        change(level, cost);
+        pthread_mutex_unlock(&mMutex);
+    }
+}
+
+void Governor::rebase(uint32_t limit, uint32_t depth) {
+    pthread_mutex_lock(&mMutex);
+    mLimit = limit;
+    mDepth = depth;
+    // the level is kept, only the values it scales are new
+    change(mLevel, mCost);
+    pthread_mutex_unlock(&mMutex);
+}
+
+// called with mMutex held
+void Governor::change(uint32_t level, uint32_t cost) {
+    uint32_t limit = mLimit == 0 && level != 0 ? 1u << level : mLimit << level;
+    limit = limit > 0xFFFF ? 0xFFFF : limit;
+    uint32_t depth = mDepth > GOVERNOR_DEPTH + level ? mDepth - level : (mDepth < GOVERNOR_DEPTH ? mDepth : GOVERNOR_DEPTH);
+    mApply(limit, depth);
+
+    Adjustment *adjustment = &mHistory[mCount % GOVERNOR_HISTORY];
+    adjustment->time = (ticks() - mStart) * 1000 / mFrequency;
+    adjustment->cost = cost;
+    adjustment->level = level;
+    adjustment->limit = limit;
+    adjustment->depth = depth;
+    mCount++;
+    mLevel = level;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <atomic>
+#include <ctime>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define GOVERNOR_SLOTS   64
+#define GOVERNOR_PERIOD  1000
+#define GOVERNOR_LEVELS  8
+#define GOVERNOR_HISTORY 256
+#define GOVERNOR_DEPTH   4
+
+typedef union {
+    std::atomic<uint64_t> ticks;
+    char                  align[64];
+} GovernorSlot;
+
+typedef struct {
+    uint64_t  time;
+    uint32_t  cost;
+    uint32_t  level;
+    uint32_t  limit;
+    uint32_t  depth;
+} Adjustment;
+
+/**
+ * Keeps the time spent recording allocations inside a CPU budget, given in per-mille of one CPU.
+ * Proxies add their ticks to a slot picked by thread, once per GOVERNOR_PERIOD ms the governor
+ * sums them and moves one level: each level doubles the limit, or the sampling interval, and
+ * unwinds one frame less. Every change is kept and written next to the report. A rebase after a
+ * reconfiguration scales the new limit and depth by the current level.
+ */
+class Governor {
+public:
+    Governor(uint32_t limit, uint32_t depth, void (*apply)(uint32_t limit, uint32_t depth));
+    ~Governor();
+public:
+    bool start(uint32_t budget);
+    void stop();
+    void budget(uint32_t budget);
+    void rebase(uint32_t limit, uint32_t depth);
+    void print(FILE *output);
+
+    inline void account(uint64_t ticks) {
+        uint32_t slot = (uint32_t) (((uintptr_t) pthread_self() >> 4) * 0x9E3779B1u) % GOVERNOR_SLOTS;
+        mSlots[slot].ticks.fetch_add(ticks, std::memory_order_relaxed);
+    }
+
+    static inline uint64_t ticks() {
+#if defined(__aarch64__)
+        // the generic timer is readable from user space on every arm64 device
+        uint64_t value;
+        __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(value));
+        return value;
+#else
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+#endif
+    }
+private:
+    static void *loop(void *arg);
+    void adjust(uint64_t elapsed);
+    void change(uint32_t level, uint32_t cost);
+private:
+    uint32_t              mLimit;
+    uint32_t              mDepth;
+    void                  (*mApply)(uint32_t limit, uint32_t depth);
+    std::atomic<uint32_t> mBudget;
+    std::atomic<bool>     mRunning;
+    pthread_t             mThread;
+    uint64_t              mFrequency;
+    uint64_t              mStart;
+    uint64_t              mSpent;
+    uint32_t              mLevel;
+    uint32_t              mCost;
+    pthread_mutex_t       mMutex;
+    uint32_t              mCount;
+    Adjustment            mHistory[GOVERNOR_HISTORY];
+    GovernorSlot          mSlots[GOVERNOR_SLOTS];
+};
+
+#endif //GOVERNOR_H
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GUARD_H
+#define GUARD_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * Per-thread reentrancy guard of the proxies, held while the detector itself allocates. The host
+ * build keeps it in __thread. The shipped library targets releases without native ELF TLS, so the
+ * place is picked per device by create_guard: bit 0 of the thread slot from Q on, a pthread key
+ * before, one predictable branch in front of either.
+ */
+#if !defined(__ANDROID__)
+#define GUARD_TLS_MODEL __attribute__((tls_model("initial-exec")))
+
+extern __thread uint32_t guard GUARD_TLS_MODEL;
+
+static inline void create_guard() {}
+
+static inline bool is_guarded() {
+    return guard != 0;
+}
+
+static inline void set_guard(bool value) {
+    guard = value;
+}
+#else
+#include "thread_slot.h"
+
+extern pthread_key_t guard;
+
+// called once by JNI_OnLoad, the key is never deleted
+static inline void create_guard() {
+    init_thread_slot();
+    if (!thread_slot_ready) {
+        pthread_key_create(&guard, nullptr);
+    }
+}
+
+static inline bool is_guarded() {
+    if (thread_slot_ready) {
+        return (*thread_slot() & THREAD_SLOT_GUARD) != 0;
+    }
+    return (uintptr_t) pthread_getspecific(guard) != 0;
+}
+
+static inline void set_guard(bool value) {
+    if (thread_slot_ready) {
+        uintptr_t *slot = thread_slot();
+        *slot = (*slot & ~THREAD_SLOT_GUARD) | (uintptr_t) value;
+        return;
+    }
+    pthread_setspecific(guard, (void *) (uintptr_t) value);
+}
+#endif
+
+#endif //GUARD_H
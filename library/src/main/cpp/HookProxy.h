@@ -17,8 +17,13 @@
 #ifndef HOOK_PROXY_H
 #define HOOK_PROXY_H
 
+#include <new>
+#include <cstdarg>
 #include <cstdlib>
+#include <dlfcn.h>
+#include <malloc.h>
 #include <pthread.h>
+#include <sched.h>
 
 #include <unwind.h>
 #include <sys/mman.h>
@@ -35,40 +40,174 @@
 
 #include "And64InlineHook.hpp"
 #include "backtrace_64.h"
+#include "cfi_64.h"
 
 #endif
 
 #include "Logger.h"
 #include "Raphael.h"
+#include "Guard.h"
+#include "Sampler.h"
+#include "EventLog.h"
+#include "AddressFilter.hpp"
+#include "Governor.h"
+#include "AsyncUnwinder.h"
 
 //**************************************************************************************************
 static Cache *cache = nullptr;
-static pthread_key_t guard;
-static volatile uint32_t limit;
-static volatile uint32_t depth;
-static volatile uint32_t isPss;
-static volatile uint32_t isVss;
+static EventLog *events = nullptr;
+static AddressFilter filter;
+static Governor *governor = nullptr;
+static AsyncUnwinder *unwinder = nullptr;
+// set while some modules are selected to be unwound by their CFI
+static bool unwind_cfi = false;
+// one word, so that a proxy never sees half of a reconfiguration
+static std::atomic<uint32_t> configs(0);
+// proxies between reading the pointers above and their last use of them, see drain_proxies
+static std::atomic<uint32_t> inflight(0);
+/*
+ * Frees that passed the filter but had no record. Only recorded blocks are added to the filter, so
+ * these are its false positives, plus blocks a batch dropped when publishing them to a full cache.
+ */
+static std::atomic<uint64_t> unmatched(0);
 
-void update_configs(Cache *pNew, uint32_t params) {
-    cache = (pNew ? pNew : cache);
-    limit = (params & LIMIT_MASK);
-    depth = (params & DEPTH_MASK) >> 16;
-    isPss = (params & ALLOC_MODE) != 0;
-    isVss = (params & MAP64_MODE) != 0;
+void update_events(EventLog *pNew) {
+    events = pNew;
+}
+
+void update_governor(Governor *pNew) {
+    governor = pNew;
+}
+
+void update_unwinder(AsyncUnwinder *pNew) {
+    unwinder = pNew;
+}
+
+void update_unwind_cfi(bool pNew) {
+    unwind_cfi = pNew;
+}
+
+// once the pointers are cleared, waits for the proxies that may still use what they pointed to
+void drain_proxies() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (inflight.load(std::memory_order_acquire) != 0) {
+        sched_yield();
+    }
+}
+
+void update_effort(uint32_t pLimit, uint32_t pDepth) {
+    uint32_t params = configs.load(std::memory_order_relaxed);
+    uint32_t effort;
+    do {
+        effort = (params & ~(LIMIT_MASK | DEPTH_MASK)) | (pLimit & LIMIT_MASK) | ((pDepth << 16) & DEPTH_MASK);
+    } while (!configs.compare_exchange_weak(params, effort, std::memory_order_release, std::memory_order_relaxed));
 }
 
 //**************************************************************************************************
-static inline void insert_memory_backtrace(void *address, size_t size) {
-    Backtrace backtrace;
-    backtrace.depth = 0;
+// whether an allocation is recorded, a sampled one is recorded with its weight as size
+template<uint32_t MODE>
+static inline bool should_track(uint32_t params, size_t *size) {
+    if (!(MODE & SAMPLE_MODE)) {
+        return *size >= (params & LIMIT_MASK);
+    }
+    // the detector's own allocations must not consume samples of the app
+    if (is_guarded()) {
+        return false;
+    }
+    *size = sample_size(*size, params & LIMIT_MASK);
+    return *size != 0;
+}
+
+static inline bool record_tracked(uintptr_t address, size_t size, Backtrace *backtrace) {
+    Cache *pCache = cache;
+    if (pCache == nullptr || !pCache->insert(address, size, backtrace)) {
+        return false;
+    }
+
+    EventLog *log = events;
+    if (log != nullptr) {
+        log->insert(address, size, backtrace);
+    }
+    return true;
+}
+
+// called by the async unwinder once it has unwound a capture, whose address is in the filter
+void record_memory_backtrace(uintptr_t address, size_t size, Backtrace *backtrace) {
+    if (!record_tracked(address, size, backtrace)) {
+        filter.del(address);
+    }
+}
+
+static inline void insert_memory_backtrace(void *address, size_t size, uint32_t params) {
+    inflight.fetch_add(1, std::memory_order_seq_cst);
+    uint32_t depth = (params & DEPTH_MASK) >> 16;
+    Governor *pGovernor = governor;
+    uint64_t begin = pGovernor != nullptr ? Governor::ticks() : 0;
+
+    // a capture is in the filter before the unwinder can record it, so that a free can cancel it
+    AsyncUnwinder *pUnwinder = unwinder;
+    bool captured = false;
+    if (pUnwinder != nullptr) {
+        filter.add((uintptr_t) address);
+        captured = pUnwinder->capture((uintptr_t) address, size, depth);
+        if (!captured) {
+            filter.del((uintptr_t) address);
+        }
+    }
+    if (!captured) {
+        Backtrace backtrace;
+        backtrace.depth = 0;
 
 #ifdef __arm__
-    backtrace.depth = libudf_unwind_backtrace(backtrace.trace, 2, depth + 1);
+        backtrace.depth = libudf_unwind_backtrace(backtrace.trace, 2, depth + 1);
 #else
-    backtrace.depth = unwind_backtrace(backtrace.trace, depth + 1);
+        if (params & HYBRID_UNWIND) {
+            backtrace.depth = unwind_backtrace_hybrid(backtrace.trace, depth + 1, unwind_cfi);
+        } else if (unwind_cfi) {
+            backtrace.depth = unwind_backtrace_cfi(backtrace.trace, depth + 1);
+        } else {
+            backtrace.depth = unwind_backtrace(backtrace.trace, depth + 1);
+        }
 #endif
 
-    cache->insert((uintptr_t) address, size, &backtrace);
+        // the block isn't returned yet, nothing can free it before it is in the filter
+        if (record_tracked((uintptr_t) address, size, &backtrace)) {
+            filter.add((uintptr_t) address);
+        }
+    }
+
+    if (pGovernor != nullptr) {
+        pGovernor->account(Governor::ticks() - begin);
+    }
+    inflight.fetch_sub(1, std::memory_order_release);
+}
+
+static inline void remove_tracked(Cache *pCache, uintptr_t address) {
+    // a capture not unwound yet never reached the cache or the event log
+    AsyncUnwinder *pUnwinder = unwinder;
+    if (pUnwinder != nullptr && pUnwinder->cancel(address)) {
+        filter.del(address);
+        return;
+    }
+    if (!pCache->remove(address)) {
+        unmatched.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    filter.del(address);
+
+    EventLog *log = events;
+    if (log != nullptr) {
+        log->remove(address);
+    }
+}
+
+static inline void remove_memory_backtrace(void *address) {
+    inflight.fetch_add(1, std::memory_order_seq_cst);
+    Cache *pCache = cache;
+    if (pCache != nullptr && filter.contains((uintptr_t) address)) {
+        remove_tracked(pCache, (uintptr_t) address);
+    }
+    inflight.fetch_sub(1, std::memory_order_release);
 }
 
 //**************************************************************************************************
@@ -90,115 +229,371 @@ static int (*munmap_origin)(void *, size_t) = munmap;
 
 static void (*pthread_exit_origin)(void *) = pthread_exit;
 
+static int (*dlclose_origin)(void *) = dlclose;
+
+static int (*posix_memalign_origin)(void **, size_t, size_t) = posix_memalign;
+
+static void *(*mremap_origin)(void *, size_t, size_t, int, ...) = mremap;
+
+// newer than the minimum api level, or 32-bit only, these are looked up in libc at register
+static void *(*aligned_alloc_origin)(size_t, size_t) = nullptr;
+
+static void *(*valloc_origin)(size_t) = nullptr;
+
+static void *(*pvalloc_origin)(size_t) = nullptr;
+
+static void *(*reallocarray_origin)(void *, size_t, size_t) = nullptr;
+
+/*
+ * Only hooked in plt/got, inline the default ones are already seen as malloc and free. The app
+ * may replace them or bring its own libc++, so these are what the slot held before it was hooked,
+ * this library's own are only placeholders until then.
+ *
+ * There is one origin per operator, not per library, every hooked slot overwrites it and the last
+ * one wins. The linker binds the slots of all libraries to the same global definition, so they
+ * normally agree. A library in its own namespace, with its own libc++_shared, is called through
+ * whichever definition was hooked last.
+ */
+static void *(*new_origin)(size_t) = ::operator new;
+
+static void *(*new_array_origin)(size_t) = ::operator new[];
+
+static void (*delete_origin)(void *) = ::operator delete;
+
+static void (*delete_array_origin)(void *) = ::operator delete[];
+
+// sized delete is C++14, this library is built as C++11 and may ignore the size as well
+static void delete_sized_placeholder(void *address, size_t) {
+    delete_origin(address);
+}
+
+static void delete_array_sized_placeholder(void *address, size_t) {
+    delete_array_origin(address);
+}
+
+static void (*delete_sized_origin)(void *, size_t) = delete_sized_placeholder;
+
+static void (*delete_array_sized_origin)(void *, size_t) = delete_array_sized_placeholder;
+
 //**************************************************************************************************
-static void *malloc_proxy(size_t size) {
-    if (isPss && size >= limit && !(uintptr_t) pthread_getspecific(guard)) {
-        pthread_setspecific(guard, (void *) 1);
-        void *address = malloc_origin(size);
-        if (address != NULL) {
-            insert_memory_backtrace(address, size);
-        }
-        pthread_setspecific(guard, (void *) 0);
-        return address;
-    } else {
-        return malloc_origin(size);
+// allocate runs the origin, the record is only taken when MODE tracks this kind of allocation
+template<uint32_t MODE, uint32_t KIND, typename Allocate>
+static inline void *record_alloc(size_t size, void *failed, Allocate allocate) {
+    if (!(MODE & KIND)) {
+        return allocate();
+    }
+    uint32_t params = configs.load(std::memory_order_relaxed);
+    size_t tracked = size;
+    if (!should_track<MODE>(params, &tracked) || is_guarded()) {
+        return allocate();
     }
+    set_guard(true);
+    void *address = allocate();
+    if (address != failed) {
+        insert_memory_backtrace(address, tracked, params);
+    }
+    set_guard(false);
+    return address;
 }
 
-static void *calloc_proxy(size_t count, size_t bytes) {
-    uint size = count * bytes;
-    if (isPss && size >= limit && !(uintptr_t) pthread_getspecific(guard)) {
-        pthread_setspecific(guard, (void *) 1);
-        void *address = calloc_origin(count, bytes);
-        if (address != NULL) {
-            insert_memory_backtrace(address, size);
-        }
-        pthread_setspecific(guard, (void *) 0);
-        return address;
-    } else {
-        return calloc_origin(count, bytes);
+template<uint32_t MODE>
+static void *malloc_variant(size_t size) {
+    return record_alloc<MODE, ALLOC_MODE>(size, NULL, [=] { return malloc_origin(size); });
+}
+
+template<uint32_t MODE>
+static void *calloc_variant(size_t count, size_t bytes) {
+    return record_alloc<MODE, ALLOC_MODE>(count * bytes, NULL, [=] { return calloc_origin(count, bytes); });
+}
+
+template<uint32_t MODE>
+static void *memalign_variant(size_t alignment, size_t size) {
+    return record_alloc<MODE, ALLOC_MODE>(size, NULL, [=] { return memalign_origin(alignment, size); });
+}
+
+template<uint32_t MODE>
+static void *mmap_variant(void *ptr, size_t size, int port, int flags, int fd, off_t offset) {
+    return record_alloc<MODE, MAP64_MODE>(size, MAP_FAILED, [=] { return mmap_origin(ptr, size, port, flags, fd, offset); });
+}
+
+template<uint32_t MODE>
+static void *mmap64_variant(void *ptr, size_t size, int port, int flags, int fd, off64_t offset) {
+    return record_alloc<MODE, MAP64_MODE>(size, MAP_FAILED, [=] { return mmap64_origin(ptr, size, port, flags, fd, offset); });
+}
+
+template<uint32_t MODE>
+static int posix_memalign_variant(void **memptr, size_t alignment, size_t size) {
+    int result = 0;
+    void *address = record_alloc<MODE, ALLOC_MODE>(size, NULL, [&] {
+        void *block = NULL;
+        result = posix_memalign_origin(&block, alignment, size);
+        return result == 0 ? block : NULL;
+    });
+    if (result == 0) {
+        *memptr = address;
     }
+    return result;
 }
 
-static void *realloc_proxy(void *ptr, size_t size) {
-    if (isPss && !(uintptr_t) pthread_getspecific(guard)) {
-        pthread_setspecific(guard, (void *) 1);
-        void *address = realloc_origin(ptr, size);
-        if (ptr != NULL && (size == 0 || address != NULL)) {
-            cache->remove((uintptr_t) ptr);
-        }
+template<uint32_t MODE>
+static void *aligned_alloc_variant(size_t alignment, size_t size) {
+    return record_alloc<MODE, ALLOC_MODE>(size, NULL, [=] { return aligned_alloc_origin(alignment, size); });
+}
 
-        if (address != NULL && size >= limit) {
-            insert_memory_backtrace(address, size);
-        }
-        pthread_setspecific(guard, (void *) 0);
-        return address;
-    } else {
-        return realloc_origin(ptr, size);
+template<uint32_t MODE>
+static void *valloc_variant(size_t size) {
+    return record_alloc<MODE, ALLOC_MODE>(size, NULL, [=] { return valloc_origin(size); });
+}
+
+template<uint32_t MODE>
+static void *pvalloc_variant(size_t size) {
+    return record_alloc<MODE, ALLOC_MODE>(size, NULL, [=] { return pvalloc_origin(size); });
+}
+
+// operator new can throw, the guard is given back before the exception leaves the proxy
+template<uint32_t MODE, typename New>
+static inline void *record_new(size_t size, New allocate) {
+    bool guarded = is_guarded();
+    try {
+        return record_alloc<MODE, ALLOC_MODE>(size, NULL, allocate);
+    } catch (...) {
+        set_guard(guarded);
+        throw;
     }
 }
 
+template<uint32_t MODE>
+static void *new_variant(size_t size) {
+    return record_new<MODE>(size, [=] { return new_origin(size); });
+}
+
+template<uint32_t MODE>
+static void *new_array_variant(size_t size) {
+    return record_new<MODE>(size, [=] { return new_array_origin(size); });
+}
+
+// reallocate moves ptr, which is released unless it fails, realloc also releases it on size 0
+template<uint32_t MODE, uint32_t KIND, typename Reallocate>
+static inline void *record_realloc(void *ptr, size_t size, void *failed, Reallocate reallocate) {
+    // a block recorded before its mode was turned off still has to leave the cache
+    bool recorded = ptr != NULL && filter.contains((uintptr_t) ptr) && cache != nullptr;
+    if ((!(MODE & KIND) && !recorded) || is_guarded()) {
+        return reallocate();
+    }
+    uint32_t params = configs.load(std::memory_order_relaxed);
+    size_t tracked = size;
+    bool track = (MODE & KIND) && should_track<MODE>(params, &tracked);
+    set_guard(true);
+    void *address = reallocate();
+    if (ptr != NULL && (address != failed || (KIND == ALLOC_MODE && size == 0))) {
+        remove_memory_backtrace(ptr);
+    }
+
+    if (address != failed && track) {
+        insert_memory_backtrace(address, tracked, params);
+    }
+    set_guard(false);
+    return address;
+}
+
+template<uint32_t MODE>
+static void *realloc_variant(void *ptr, size_t size) {
+    return record_realloc<MODE, ALLOC_MODE>(ptr, size, NULL, [=] { return realloc_origin(ptr, size); });
+}
+
+template<uint32_t MODE>
+static void *reallocarray_variant(void *ptr, size_t count, size_t bytes) {
+    size_t size;
+    if (__builtin_mul_overflow(count, bytes, &size)) {
+        return reallocarray_origin(ptr, count, bytes);
+    }
+    return record_realloc<MODE, ALLOC_MODE>(ptr, size, NULL, [=] { return reallocarray_origin(ptr, count, bytes); });
+}
+
+template<uint32_t MODE>
+static void *mremap_variant(void *ptr, size_t old_size, size_t size, int flags, void *target) {
+    return record_realloc<MODE, MAP64_MODE>(ptr, size, MAP_FAILED, [=] { return mremap_origin(ptr, old_size, size, flags, target); });
+}
+
+typedef struct {
+    void *(*malloc)(size_t);
+    void *(*calloc)(size_t, size_t);
+    void *(*realloc)(void *, size_t);
+    void *(*memalign)(size_t, size_t);
+    void *(*mmap)(void *, size_t, int, int, int, off_t);
+    void *(*mmap64)(void *, size_t, int, int, int, off64_t);
+    int (*posix_memalign)(void **, size_t, size_t);
+    void *(*aligned_alloc)(size_t, size_t);
+    void *(*valloc)(size_t);
+    void *(*pvalloc)(size_t);
+    void *(*reallocarray)(void *, size_t, size_t);
+    void *(*mremap)(void *, size_t, size_t, int, void *);
+    void *(*new_)(size_t);
+    void *(*new_array)(size_t);
+} ProxySet;
+
+#define PROXY_SET(MODE) {malloc_variant<MODE>, calloc_variant<MODE>, realloc_variant<MODE>, \
+        memalign_variant<MODE>, mmap_variant<MODE>, mmap64_variant<MODE>, posix_memalign_variant<MODE>, \
+        aligned_alloc_variant<MODE>, valloc_variant<MODE>, pvalloc_variant<MODE>, reallocarray_variant<MODE>, \
+        mremap_variant<MODE>, new_variant<MODE>, new_array_variant<MODE>}
+
+// indexed by proxy_index, sampling only matters where something is tracked
+static const ProxySet sProxySets[] = {
+        PROXY_SET(0),
+        PROXY_SET(ALLOC_MODE),
+        PROXY_SET(MAP64_MODE),
+        PROXY_SET(ALLOC_MODE | MAP64_MODE),
+        PROXY_SET(SAMPLE_MODE),
+        PROXY_SET(SAMPLE_MODE | ALLOC_MODE),
+        PROXY_SET(SAMPLE_MODE | MAP64_MODE),
+        PROXY_SET(SAMPLE_MODE | ALLOC_MODE | MAP64_MODE)
+};
+
+static inline uint32_t proxy_index(uint32_t params) {
+    return ((params & ALLOC_MODE) ? 1 : 0) | ((params & MAP64_MODE) ? 2 : 0) | ((params & SAMPLE_MODE) ? 4 : 0);
+}
+
+static std::atomic<const ProxySet *> proxies(&sProxySets[0]);
+
+// blocks are removed as long as there is a cache, even if their mode was turned off since
+void update_configs(Cache *pNew, uint32_t params) {
+    cache = pNew;
+    configs.store(params, std::memory_order_release);
+    proxies.store(&sProxySets[proxy_index(params)], std::memory_order_release);
+}
+
+//**************************************************************************************************
+// the hooked entries only pick the variant of the active mode, the sets never change
+static void *malloc_proxy(size_t size) {
+    return proxies.load(std::memory_order_acquire)->malloc(size);
+}
+
+static void *calloc_proxy(size_t count, size_t bytes) {
+    return proxies.load(std::memory_order_acquire)->calloc(count, bytes);
+}
+
+static void *realloc_proxy(void *ptr, size_t size) {
+    return proxies.load(std::memory_order_acquire)->realloc(ptr, size);
+}
+
 static void *memalign_proxy(size_t alignment, size_t size) {
-    if (isPss && size >= limit && !(uintptr_t) pthread_getspecific(guard)) {
-        pthread_setspecific(guard, (void *) 1);
-        void *address = memalign_origin(alignment, size);
-        if (address != NULL) {
-            insert_memory_backtrace(address, size);
-        }
-        pthread_setspecific(guard, (void *) 0);
-        return address;
-    } else {
-        return memalign_origin(alignment, size);
+    return proxies.load(std::memory_order_acquire)->memalign(alignment, size);
+}
+
+static void *mmap_proxy(void *ptr, size_t size, int port, int flags, int fd, off_t offset) {
+    return proxies.load(std::memory_order_acquire)->mmap(ptr, size, port, flags, fd, offset);
+}
+
+static void *mmap64_proxy(void *ptr, size_t size, int port, int flags, int fd, off64_t offset) {
+    return proxies.load(std::memory_order_acquire)->mmap64(ptr, size, port, flags, fd, offset);
+}
+
+static int posix_memalign_proxy(void **memptr, size_t alignment, size_t size) {
+    return proxies.load(std::memory_order_acquire)->posix_memalign(memptr, alignment, size);
+}
+
+static void *aligned_alloc_proxy(size_t alignment, size_t size) {
+    return proxies.load(std::memory_order_acquire)->aligned_alloc(alignment, size);
+}
+
+static void *valloc_proxy(size_t size) {
+    return proxies.load(std::memory_order_acquire)->valloc(size);
+}
+
+static void *pvalloc_proxy(size_t size) {
+    return proxies.load(std::memory_order_acquire)->pvalloc(size);
+}
+
+static void *reallocarray_proxy(void *ptr, size_t count, size_t bytes) {
+    return proxies.load(std::memory_order_acquire)->reallocarray(ptr, count, bytes);
+}
+
+static void *mremap_proxy(void *ptr, size_t old_size, size_t size, int flags, ...) {
+    void *target = NULL;
+    if (flags & MREMAP_FIXED) {
+        va_list args;
+        va_start(args, flags);
+        target = va_arg(args, void *);
+        va_end(args);
     }
+    return proxies.load(std::memory_order_acquire)->mremap(ptr, old_size, size, flags, target);
+}
+
+static void *new_proxy(size_t size) {
+    return proxies.load(std::memory_order_acquire)->new_(size);
+}
+
+static void *new_array_proxy(size_t size) {
+    return proxies.load(std::memory_order_acquire)->new_array(size);
+}
+
+static inline bool should_remove(void *address) {
+    return address && filter.contains((uintptr_t) address) && cache != nullptr && !is_guarded();
 }
 
 static void free_proxy(void *address) {
-    if ((isVss | isPss) && address && !(uintptr_t) pthread_getspecific(guard)) {
-        pthread_setspecific(guard, (void *) 1);
+    if (should_remove(address)) {
+        set_guard(true);
         free_origin(address);
-        cache->remove((uintptr_t) address);
-        pthread_setspecific(guard, (void *) 0);
+        remove_memory_backtrace(address);
+        set_guard(false);
     } else {
         free_origin(address);
     }
 }
 
-static void *mmap_proxy(void *ptr, size_t size, int port, int flags, int fd, off_t offset) {
-    if (isVss && !(uintptr_t) pthread_getspecific(guard)) {
-        pthread_setspecific(guard, (void *) 1);
-        void *address = mmap_origin(ptr, size, port, flags, fd, offset);
-        if (address != MAP_FAILED) {
-            insert_memory_backtrace(address, size);
-        }
-        pthread_setspecific(guard, (void *) 0);
-        return address;
+static void delete_proxy(void *address) {
+    if (should_remove(address)) {
+        set_guard(true);
+        delete_origin(address);
+        remove_memory_backtrace(address);
+        set_guard(false);
     } else {
-        return mmap_origin(ptr, size, port, flags, fd, offset);
+        delete_origin(address);
     }
 }
 
-static void *mmap64_proxy(void *ptr, size_t size, int port, int flags, int fd, off64_t offset) {
-    if (isVss && !(uintptr_t) pthread_getspecific(guard)) {
-        pthread_setspecific(guard, (void *) 1);
-        void *address = mmap64_origin(ptr, size, port, flags, fd, offset);
-        if (address != MAP_FAILED) {
-            insert_memory_backtrace(address, size);
-        }
-        pthread_setspecific(guard, (void *) 0);
-        return address;
+static void delete_array_proxy(void *address) {
+    if (should_remove(address)) {
+        set_guard(true);
+        delete_array_origin(address);
+        remove_memory_backtrace(address);
+        set_guard(false);
+    } else {
+        delete_array_origin(address);
+    }
+}
+
+static void delete_sized_proxy(void *address, size_t size) {
+    if (should_remove(address)) {
+        set_guard(true);
+        delete_sized_origin(address, size);
+        remove_memory_backtrace(address);
+        set_guard(false);
     } else {
-        return mmap64_origin(ptr, size, port, flags, fd, offset);
+        delete_sized_origin(address, size);
+    }
+}
+
+static void delete_array_sized_proxy(void *address, size_t size) {
+    if (should_remove(address)) {
+        set_guard(true);
+        delete_array_sized_origin(address, size);
+        remove_memory_backtrace(address);
+        set_guard(false);
+    } else {
+        delete_array_sized_origin(address, size);
     }
 }
 
 static int munmap_proxy(void *address, size_t size) {
-    if (isVss && address && !(uintptr_t) pthread_getspecific(guard)) {
-        pthread_setspecific(guard, (void *) 1);
+    if (should_remove(address)) {
+        set_guard(true);
         int result = munmap_origin(address, size);
         if (result == 0) {
-            cache->remove((uintptr_t) address);
+            remove_memory_backtrace(address);
         }
-        pthread_setspecific(guard, (void *) 0);
+        set_guard(false);
         return result;
     } else {
         return munmap_origin(address, size);
@@ -207,16 +602,49 @@ static int munmap_proxy(void *address, size_t size) {
 
 static void pthread_exit_proxy(void *value) {
     pthread_attr_t attr;
-    if (isVss && pthread_getattr_np(pthread_self(), &attr) == 0) {
-        pthread_setspecific(guard, (void *) 1);
-        cache->remove((uintptr_t) attr.stack_base);
+    if (cache != nullptr && pthread_getattr_np(pthread_self(), &attr) == 0) {
+        void *stack;
+        size_t size;
+        set_guard(true);
+        if (pthread_attr_getstack(&attr, &stack, &size) == 0) {
+            remove_memory_backtrace(stack);
+        }
         pthread_attr_destroy(&attr);
-        pthread_setspecific(guard, (void *) 0);
+        set_guard(false);
     }
     pthread_exit_origin(value);
 }
 
+// unwind tables cached for a module must not outlive it, another one may be mapped at its place
+static int dlclose_proxy(void *handle) {
+    int result = dlclose_origin(handle);
+    bool guarded = is_guarded();
+    set_guard(true);
+#ifdef __arm__
+    libudf_invalidate_modules();
+#else
+    cfi_invalidate_modules();
+#endif
+    set_guard(guarded);
+    return result;
+}
+
 //**************************************************************************************************
+#if defined(__LP64__)
+#define OPERATOR_NEW "_Znwm"
+#define OPERATOR_NEW_ARRAY "_Znam"
+#define OPERATOR_DELETE_SIZED "_ZdlPvm"
+#define OPERATOR_DELETE_ARRAY_SIZED "_ZdaPvm"
+#else
+#define OPERATOR_NEW "_Znwj"
+#define OPERATOR_NEW_ARRAY "_Znaj"
+#define OPERATOR_DELETE_SIZED "_ZdlPvj"
+#define OPERATOR_DELETE_ARRAY_SIZED "_ZdaPvj"
+#endif
+#define OPERATOR_DELETE "_ZdlPv"
+#define OPERATOR_DELETE_ARRAY "_ZdaPv"
+
+// a null target is looked up in libc by name, and skipped if this libc doesn't have it
 static const void *sInline[][4] = {
         {
                 "malloc",
@@ -271,53 +699,163 @@ static const void *sInline[][4] = {
                 (void *) pthread_exit,
                 (void *) pthread_exit_proxy,
                 (void *) &pthread_exit_origin
+        },
+        {
+                "posix_memalign",
+                (void *) posix_memalign,
+                (void *) posix_memalign_proxy,
+                (void *) &posix_memalign_origin
+        },
+        {
+                "mremap",
+                (void *) mremap,
+                (void *) mremap_proxy,
+                (void *) &mremap_origin
+        },
+        {
+                "aligned_alloc",
+                nullptr,
+                (void *) aligned_alloc_proxy,
+                (void *) &aligned_alloc_origin
+        },
+        {
+                "valloc",
+                nullptr,
+                (void *) valloc_proxy,
+                (void *) &valloc_origin
+        },
+        {
+                "pvalloc",
+                nullptr,
+                (void *) pvalloc_proxy,
+                (void *) &pvalloc_origin
+        },
+        {
+                "reallocarray",
+                nullptr,
+                (void *) reallocarray_proxy,
+                (void *) &reallocarray_origin
         }
 };
 
-static const void *sPltGot[][2] = {
+static const void *sPltGot[][3] = {
         {
                 "malloc",
-                (void *) malloc_proxy
+                (void *) malloc_proxy,
+                (void *) &malloc_origin
         },
         {
                 "calloc",
-                (void *) calloc_proxy
+                (void *) calloc_proxy,
+                (void *) &calloc_origin
         },
         {
                 "realloc",
-                (void *) realloc_proxy
+                (void *) realloc_proxy,
+                (void *) &realloc_origin
         },
         {
                 "memalign",
-                (void *) memalign_proxy
+                (void *) memalign_proxy,
+                (void *) &memalign_origin
         },
         {
                 "free",
-                (void *) free_proxy
+                (void *) free_proxy,
+                (void *) &free_origin
         },
         {
                 "mmap",
-                (void *) mmap_proxy
+                (void *) mmap_proxy,
+                (void *) &mmap_origin
         },
         {
                 "mmap64",
-                (void *) mmap64_proxy
+                (void *) mmap64_proxy,
+                (void *) &mmap64_origin
         },
         {
                 "munmap",
-                (void *) munmap_proxy
+                (void *) munmap_proxy,
+                (void *) &munmap_origin
         },
         {
                 "pthread_exit",
-                (void *) pthread_exit_proxy
+                (void *) pthread_exit_proxy,
+                (void *) &pthread_exit_origin
+        },
+        {
+                "dlclose",
+                (void *) dlclose_proxy,
+                (void *) &dlclose_origin
+        },
+        {
+                "posix_memalign",
+                (void *) posix_memalign_proxy,
+                (void *) &posix_memalign_origin
+        },
+        {
+                "mremap",
+                (void *) mremap_proxy,
+                (void *) &mremap_origin
+        },
+        {
+                "aligned_alloc",
+                (void *) aligned_alloc_proxy,
+                (void *) &aligned_alloc_origin
+        },
+        {
+                "valloc",
+                (void *) valloc_proxy,
+                (void *) &valloc_origin
+        },
+        {
+                "pvalloc",
+                (void *) pvalloc_proxy,
+                (void *) &pvalloc_origin
+        },
+        {
+                "reallocarray",
+                (void *) reallocarray_proxy,
+                (void *) &reallocarray_origin
         }
 };
 
-static void invoke_je_free() {
-    int api_level = android_get_device_api_level();
-    if (api_level < __ANDROID_API_O__) {
-        return;
-    }
+// hooked with the slot's previous target saved in the origin, the last one hooked wins, see new_origin
+static const void *sOperators[][3] = {
+        {
+                OPERATOR_NEW,
+                (void *) new_proxy,
+                (void *) &new_origin
+        },
+        {
+                OPERATOR_NEW_ARRAY,
+                (void *) new_array_proxy,
+                (void *) &new_array_origin
+        },
+        {
+                OPERATOR_DELETE,
+                (void *) delete_proxy,
+                (void *) &delete_origin
+        },
+        {
+                OPERATOR_DELETE_ARRAY,
+                (void *) delete_array_proxy,
+                (void *) &delete_array_origin
+        },
+        {
+                OPERATOR_DELETE_SIZED,
+                (void *) delete_sized_proxy,
+                (void *) &delete_sized_origin
+        },
+        {
+                OPERATOR_DELETE_ARRAY_SIZED,
+                (void *) delete_array_sized_proxy,
+                (void *) &delete_array_sized_origin
+        }
+};
+
+static void *open_libc(int api_level) {
     void *handle;
     if (api_level < __ANDROID_API_Q__) {
 #if defined(__LP64__)
@@ -332,29 +870,61 @@ static void invoke_je_free() {
         handle = xdl_open("/apex/com.android.runtime/lib/bionic/libc.so");
 #endif
     }
-    if (handle == nullptr) {
-        LOGGER("invoke failed at xdl_open");
-        return;
-    }
+    return handle;
+}
+
+static void invoke_je_free(void *handle) {
     void *target = xdl_sym(handle, "je_free");
     if (target == nullptr) {
         LOGGER("invoke failed at xdl_sym");
     } else {
         sInline[4][1] = target;
     }
+}
+
+static void resolve_origins(bool inlined) {
+    int api_level = android_get_device_api_level();
+    void *handle = open_libc(api_level);
+    if (handle == nullptr) {
+        LOGGER("resolve failed at xdl_open");
+        return;
+    }
+    if (inlined && api_level >= __ANDROID_API_O__) {
+        invoke_je_free(handle);
+    }
+
+    const int PROXY_MAPPING_LENGTH = sizeof(sInline) / sizeof(sInline[0]);
+    for (int i = 0; i < PROXY_MAPPING_LENGTH; i++) {
+        if (sInline[i][1] == nullptr) {
+            sInline[i][1] = xdl_sym(handle, (const char *) sInline[i][0]);
+            *(void **) sInline[i][3] = (void *) sInline[i][1];
+        }
+    }
     xdl_close(handle);
 }
 
 //**************************************************************************************************
 void registerPltGotProxy(JNIEnv *env, jstring regex) {
+    resolve_origins(false);
+
     const char *focused = (char *) env->GetStringUTFChars(regex, 0);
     const int PROXY_MAPPING_LENGTH = sizeof(sPltGot) / sizeof(sPltGot[0]);
     for (int i = 0; i < PROXY_MAPPING_LENGTH; i++) {
+        if (*(void **) sPltGot[i][2] == nullptr) {
+            continue;
+        }
         if (0 !=
             xh_core_register(focused, (const char *) sPltGot[i][0], (void *) sPltGot[i][1], NULL)) {
             LOGGER("register focused failed: %s, %s", focused, (const char *) sPltGot[i][0]);
         }
     }
+    const int OPERATOR_MAPPING_LENGTH = sizeof(sOperators) / sizeof(sOperators[0]);
+    for (int i = 0; i < OPERATOR_MAPPING_LENGTH; i++) {
+        if (0 != xh_core_register(focused, (const char *) sOperators[i][0], (void *) sOperators[i][1],
+                                  (void **) sOperators[i][2])) {
+            LOGGER("register focused failed: %s, %s", focused, (const char *) sOperators[i][0]);
+        }
+    }
     env->ReleaseStringUTFChars(regex, focused);
 
     const char *ignored = ".*libraphael\\.so$";
@@ -363,6 +933,11 @@ void registerPltGotProxy(JNIEnv *env, jstring regex) {
             LOGGER("register ignored failed: %s, %s", ignored, (const char *) sPltGot[i][0]);
         }
     }
+    for (int i = 0; i < OPERATOR_MAPPING_LENGTH; i++) {
+        if (0 != xh_core_ignore(ignored, (const char *) sOperators[i][0])) {
+            LOGGER("register ignored failed: %s, %s", ignored, (const char *) sOperators[i][0]);
+        }
+    }
 
     if (0 != xh_core_refresh(0)) {
         LOGGER("refresh failed");
@@ -370,19 +945,24 @@ void registerPltGotProxy(JNIEnv *env, jstring regex) {
 }
 
 void registerInlineProxy(JNIEnv *env) {
-    invoke_je_free();
+    resolve_origins(true);
 
     const int PROXY_MAPPING_LENGTH = sizeof(sInline) / sizeof(sInline[0]);
 #ifdef __arm__
     for (int i = 0; i < PROXY_MAPPING_LENGTH; i++) {
+        if (sInline[i][1] == nullptr) {
+            continue;
+        }
         if (registerInlineHook((uint32_t) sInline[i][1], (uint32_t) sInline[i][2], (uint32_t **) sInline[i][3]) != ELE7EN_OK) {
             LOGGER("register inline hook failed: %s", (const char *) sInline[i][0]);
         }
     }
     inlineHookAll();
 #else
-    init_arm64_unwind();
     for (int i = 0; i < PROXY_MAPPING_LENGTH; i++) {
+        if (sInline[i][1] == nullptr) {
+            continue;
+        }
         A64HookFunction((void *) sInline[i][1], (void *) sInline[i][2], (void **) sInline[i][3]);
     }
 #endif
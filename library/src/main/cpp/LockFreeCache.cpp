@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "Logger.h"
+#include "MemoryCache.h"
+#include "BinaryReport.h"
+#include "LockFreeCache.h"
+
+//**************************************************************************************************
+// four neighbouring blocks share a cache line of slots, as in AggregateCache, the lines are scattered
+static inline uint32_t slot_hash(uintptr_t address) {
+    uint32_t key = (uint32_t) (address >> ADDR_HASH_OFFSET);
+    return ((key >> 2) * 0x9E3779B1u) >> (34 - SLOT_INDEX_BITS) << 2 | (key & 3);
+}
+
+static inline AllocSlot *slot_at(AllocSlot *table, uint32_t index) {
+    return &table[index & (SLOT_INDEX_SIZE - 1)];
+}
+
+LockFreeCache::LockFreeCache(const char *sdcard) : Cache(sdcard), alloc_full(false) {
+    // zero pages are valid empty slots, so the table is only committed where it is used
+    void *table = mmap(nullptr, SLOT_INDEX_SIZE * sizeof(AllocSlot), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    alloc_table = (AllocSlot *) (table == MAP_FAILED ? nullptr : table);
+    alloc_cache = new AllocPool(ALLOC_CACHE_LIMIT);
+    alloc_depot = new StackDepot();
+}
+
+LockFreeCache::~LockFreeCache() {
+    if (alloc_table != nullptr) {
+        munmap(alloc_table, SLOT_INDEX_SIZE * sizeof(AllocSlot));
+    }
+    delete alloc_cache;
+    delete alloc_depot;
+}
+
+void LockFreeCache::reset() {
+    alloc_cache->reset();
+    alloc_depot->reset();
+    madvise(alloc_table, SLOT_INDEX_SIZE * sizeof(AllocSlot), MADV_DONTNEED);
+    alloc_full.store(false, std::memory_order_relaxed);
+}
+
+bool LockFreeCache::insert(uintptr_t address, size_t size, Backtrace *backtrace) {
+    AllocNode *p = alloc_cache->apply();
+    if (p == nullptr) {
+        if (!alloc_full.exchange(true, std::memory_order_relaxed)) {
+            LOGGER("Alloc cache is full!!!!!!!!");
+        }
+        return false;
+    }
+
+    p->addr = address;
+    p->size = size;
+    uint depth = backtrace->depth > 2 ? backtrace->depth - 2 : 1;
+    p->stack = alloc_depot->intern(backtrace->trace + 2, depth);
+
+    uint32_t hash = slot_hash(address);
+    uint32_t value = alloc_cache->index(p);
+    uint32_t moved = SLOT_PROBE_SIZE;
+    for (;;) {
+        uint i = 0;
+        for (; i < SLOT_PROBE_SIZE; i++) {
+            AllocSlot *slot = slot_at(alloc_table, hash + i);
+            uintptr_t key = slot->key.load(std::memory_order_relaxed);
+            if (key != SLOT_EMPTY && key != SLOT_TOMBS) {
+                continue;
+            }
+            if (slot->key.compare_exchange_strong(key, SLOT_BUSY, std::memory_order_acquire, std::memory_order_relaxed)) {
+                slot->value.store(value, std::memory_order_relaxed);
+                slot->key.store(address, std::memory_order_seq_cst);
+                break;
+            }
+        }
+        if (moved != SLOT_PROBE_SIZE) {
+            release(hash + moved);
+        }
+        if (i == SLOT_PROBE_SIZE) {
+            if (!alloc_full.exchange(true, std::memory_order_relaxed)) {
+                LOGGER("Alloc table is full!!!!!!!!");
+            }
+            alloc_cache->recycle(p);
+            return false;
+        }
+        if (settle(hash, i)) {
+            return true;
+        }
+        // a slot before it was emptied under this probe, the entry is moved there
+        AllocSlot *slot = slot_at(alloc_table, hash + i);
+        uintptr_t key = address;
+        // the block was freed meanwhile, so it had been recorded
+        if (!slot->key.compare_exchange_strong(key, SLOT_BUSY, std::memory_order_acquire, std::memory_order_relaxed)) {
+            return true;
+        }
+        moved = i;
+    }
+}
+
+/*
+ * Whether the entry published at hash + index is found by a probe from hash. A slot is only
+ * emptied while the one after it is empty, so once each slot before the entry was seen taken,
+ * from the entry down, none of them can be emptied while the entry stays.
+ */
+bool LockFreeCache::settle(uint32_t hash, uint32_t index) {
+    while (index-- > 0) {
+        AllocSlot *slot = slot_at(alloc_table, hash + index);
+        uintptr_t key;
+        while ((key = slot->key.load(std::memory_order_seq_cst)) == SLOT_BUSY) {
+            sched_yield();
+        }
+        if (key == SLOT_EMPTY) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the caller holds the slot at index, the tombstones right before it are emptied along with it
+void LockFreeCache::release(uint32_t index) {
+    for (uint i = 0;; i++, index--) {
+        AllocSlot *slot = slot_at(alloc_table, index);
+        if (i == SLOT_PROBE_SIZE || slot_at(alloc_table, index + 1)->key.load(std::memory_order_seq_cst) != SLOT_EMPTY) {
+            slot->key.store(SLOT_TOMBS, std::memory_order_release);
+            return;
+        }
+        slot->key.store(SLOT_EMPTY, std::memory_order_release);
+        uintptr_t key = SLOT_TOMBS;
+        if (!slot_at(alloc_table, index - 1)->key.compare_exchange_strong(key, SLOT_BUSY, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return;
+        }
+    }
+}
+
+bool LockFreeCache::remove(uintptr_t address) {
+    uint32_t hash = slot_hash(address);
+    for (uint i = 0; i < SLOT_PROBE_SIZE; i++) {
+        AllocSlot *slot = slot_at(alloc_table, hash + i);
+        uintptr_t key = slot->key.load(std::memory_order_acquire);
+        if (key == SLOT_EMPTY) {
+            return false;
+        } else if (key != address) {
+            continue;
+        }
+        if (slot->key.compare_exchange_strong(key, SLOT_BUSY, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            uint32_t index = slot->value.load(std::memory_order_relaxed);
+            release(hash + i);
+            alloc_cache->recycle(alloc_cache->at(index));
+            return true;
+        }
+        return false;
+    }
+    return false;
+}
+
+void LockFreeCache::print() {
+    char path[MAX_BUFFER_SIZE];
+    sprintf(path, mBinary ? "%s/report.bin" : "%s/report", mSpace);
+
+    FILE *report = fopen(path, mBinary ? "wb" : "w");
+    if (report == nullptr) {
+        LOGGER("print report failed, can't open report file");
+        return;
+    }
+    std::vector<AllocNode> nodes;
+
+    AllocNode node;
+    for (uint i = 0; i < SLOT_INDEX_SIZE; i++) {
+        AllocSlot *slot = &alloc_table[i];
+        uintptr_t key = slot->key.load(std::memory_order_acquire);
+        if (key == SLOT_EMPTY || key == SLOT_TOMBS || key == SLOT_BUSY) {
+            continue;
+        }
+        uint32_t index = slot->value.load(std::memory_order_relaxed);
+        memcpy(&node, alloc_cache->at(index), sizeof(AllocNode));
+        // the node may be recycled while it is copied, keep it only if the slot is unchanged
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->key.load(std::memory_order_relaxed) != key || slot->value.load(std::memory_order_relaxed) != index) {
+            continue;
+        }
+        nodes.push_back(node);
+    }
+
+    if (mBinary) {
+        write_binary(report, alloc_depot, nodes.data(), nodes.size());
+    } else {
+        write_report(report, alloc_depot, nodes.data(), nodes.size());
+    }
+    fclose(report);
+}
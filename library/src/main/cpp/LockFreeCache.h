@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LOCK_FREE_CACHE_H
+#define LOCK_FREE_CACHE_H
+
+#include <atomic>
+
+#include "Cache.h"
+#include "AllocPool.hpp"
+#include "StackDepot.h"
+
+// twice the pool's ceiling, so that the table is at most half full, committed only where it is used
+#define SLOT_INDEX_BITS (__builtin_ctz(ALLOC_CACHE_LIMIT) + 1)
+#define SLOT_INDEX_SIZE ((uint32_t) ALLOC_CACHE_LIMIT * 2)
+#define SLOT_PROBE_SIZE 64
+
+// key states besides a live address, real addresses are never below 4
+#define SLOT_EMPTY 0
+#define SLOT_TOMBS 1
+#define SLOT_BUSY  2
+
+typedef struct {
+    std::atomic<uintptr_t> key;
+    std::atomic<uint32_t>  value;
+} AllocSlot;
+
+/**
+ * Open-addressing address table, an entry is claimed by CAS on its key, so neither insert nor
+ * remove takes a lock. Entries are only placed within SLOT_PROBE_SIZE of their home slot, which
+ * bounds the probes of a remove for an address that was never recorded. A removed entry is left
+ * as a tombstone only while a later slot is taken, otherwise it and the tombstones before it are
+ * emptied again, see settle().
+ */
+class LockFreeCache : public Cache {
+public:
+    LockFreeCache(const char *space);
+    ~LockFreeCache();
+public:
+    void reset();
+    bool insert(uintptr_t address, size_t size, Backtrace *backtrace);
+    bool remove(uintptr_t address);
+    void print();
+private:
+    bool settle(uint32_t hash, uint32_t index);
+    void release(uint32_t index);
+private:
+    AllocSlot *alloc_table;
+    AllocPool *alloc_cache;
+    StackDepot *alloc_depot;
+    std::atomic<bool> alloc_full;
+};
+
+#endif //LOCK_FREE_CACHE_H
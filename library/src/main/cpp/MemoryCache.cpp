@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <vector>
 #include <cstring>
 #include <cstdlib>
 #include <pthread.h>
@@ -22,8 +24,8 @@
 #include <xdl.h>
 
 #include "Logger.h"
-#include "MapData.h"
 #include "MemoryCache.h"
+#include "BinaryReport.h"
 
 //**************************************************************************************************
 inline AllocNode *remove_alloc(AllocNode **header, uintptr_t address) {
@@ -45,138 +47,235 @@ inline AllocNode *remove_alloc(AllocNode **header, uintptr_t address) {
     }
 }
 
-void write_trace(FILE *output, AllocNode *alloc_node, MapData *map_data, void **dl_cache) {
-    fprintf(output, STACK_FORMAT_HEADER, alloc_node->addr, alloc_node->size);
-    for (int i = 0; alloc_node->trace[i] != 0; i++) {
-        uintptr_t pc = alloc_node->trace[i];
-        Dl_info info;
-        if (0 == xdl_addr((void *) pc, &info, dl_cache) || (uintptr_t) info.dli_fbase > pc) {
-            fprintf(
-                    output,
-                    STACK_FORMAT_UNKNOWN,
-                    pc
+static size_t write_frame(char *buffer, size_t length, uintptr_t pc, void **dl_cache) {
+    int written;
+    Dl_info info;
+    if (0 == xdl_addr((void *) pc, &info, dl_cache) || (uintptr_t) info.dli_fbase > pc) {
+        written = snprintf(
+                buffer,
+                length,
+                STACK_FORMAT_UNKNOWN,
+                pc
+        );
+    } else {
+        if (nullptr == info.dli_fname || '\0' == info.dli_fname[0]) {
+            written = snprintf(
+                    buffer,
+                    length,
+                    STACK_FORMAT_ANONYMOUS,
+                    pc - (uintptr_t) info.dli_fbase,
+                    (uintptr_t) info.dli_fbase
             );
         } else {
-            if (nullptr == info.dli_fname || '\0' == info.dli_fname[0]) {
-                fprintf(
-                        output,
-                        STACK_FORMAT_ANONYMOUS,
+            if (nullptr == info.dli_sname || '\0' == info.dli_sname[0]) {
+                written = snprintf(
+                        buffer,
+                        length,
+                        STACK_FORMAT_FILE,
                         pc - (uintptr_t) info.dli_fbase,
-                        (uintptr_t) info.dli_fbase
+                        info.dli_fname
                 );
             } else {
-                if (nullptr == info.dli_sname || '\0' == info.dli_sname[0]) {
-                    fprintf(
-                            output,
-                            STACK_FORMAT_FILE,
+                int s;
+                const char *symbol = __cxxabiv1::__cxa_demangle(
+                        info.dli_sname,
+                        nullptr,
+                        nullptr,
+                        &s
+                );
+                if (0 == (uintptr_t) info.dli_saddr || (uintptr_t) info.dli_saddr > pc) {
+                    written = snprintf(
+                            buffer,
+                            length,
+                            STACK_FORMAT_FILE_NAME,
                             pc - (uintptr_t) info.dli_fbase,
-                            info.dli_fname
+                            info.dli_fname,
+                            symbol == nullptr ? info.dli_sname : symbol
                     );
                 } else {
-                    int s;
-                    const char *symbol = __cxxabiv1::__cxa_demangle(
-                            info.dli_sname,
-                            nullptr,
-                            nullptr,
-                            &s
+                    written = snprintf(
+                            buffer,
+                            length,
+                            STACK_FORMAT_FILE_NAME_LINE,
+                            pc - (uintptr_t) info.dli_fbase,
+                            info.dli_fname,
+                            symbol == nullptr ? info.dli_sname : symbol,
+                            pc - (uintptr_t) info.dli_saddr
                     );
-                    if (0 == (uintptr_t) info.dli_saddr || (uintptr_t) info.dli_saddr > pc) {
-                        fprintf(
-                                output,
-                                STACK_FORMAT_FILE_NAME,
-                                pc - (uintptr_t) info.dli_fbase,
-                                info.dli_fname,
-                                symbol == nullptr ? info.dli_sname : symbol
-                        );
-                    } else {
-                        fprintf(
-                                output,
-                                STACK_FORMAT_FILE_NAME_LINE,
-                                pc - (uintptr_t) info.dli_fbase,
-                                info.dli_fname,
-                                symbol == nullptr ? info.dli_sname : symbol,
-                                pc - (uintptr_t) info.dli_saddr
-                        );
-                    }
-                    if (symbol != nullptr) {
-                        free((void *) symbol);
-                    }
+                }
+                if (symbol != nullptr) {
+                    free((void *) symbol);
                 }
             }
         }
     }
+    return written < 0 || (size_t) written >= length ? 0 : (size_t) written;
 }
 
-MemoryCache::MemoryCache(const char *sdcard) : Cache(sdcard) {
-    pthread_mutex_init(&alloc_mutex, NULL);
-    alloc_cache = new AllocPool(ALLOC_CACHE_SIZE);
+size_t write_trace(char *buffer, size_t length, const uintptr_t *trace, uint32_t depth, void **dl_cache) {
+    size_t used = 0;
+    buffer[0] = '\0';
+    for (uint32_t i = 0; i < depth && trace[i] != 0; i++) {
+        size_t written = write_frame(buffer + used, length - used, trace[i], dl_cache);
+        if (written == 0) {
+            buffer[used] = '\0';
+            break;
+        }
+        used += written;
+    }
+    return used;
+}
+
+void write_report(FILE *output, StackDepot *depot, AllocNode *nodes, size_t count, bool merged) {
+    // grouped by stack id, so that every unique stack is symbolized only once
+    std::sort(nodes, nodes + count, [](const AllocNode &a, const AllocNode &b) {
+        return a.stack < b.stack;
+    });
+
+    void *dl_cache = nullptr;
+    char *buffer = (char *) malloc(MAX_TRACE_DEPTH * MAX_BUFFER_SIZE);
+    uint32_t stack = 0;
+    buffer[0] = '\0';
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 || nodes[i].stack != stack) {
+            const uintptr_t *trace;
+            uint32_t depth = depot->fetch(nodes[i].stack, &trace);
+            stack = nodes[i].stack;
+            write_trace(buffer, MAX_TRACE_DEPTH * MAX_BUFFER_SIZE, trace, depth, &dl_cache);
+        }
+        if (merged) {
+            size_t j = i;
+            size_t size = 0;
+            for (; j < count && nodes[j].stack == stack; j++) {
+                size += nodes[j].size;
+            }
+            fprintf(output, STACK_FORMAT_GROUP, nodes[i].addr, size, (uint) (j - i));
+            i = j - 1;
+        } else {
+            fprintf(output, STACK_FORMAT_HEADER, nodes[i].addr, nodes[i].size);
+        }
+        fputs(buffer, output);
+    }
+    free(buffer);
+    xdl_addr_clean(&dl_cache);
+}
+
+MemoryCache::MemoryCache(const char *sdcard, uint stripes) : Cache(sdcard) {
+    alloc_depot = new StackDepot();
+    alloc_stripes = new AllocStripe[stripes];
+    alloc_mask = stripes - 1;
+    for (uint i = 0; i < stripes; i++) {
+        pthread_mutex_init(&alloc_stripes[i].mutex, NULL);
+    }
+    alloc_cache = new AllocPool(ALLOC_CACHE_LIMIT);
 }
 
 MemoryCache::~MemoryCache() {
+    for (uint i = 0; i <= alloc_mask; i++) {
+        pthread_mutex_destroy(&alloc_stripes[i].mutex);
+    }
+    delete[] alloc_stripes;
     delete alloc_cache;
+    delete alloc_depot;
 }
 
 void MemoryCache::reset() {
     alloc_cache->reset();
+    alloc_depot->reset();
+    alloc_epoch = 0;
+    alloc_last = 0;
     for (uint i = 0; i < ALLOC_INDEX_SIZE; i++) {
         alloc_table[i] = nullptr;
     }
 }
 
-void MemoryCache::insert(uintptr_t address, size_t size, Backtrace *backtrace) {
+bool MemoryCache::insert(uintptr_t address, size_t size, Backtrace *backtrace) {
+    return link_alloc(address, size, backtrace);
+}
+
+bool MemoryCache::remove(uintptr_t address) {
+    AllocNode *p = unlink_alloc(address);
+    if (p == nullptr) {
+        return false;
+    }
+    alloc_cache->recycle(p);
+    return true;
+}
+
+bool MemoryCache::link_alloc(uintptr_t address, size_t size, Backtrace *backtrace) {
     AllocNode *p = alloc_cache->apply();
     if (p == nullptr) {
         LOGGER("Alloc cache is full!!!!!!!!");
-        return;
+        return false;
     }
 
     p->addr = address;
     p->size = size;
     uint depth = backtrace->depth > 2 ? backtrace->depth - 2 : 1;
-    memcpy(p->trace, backtrace->trace + 2, depth * sizeof(uintptr_t));
-    p->trace[depth] = 0;
+    p->stack = alloc_depot->intern(backtrace->trace + 2, depth);
 
     uint16_t alloc_hash = (address >> ADDR_HASH_OFFSET) & 0xFFFF;
-    pthread_mutex_lock(&alloc_mutex);
+    pthread_mutex_t *alloc_mutex = &alloc_stripes[alloc_hash & alloc_mask].mutex;
+    pthread_mutex_lock(alloc_mutex);
+    p->epoch = alloc_epoch;
     p->next = alloc_table[alloc_hash];
     alloc_table[alloc_hash] = p;
-    pthread_mutex_unlock(&alloc_mutex);
+    pthread_mutex_unlock(alloc_mutex);
+    return true;
 }
 
-void MemoryCache::remove(uintptr_t address) {
+AllocNode *MemoryCache::unlink_alloc(uintptr_t address) {
     uint16_t alloc_hash = (address >> ADDR_HASH_OFFSET) & 0xFFFF;
     if (alloc_table[alloc_hash] == nullptr) {
-        return;
+        return nullptr;
     }
 
-    pthread_mutex_lock(&alloc_mutex);
+    pthread_mutex_t *alloc_mutex = &alloc_stripes[alloc_hash & alloc_mask].mutex;
+    pthread_mutex_lock(alloc_mutex);
     AllocNode *p = remove_alloc(&alloc_table[alloc_hash], address);
-    pthread_mutex_unlock(&alloc_mutex);
-
-    if (p != nullptr) {
-        alloc_cache->recycle(p);
-    }
+    pthread_mutex_unlock(alloc_mutex);
+    return p;
 }
 
 void MemoryCache::print() {
     char path[MAX_BUFFER_SIZE];
-    sprintf(path, "%s/report", mSpace);
+    sprintf(path, mBinary ? "%s/report.bin" : "%s/report", mSpace);
 
-    FILE *report = fopen(path, "w");
+    FILE *report = fopen(path, mBinary ? "wb" : "w");
     if (report == nullptr) {
         LOGGER("print report failed, can't open report file");
         return;
     }
-    void *dl_cache = nullptr;
+    std::vector<AllocNode> nodes;
 
-    pthread_mutex_lock(&alloc_mutex);
+    // only the raw records are copied under the lock, symbolization and I/O run without it
+    nodes.reserve(alloc_last);
+    lock_all();
     for (auto p : alloc_table) {
         for (; p != nullptr; p = p->next) {
-            write_trace(report, p, nullptr, &dl_cache);
+            nodes.push_back(*p);
         }
     }
-    pthread_mutex_unlock(&alloc_mutex);
+    unlock_all();
+    alloc_last = nodes.size();
+
+    if (mBinary) {
+        write_binary(report, alloc_depot, nodes.data(), nodes.size());
+    } else {
+        write_report(report, alloc_depot, nodes.data(), nodes.size());
+    }
 
-    xdl_addr_clean(&dl_cache);
     fclose(report);
-}
\ No newline at end of file
+}
+void MemoryCache::lock_all() {
+    // stripes are always taken in ascending order, so the walk sees one consistent table
+    for (uint i = 0; i <= alloc_mask; i++) {
+        pthread_mutex_lock(&alloc_stripes[i].mutex);
+    }
+}
+
+void MemoryCache::unlock_all() {
+    for (uint i = alloc_mask + 1; i > 0; i--) {
+        pthread_mutex_unlock(&alloc_stripes[i - 1].mutex);
+    }
+}
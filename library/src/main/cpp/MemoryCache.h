@@ -14,14 +14,20 @@
  * limitations under the License.
  */
 
-#ifndef DIFF_CACHE_H
-#define DIFF_CACHE_H
+#ifndef MEMORY_CACHE_H
+#define MEMORY_CACHE_H
+
+#include <stdio.h>
+#include <pthread.h>
 
 #include "Cache.h"
 #include "AllocPool.hpp"
+#include "StackDepot.h"
 
 #if defined(__LP64__)
 #define STACK_FORMAT_HEADER "\n0x%016lx, %u, 1\n"
+#define STACK_FORMAT_GROUP "\n0x%016lx, %zu, %u\n"
+#define STACK_FORMAT_SITE "\n0x%016x, %llu, %u, %llu, %llu\n"
 #define STACK_FORMAT_UNKNOWN "0x%016lx <unknown>\n"
 #define STACK_FORMAT_ANONYMOUS "0x%016lx <anonymous:%016lx>\n"
 #define STACK_FORMAT_FILE "0x%016lx %s (unknown)\n"
@@ -29,6 +35,8 @@
 #define STACK_FORMAT_FILE_NAME_LINE "0x%016lx %s (%s + %lu)\n"
 #else
 #define STACK_FORMAT_HEADER "\n0x%08x, %u, 1\n"
+#define STACK_FORMAT_GROUP "\n0x%08x, %zu, %u\n"
+#define STACK_FORMAT_SITE "\n0x%08x, %llu, %u, %llu, %llu\n"
 #define STACK_FORMAT_UNKNOWN "0x%08x <unknown>\n"
 #define STACK_FORMAT_ANONYMOUS "0x%08x <anonymous:%08x>\n"
 #define STACK_FORMAT_FILE "0x%08x %s (unknown)\n"
@@ -36,19 +44,38 @@
 #define STACK_FORMAT_FILE_NAME_LINE "0x%08x %s (%s + %u)\n"
 #endif
 
+size_t write_trace(char *buffer, size_t length, const uintptr_t *trace, uint32_t depth, void **dl_cache);
+
+void write_report(FILE *output, StackDepot *depot, AllocNode *nodes, size_t count, bool merged = false);
+
+typedef union {
+    pthread_mutex_t mutex;
+    char            align[64];
+} AllocStripe;
+
 class MemoryCache : public Cache {
 public:
-    MemoryCache(const char *space);
+    MemoryCache(const char *space, uint stripes = 1);
     ~MemoryCache();
 public:
     void reset();
-    void insert(uintptr_t address, size_t size, Backtrace *backtrace);
-    void remove(uintptr_t address);
+    bool insert(uintptr_t address, size_t size, Backtrace *backtrace);
+    bool remove(uintptr_t address);
     void print();
-private:
-    pthread_mutex_t alloc_mutex;
+protected:
+    // link_alloc returns whether the node was recorded, an unlinked node belongs to the caller
+    bool link_alloc(uintptr_t address, size_t size, Backtrace *backtrace);
+    AllocNode *unlink_alloc(uintptr_t address);
+    void lock_all();
+    void unlock_all();
+protected:
+    AllocStripe *alloc_stripes;
+    uint alloc_mask;
+    uint32_t alloc_epoch;
+    size_t alloc_last;
     AllocNode *alloc_table[ALLOC_INDEX_SIZE];
     AllocPool *alloc_cache;
+    StackDepot *alloc_depot;
 };
 
-#endif //DIFF_CACHE_H
\ No newline at end of file
+#endif //MEMORY_CACHE_H
\ No newline at end of file
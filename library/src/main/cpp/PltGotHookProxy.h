@@ -221,8 +221,14 @@ static const void *sSoLoad[][3] = {
 
 static void tryHookAllFunc(xh_elf_t elf) {
     for (int i = 0; i < sizeof(sPltGot) / sizeof(sPltGot[0]); i++) {
+        if (*(void **) sPltGot[i][2] == nullptr) {
+            continue;
+        }
         xh_elf_hook(&elf, (const char *) sPltGot[i][0], (void *) sPltGot[i][1], NULL);
     }
+    for (int i = 0; i < sizeof(sOperators) / sizeof(sOperators[0]); i++) {
+        xh_elf_hook(&elf, (const char *) sOperators[i][0], (void *) sOperators[i][1], (void **) sOperators[i][2]);
+    }
 }
 
 static void tryHookSoLoadFunc(xh_elf_t elf, bool save_old_func) {
@@ -319,6 +325,7 @@ static void try_pltgot_hook_on_soload(const char *filename) {
 
 int registerSoLoadProxy(JNIEnv *env, jstring focused) {
     api_level = android_get_device_api_level();
+    resolve_origins(false);
 
     if (focused != NULL) {
         const char *focused_reg = (char *) env->GetStringUTFChars(focused, 0);
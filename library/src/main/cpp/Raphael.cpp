@@ -20,9 +20,36 @@
 #include "Raphael.h"
 #include "HookProxy.h"
 #include "MemoryCache.h"
+#include "LockFreeCache.h"
+#include "DiffCache.h"
+#include "AggregateCache.h"
+#include "BatchCache.h"
 #include "PltGotHookProxy.h"
 
 //**************************************************************************************************
+#ifndef __ANDROID__
+__thread uint32_t guard GUARD_TLS_MODEL = 0;
+#else
+pthread_key_t guard;
+pthread_key_t countdown;
+#endif
+
+static Cache *create_cache(const char *space, uint32_t configs) {
+    if (configs & DIFF_CACHE) {
+        return new DiffCache(space, (configs & CACHE_MASK) == STRIPE_CACHE ? ALLOC_STRIPE_SIZE : 1);
+    }
+    switch (configs & CACHE_MASK) {
+        case STRIPE_CACHE:
+            return new MemoryCache(space, ALLOC_STRIPE_SIZE);
+        case LOCKFREE_CACHE:
+            return new LockFreeCache(space);
+        case AGGREGATE_CACHE:
+            return new AggregateCache(space, ALLOC_STRIPE_SIZE);
+        default:
+            return new MemoryCache(space);
+    }
+}
+
 void Raphael::start(JNIEnv *env, jobject obj, jint configs, jstring space, jstring regex) {
     const char *string = (char *) env->GetStringUTFChars(space, 0);
     size_t length = strlen(string);
@@ -31,8 +58,19 @@ void Raphael::start(JNIEnv *env, jobject obj, jint configs, jstring space, jstri
     memcpy((void *) mSpace, string, length);
     env->ReleaseStringUTFChars(space, string);
 
-    mCache = new MemoryCache(mSpace);
-    update_configs(mCache, 0);
+    mCache = create_cache(mSpace, configs);
+    mCache->binary((configs & BINARY_REPORT) != 0);
+    if (configs & BATCH_MODE) {
+        mCache = new BatchCache(mSpace, mCache);
+    }
+    update_configs(nullptr, 0);
+
+    // both hook modes unwind, the stack bounds are cached per thread from here on
+#ifdef __arm__
+    init_thread_stack();
+#else
+    init_arm64_unwind();
+#endif
 
     if (regex != nullptr) {
         registerSoLoadProxy(env, regex);
@@ -41,20 +79,64 @@ void Raphael::start(JNIEnv *env, jobject obj, jint configs, jstring space, jstri
     }
 
     mCache->reset();
-    pthread_key_create(&guard, nullptr);
+    filter.reset();
+    unmatched.store(0, std::memory_order_relaxed);
+#ifndef __arm__
+    reset_unwind_counters();
+#endif
+    if (configs & EVENT_LOG) {
+        mEvents = new EventLog(mSpace);
+        if (mEvents->start()) {
+            update_events(mEvents);
+        } else {
+            delete mEvents;
+            mEvents = nullptr;
+        }
+    }
+    if (configs & ASYNC_UNWIND) {
+        mUnwinder = new AsyncUnwinder(record_memory_backtrace);
+        if (mUnwinder->start()) {
+            update_unwinder(mUnwinder);
+        } else {
+            delete mUnwinder;
+            mUnwinder = nullptr;
+        }
+    }
     LOGGER("start >>> %#x, %s", (uint) configs, mSpace);
+    mConfigs = configs;
     update_configs(mCache, configs);
 }
 
 void Raphael::stop(JNIEnv *env, jobject obj) {
+    if (mGovernor != nullptr) {
+        mGovernor->stop();
+        update_governor(nullptr);
+    }
+    if (mUnwinder != nullptr) {
+        // captures still waiting are recorded into the cache, which stays until they are
+        update_configs(mCache, 0);
+        mUnwinder->stop();
+        update_unwinder(nullptr);
+    }
     update_configs(nullptr, 0);
+    update_events(nullptr);
+    // a proxy that read the pointers before they were cleared may still be in the cache or the log
+    drain_proxies();
     print(env, obj);
 
     delete mCache;
     mCache = nullptr;
 
+    delete mEvents;
+    mEvents = nullptr;
+
+    delete mGovernor;
+    mGovernor = nullptr;
+
+    delete mUnwinder;
+    mUnwinder = nullptr;
+
     xh_core_clear();
-    pthread_key_delete(guard);
     LOGGER("stop >>> %s", mSpace);
 
     delete mSpace;
@@ -62,14 +144,77 @@ void Raphael::stop(JNIEnv *env, jobject obj) {
 }
 
 void Raphael::print(JNIEnv *env, jobject obj) {
-    pthread_setspecific(guard, (void *) 1);
+    set_guard(true);
 
     clean_cache(env);
+    if (mUnwinder != nullptr) {
+        mUnwinder->flush();
+    }
     mCache->print();
     dump_system(env);
+    dump_governor(env);
+
+    LOGGER("print >>> %s, unmatched frees %llu", mSpace, (unsigned long long) unmatched.load(std::memory_order_relaxed));
+#ifndef __arm__
+    if (mConfigs & HYBRID_UNWIND) {
+        UnwindCounters counters;
+        get_unwind_counters(&counters);
+        LOGGER("print >>> fp frames %llu, cfi frames %llu, fallbacks %llu, stops %llu",
+               (unsigned long long) counters.fp_frames, (unsigned long long) counters.cfi_frames,
+               (unsigned long long) counters.fallbacks, (unsigned long long) counters.stops);
+    }
+#endif
+    set_guard(false);
+}
+
+void Raphael::govern(JNIEnv *env, jobject obj, jint budget) {
+    if (mGovernor != nullptr) {
+        mGovernor->budget((uint32_t) budget);
+        return;
+    }
+    mGovernor = new Governor(mConfigs & LIMIT_MASK, (mConfigs & DEPTH_MASK) >> 16, update_effort);
+    if (mGovernor->start((uint32_t) budget)) {
+        update_governor(mGovernor);
+    } else {
+        delete mGovernor;
+        mGovernor = nullptr;
+    }
+}
+
+void Raphael::reconfigure(JNIEnv *env, jobject obj, jint configs) {
+    if (mCache == nullptr) {
+        LOGGER("reconfigure failed, not started");
+        return;
+    }
+    if (((uint32_t) configs & ~LIVE_MASK) != (mConfigs & ~LIVE_MASK)) {
+        LOGGER("reconfigure ignores %#x, it needs a restart", ((uint32_t) configs ^ mConfigs) & ~LIVE_MASK);
+    }
+    mConfigs = (mConfigs & ~LIVE_MASK) | ((uint32_t) configs & LIVE_MASK);
+    update_configs(mCache, mConfigs);
+    if (mGovernor != nullptr) {
+        mGovernor->rebase(mConfigs & LIMIT_MASK, (mConfigs & DEPTH_MASK) >> 16);
+    }
+    LOGGER("reconfigure >>> %#x", mConfigs);
+}
 
-    LOGGER("print >>> %s", mSpace);
-    pthread_setspecific(guard, (void *) 0);
+void Raphael::unwind_by_cfi(JNIEnv *env, jobject obj, jstring regex) {
+#ifdef __arm__
+    LOGGER("unwind by cfi ignored, armeabi-v7a always unwinds by its exception tables");
+#else
+    const char *string = regex != nullptr ? env->GetStringUTFChars(regex, 0) : nullptr;
+    // compiling the regex allocates, it is the detector's own
+    set_guard(true);
+    if (cfi_select_modules(string)) {
+        update_unwind_cfi(string != nullptr);
+        LOGGER("unwind by cfi >>> %s", string != nullptr ? string : "none");
+    } else {
+        LOGGER("unwind by cfi failed, invalid regex %s", string);
+    }
+    set_guard(false);
+    if (string != nullptr) {
+        env->ReleaseStringUTFChars(regex, string);
+    }
+#endif
 }
 
 void Raphael::clean_cache(JNIEnv *env) {
@@ -79,7 +224,9 @@ void Raphael::clean_cache(JNIEnv *env) {
     char path[MAX_BUFFER_SIZE];
     if ((pDir = opendir(mSpace)) != NULL) {
         while ((pDirent = readdir(pDir)) != NULL) {
-            if (strcmp(pDirent->d_name, ".") != 0 && strcmp(pDirent->d_name, "..") != 0) {
+            // the event log is still being appended to, it spans all reports
+            if (strcmp(pDirent->d_name, ".") != 0 && strcmp(pDirent->d_name, "..") != 0
+                && strcmp(pDirent->d_name, "events") != 0) {
                 if (snprintf(path, MAX_BUFFER_SIZE, "%s/%s", mSpace, pDirent->d_name) < MAX_BUFFER_SIZE) {
                     remove(path);
                 }
@@ -117,4 +264,19 @@ void Raphael::dump_system(JNIEnv *env) {
 
     fclose(source);
     fclose(target);
-}
\ No newline at end of file
+}
+
+void Raphael::dump_governor(JNIEnv *env) {
+    char path[MAX_BUFFER_SIZE];
+    if (mGovernor == nullptr || snprintf(path, MAX_BUFFER_SIZE, "%s/governor", mSpace) >= MAX_BUFFER_SIZE) {
+        return;
+    }
+
+    FILE *target = fopen(path, "w");
+    if (target == nullptr) {
+        LOGGER("dump governor failed, can't open %s/governor", mSpace);
+        return;
+    }
+    mGovernor->print(target);
+    fclose(target);
+}
@@ -19,23 +19,52 @@
 
 #include <jni.h>
 #include "Cache.h"
+#include "EventLog.h"
+#include "Governor.h"
+#include "AsyncUnwinder.h"
+
+// arm64 walks frame records and falls back to the CFI of a module only where the chain breaks
+#define HYBRID_UNWIND 0x80000000
+// stacks are copied by the allocating thread and unwound by a worker
+#define ASYNC_UNWIND 0x40000000
+#define BATCH_MODE 0x20000000
+// with SAMPLE_MODE the limit is the mean sampling interval in bytes instead of a threshold
+#define SAMPLE_MODE 0x10000000
+#define EVENT_LOG 0x08000000
+#define BINARY_REPORT 0x04000000
+#define CACHE_MASK 0x03000000
+#define STRIPE_CACHE 0x01000000
+#define LOCKFREE_CACHE 0x02000000
+#define AGGREGATE_CACHE 0x03000000
 
 #define MAP64_MODE 0x00800000
 #define ALLOC_MODE 0x00400000
+#define DIFF_CACHE 0x00200000
 #define DEPTH_MASK 0x001F0000
 #define LIMIT_MASK 0x0000FFFF
 
+// the bits a running session can change, the others pick its structures and hooks
+#define LIVE_MASK (LIMIT_MASK | DEPTH_MASK | ALLOC_MODE | MAP64_MODE | SAMPLE_MODE | HYBRID_UNWIND)
+
 class Raphael {
 public:
     void start(JNIEnv *env, jobject obj, jint configs, jstring space, jstring regex);
     void stop(JNIEnv *env, jobject obj);
     void print(JNIEnv *env, jobject obj);
+    void govern(JNIEnv *env, jobject obj, jint budget);
+    void reconfigure(JNIEnv *env, jobject obj, jint configs);
+    void unwind_by_cfi(JNIEnv *env, jobject obj, jstring regex);
 private:
     void clean_cache(JNIEnv *env);
     void dump_system(JNIEnv *env);
+    void dump_governor(JNIEnv *env);
 private:
     char  *mSpace;
     Cache *mCache;
+    EventLog *mEvents;
+    Governor *mGovernor;
+    AsyncUnwinder *mUnwinder;
+    uint32_t mConfigs;
 };
 
 #endif //RAPHAEL_H
\ No newline at end of file
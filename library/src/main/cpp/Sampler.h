@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <atomic>
+#include <cmath>
+#include <ctime>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "Guard.h"
+
+/**
+ * Byte sampling as heapprofd does it: every thread counts down a byte budget drawn from an
+ * exponential distribution with mean `interval`, and an allocation is sampled once per time it
+ * takes the countdown across zero. A sample stands for `interval` bytes, allocations of at least
+ * `interval` are always sampled with their own size, so summed weights are unbiased live bytes.
+ */
+#ifndef __ANDROID__
+static __thread intptr_t countdown GUARD_TLS_MODEL;
+
+static inline void create_sampler() {}
+
+static inline intptr_t get_countdown() {
+    return countdown;
+}
+
+static inline void set_countdown(intptr_t value) {
+    countdown = value;
+}
+#else
+#include "thread_stack.h"
+
+/*
+ * Kept where the guard is: from Q on in the record behind the thread slot, next to the stack
+ * bounds, before Q in a pthread key. A thread without a record draws a new countdown per
+ * allocation, the draws are memoryless, so that is the same distribution.
+ */
+extern pthread_key_t countdown;
+
+// called once by JNI_OnLoad, the key is never deleted
+static inline void create_sampler() {
+    init_thread_stack();
+    if (!thread_slot_ready) {
+        pthread_key_create(&countdown, nullptr);
+    }
+}
+
+static inline intptr_t get_countdown() {
+    if (thread_slot_ready) {
+        intptr_t *remain = get_thread_countdown();
+        return remain != nullptr ? *remain : 0;
+    }
+    return (intptr_t) pthread_getspecific(countdown);
+}
+
+static inline void set_countdown(intptr_t value) {
+    if (thread_slot_ready) {
+        intptr_t *remain = get_thread_countdown();
+        if (remain != nullptr) {
+            *remain = value;
+        }
+        return;
+    }
+    pthread_setspecific(countdown, (void *) value);
+}
+#endif
+
+// draws are rare, one per sample, so a single shared generator is cheap enough
+static std::atomic<uint64_t> sample_seed((uint64_t) time(nullptr) * 0x9E3779B97F4A7C15ull | 1);
+
+static intptr_t next_countdown(uint32_t interval) {
+    uint64_t seed = sample_seed.load(std::memory_order_relaxed);
+    uint64_t next;
+    do {
+        next = seed;
+        next ^= next << 13;
+        next ^= next >> 7;
+        next ^= next << 17;
+    } while (!sample_seed.compare_exchange_weak(seed, next, std::memory_order_relaxed, std::memory_order_relaxed));
+
+    double uniform = ((next >> 11) + 1) * (1.0 / 9007199254740992.0);
+    intptr_t bytes = (intptr_t) (-log(uniform) * interval);
+    return bytes > 0 ? bytes : 1;
+}
+
+// weight of the allocation in bytes, 0 when it is not sampled
+static inline size_t sample_size(size_t size, uint32_t interval) {
+    if (size >= interval) {
+        return size;
+    }
+    intptr_t remain = get_countdown();
+    if (remain == 0) {
+        remain = next_countdown(interval);
+    }
+    remain -= (intptr_t) size;
+    size_t weight = 0;
+    while (remain <= 0) {
+        remain += next_countdown(interval);
+        weight += interval;
+    }
+    set_countdown(remain);
+    return weight;
+}
+
+#endif //SAMPLER_H
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "Logger.h"
+#include "StackDepot.h"
+
+#define STACK_HEADER_WORDS (offsetof(StackNode, trace) / sizeof(uintptr_t))
+
+//**************************************************************************************************
+static inline uint32_t hash_trace(const uintptr_t *trace, uint32_t depth) {
+    uint32_t hash = 0x9747B28Cu ^ depth;
+    for (uint32_t i = 0; i < depth; i++) {
+        uint64_t pc = trace[i];
+        uint32_t k = (uint32_t) (pc ^ (pc >> 32));
+        k *= 0x5BD1E995u;
+        k ^= k >> 24;
+        k *= 0x5BD1E995u;
+        hash *= 0x5BD1E995u;
+        hash ^= k;
+    }
+    hash ^= hash >> 13;
+    hash *= 0x5BD1E995u;
+    hash ^= hash >> 15;
+    return hash;
+}
+
+StackDepot::StackDepot() {
+    // pages of the store are only committed once a stack is written into them
+    void *buffer = mmap(nullptr, STACK_DEPOT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    mBuffer = buffer == MAP_FAILED ? nullptr : (uintptr_t *) buffer;
+    mCount = mBuffer == nullptr ? 0 : STACK_DEPOT_SIZE / sizeof(uintptr_t);
+    mIndex = new std::atomic<uint32_t>[STACK_INDEX_SIZE];
+}
+
+StackDepot::~StackDepot() {
+    if (mBuffer != nullptr) {
+        munmap(mBuffer, STACK_DEPOT_SIZE);
+        mBuffer = nullptr;
+    }
+    delete[] mIndex;
+}
+
+void StackDepot::reset() {
+    mCursor.store(1, std::memory_order_relaxed);
+    for (uint32_t i = 0; i < STACK_INDEX_SIZE; i++) {
+        mIndex[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+uint32_t StackDepot::find(uint32_t id, uint32_t hash, const uintptr_t *trace, uint32_t depth) {
+    while (id != 0) {
+        StackNode *node = (StackNode *) (mBuffer + id);
+        if (node->hash == hash && node->depth == depth && memcmp(node->trace, trace, depth * sizeof(uintptr_t)) == 0) {
+            return id;
+        }
+        id = node->next;
+    }
+    return 0;
+}
+
+uint32_t StackDepot::intern(const uintptr_t *trace, uint32_t depth) {
+    uint32_t hash = hash_trace(trace, depth);
+    std::atomic<uint32_t> *bucket = &mIndex[hash & (STACK_INDEX_SIZE - 1)];
+
+    uint32_t head = bucket->load(std::memory_order_acquire);
+    uint32_t id = find(head & ~STACK_LOCKED_BIT, hash, trace, depth);
+    if (id != 0) {
+        return id;
+    }
+
+    while (1) {
+        head = bucket->load(std::memory_order_relaxed);
+        if (!(head & STACK_LOCKED_BIT)
+            && bucket->compare_exchange_weak(head, head | STACK_LOCKED_BIT, std::memory_order_acquire, std::memory_order_relaxed)) {
+            break;
+        }
+        sched_yield();
+    }
+
+    id = find(head, hash, trace, depth);
+    if (id == 0) {
+        uint32_t words = STACK_HEADER_WORDS + depth;
+        uint32_t offset = mCursor.load(std::memory_order_relaxed);
+        while (offset + words <= mCount) {
+            if (mCursor.compare_exchange_weak(offset, offset + words, std::memory_order_relaxed, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+
+        if (offset + words <= mCount) {
+            StackNode *node = (StackNode *) (mBuffer + offset);
+            node->hash = hash;
+            node->next = head;
+            node->depth = depth;
+            memcpy(node->trace, trace, depth * sizeof(uintptr_t));
+            head = id = offset;
+        } else {
+            LOGGER("Stack depot is full!!!!!!!!");
+        }
+    }
+
+    bucket->store(head, std::memory_order_release);
+    return id;
+}
+
+uint32_t StackDepot::fetch(uint32_t id, const uintptr_t **trace) {
+    if (id == 0) {
+        *trace = nullptr;
+        return 0;
+    }
+    StackNode *node = (StackNode *) (mBuffer + id);
+    *trace = node->trace;
+    return node->depth;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef STACK_DEPOT_H
+#define STACK_DEPOT_H
+
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+
+#define STACK_INDEX_SIZE (1 << 14)
+#define STACK_DEPOT_SIZE (1 << 24)
+#define STACK_LOCKED_BIT 0x80000000u
+
+typedef struct {
+    uint32_t  hash;
+    uint32_t  next;
+    uint32_t  depth;
+    uintptr_t trace[0];
+} StackNode;
+
+/**
+ * Append-only store of unique call stacks. A stack is interned once and referred to by a 32-bit
+ * id, which is its word offset in the store, 0 is never a valid id. Lookups are lock-free, a
+ * miss locks only its own bucket while the new stack is appended.
+ */
+class StackDepot {
+public:
+    StackDepot();
+    ~StackDepot();
+public:
+    void reset();
+    uint32_t intern(const uintptr_t *trace, uint32_t depth);
+    uint32_t fetch(uint32_t id, const uintptr_t **trace);
+private:
+    uint32_t find(uint32_t id, uint32_t hash, const uintptr_t *trace, uint32_t depth);
+private:
+    uintptr_t *              mBuffer;
+    uint32_t                 mCount;
+    std::atomic<uint32_t>    mCursor;
+    std::atomic<uint32_t> *  mIndex;
+};
+
+#endif //STACK_DEPOT_H
@@ -17,6 +17,8 @@
 #include <stdlib.h>
 #include <jni.h>
 
+#include "Guard.h"
+#include "Sampler.h"
 #include "Logger.h"
 #include "Raphael.h"
 //**************************************************************************************************
@@ -34,6 +36,18 @@ void print(JNIEnv *env, jobject obj) {
     sRaphael->print(env, obj);
 }
 
+void govern(JNIEnv *env, jobject obj, jint budget) {
+    sRaphael->govern(env, obj, budget);
+}
+
+void reconfigure(JNIEnv *env, jobject obj, jint configs) {
+    sRaphael->reconfigure(env, obj, configs);
+}
+
+void unwind_by_cfi(JNIEnv *env, jobject obj, jstring regex) {
+    sRaphael->unwind_by_cfi(env, obj, regex);
+}
+
 static const JNINativeMethod sMethods[] = {
         {
                 "nStart",
@@ -47,6 +61,18 @@ static const JNINativeMethod sMethods[] = {
                 "nPrint",
                 "()V",
                 (void *) print
+        }, {
+                "nGovern",
+                "(I)V",
+                (void *) govern
+        }, {
+                "nReconfigure",
+                "(I)V",
+                (void *) reconfigure
+        }, {
+                "nUnwindByCfi",
+                "(Ljava/lang/String;)V",
+                (void *) unwind_by_cfi
         }
 };
 
@@ -69,6 +95,10 @@ JNIEXPORT jint JNI_OnLoad(JavaVM *vm, void *res) {
         return -1;
     }
 
+    // once for the process and never deleted, proxies and unwind_by_cfi may run outside a session
+    create_guard();
+    create_sampler();
+
     if (registerNativeImpl(env) == 0) {
         return -1;
     } else {
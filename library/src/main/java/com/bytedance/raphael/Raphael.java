@@ -23,6 +23,15 @@ import java.util.concurrent.atomic.AtomicBoolean;
 
 @Keep
 public class Raphael {
+    public static int HYBRID_UNWIND = 0x80000000;
+    public static int ASYNC_UNWIND = 0x40000000;
+    public static int BATCH_MODE = 0x20000000;
+    public static int SAMPLE_MODE = 0x10000000;
+    public static int EVENT_LOG = 0x08000000;
+    public static int BINARY_REPORT = 0x04000000;
+    public static int STRIPE_CACHE = 0x01000000;
+    public static int LOCKFREE_CACHE = 0x02000000;
+    public static int AGGREGATE_CACHE = 0x03000000;
     public static int MAP64_MODE = 0x00800000;
     public static int ALLOC_MODE = 0x00400000;
     public static int DIFF_CACHE = 0x00200000;
@@ -57,9 +66,49 @@ public class Raphael {
         }
     }
 
+    /**
+     * Keeps the time spent recording allocations under budget, in per-mille of one CPU, by raising
+     * the limit and lowering the depth at runtime. 0 restores the configs given to start.
+     */
+    public static void govern(int budget) {
+        if (sIsRunning.get()) {
+            nGovern(budget);
+        } else {
+            Log.e("RAPHAEL", "govern >>> not start");
+        }
+    }
+
+    /**
+     * Changes limit, depth, ALLOC_MODE, MAP64_MODE, SAMPLE_MODE and HYBRID_UNWIND of a running
+     * session, records taken so far are kept. Other bits, like the cache type, still need a stop
+     * and start.
+     */
+    public static void reconfigure(int configs) {
+        if (sIsRunning.get()) {
+            nReconfigure(configs);
+        } else {
+            Log.e("RAPHAEL", "reconfigure >>> not start");
+        }
+    }
+
+    /**
+     * Unwinds the code of modules whose path matches regex by their .eh_frame, for libraries
+     * built without frame pointers, arm64-v8a only. Other frames still follow frame pointers,
+     * null selects none. The selection is kept across stop and start.
+     */
+    public static void unwindByCfi(String regex) {
+        nUnwindByCfi(regex);
+    }
+
     private static native void nStart(int configs, String space, String regex);
 
     private static native void nStop();
 
     private static native void nPrint();
+
+    private static native void nGovern(int budget);
+
+    private static native void nReconfigure(int configs);
+
+    private static native void nUnwindByCfi(String regex);
 }
\ No newline at end of file
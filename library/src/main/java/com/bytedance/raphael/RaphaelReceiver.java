@@ -47,7 +47,8 @@ public class RaphaelReceiver extends BroadcastReceiver {
         }
 
         try {
-            return Integer.decode(params);
+            // HYBRID_UNWIND is bit 31, Integer.decode rejects configs that have it set
+            return Long.decode(params).intValue();
         } catch (NumberFormatException e) {
             e.printStackTrace();
             return Raphael.MAP64_MODE | Raphael.ALLOC_MODE | 0xF0000 | 4096;
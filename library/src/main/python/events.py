@@ -0,0 +1,108 @@
+#
+# Copyright (C) 2021 ByteDance Inc
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+#!/usr/bin/python3
+
+import sys
+import struct
+import argparse
+
+# layout of the events file, see EventLog.h
+__MAGIC__   = b'RPHE'
+__VERSION__ = 1
+__FREE__    = 0xFFFFFFFF
+
+__BLOCK_STACK__  = 1
+__BLOCK_EVENTS__ = 2
+__BLOCK_DROPS__  = 3
+
+
+def decode_events(data):
+    magic, version, width = struct.unpack_from('<4sHH', data, 0)
+    if magic != __MAGIC__ or version != __VERSION__:
+        sys.exit('>>>>>>>> not a raphael event log')
+
+    word = 'Q' if width == 8 else 'I'
+    event = '<Q' + word + 'II'
+    event_size = struct.calcsize(event)
+
+    stacks = {}
+    events = []
+    drops = 0
+    offset = struct.calcsize('<4sHH')
+    while offset + 8 <= len(data):
+        type, count = struct.unpack_from('<II', data, offset)
+        offset += 8
+        if type == __BLOCK_STACK__:
+            id, = struct.unpack_from('<I', data, offset)
+            offset += 4
+            stacks.update({id: struct.unpack_from('<' + word * count, data, offset)})
+            offset += width * count
+        elif type == __BLOCK_EVENTS__:
+            for i in range(0, count):
+                events.append(struct.unpack_from(event, data, offset))
+                offset += event_size
+        elif type == __BLOCK_DROPS__:
+            drops += count
+        else:
+            break
+    events.sort(key=lambda x: x[0])
+    return stacks, events, drops
+
+
+def print_events(writer, stacks, events, drops, digits):
+    # the live size of every stack along the timeline, frees are matched to the last alloc of an address
+    live = {}
+    owner = {}
+    start = events[0][0] if events else 0
+    for time, addr, size, stack in events:
+        if stack == __FREE__:
+            if addr not in owner:
+                continue
+            stack, size = owner.pop(addr)
+            live.update({stack: live.get(stack, 0) - size})
+            writer.write('%12.3f - 0x%0*x, %u, %u\n' % ((time - start) / 1e6, digits, addr, size, stack))
+        else:
+            owner.update({addr: (stack, size)})
+            live.update({stack: live.get(stack, 0) + size})
+            writer.write('%12.3f + 0x%0*x, %u, %u\n' % ((time - start) / 1e6, digits, addr, size, stack))
+
+    writer.write('\n%u events, %u dropped\n' % (len(events), drops))
+    for stack, size in sorted(live.items(), key=lambda x: x[1], reverse=True):
+        if size <= 0:
+            continue
+        writer.write('\n%u, %u\n' % (stack, size))
+        for pc in stacks.get(stack, ()):
+            writer.write('0x%0*x\n' % (digits, pc))
+
+
+if __name__ == '__main__':
+    argParser = argparse.ArgumentParser()
+    argParser.add_argument('-e', '--events', help='event log, the events file written under space')
+    argParser.add_argument('-o', '--output', help='output timeline name, the default output name is events.txt')
+    argParams = argParser.parse_args()
+
+    if not argParams.events:
+        sys.exit('>>>>>>>> no event log')
+
+    reader = open(argParams.events, 'rb')
+    data = reader.read()
+    reader.close()
+
+    stacks, events, drops = decode_events(data)
+    writer = open(argParams.output if argParams.output else 'events.txt', 'w')
+    print_events(writer, stacks, events, drops, struct.unpack_from('<H', data, 6)[0] * 2)
+    writer.close()
@@ -59,11 +59,14 @@ class Frame:
 
 
 class Trace:
-    def __init__(self, id, size, count, stack):
+    def __init__(self, id, size, count, stack, total=None, peak=None):
         self.id    = id
         self.size  = int(size)
         self.count = int(count)
         self.stack = stack
+        # only call sites of the aggregate cache report the bytes ever allocated and their peak
+        self.total = int(total) if total else None
+        self.peak  = int(peak) if peak else None
 
     def __eq__(self, b):
         if len(self.stack) != len(b.stack):
@@ -152,7 +155,10 @@ def print_report(writer, report):
     for record in report:
         retry_symbol(record)
 
-        writer.write('\n%s, %s, %s\n' % (record.id, record.size, record.count))
+        if record.total is None:
+            writer.write('\n%s, %s, %s\n' % (record.id, record.size, record.count))
+        else:
+            writer.write('\n%s, %s, %s, %s, %s\n' % (record.id, record.size, record.count, record.total, record.peak))
         for frame in record.stack:
             writer.write('%s %s (%s)\n' % (frame.pc, frame.path, frame.desc))
 
@@ -165,7 +171,11 @@ def merge_report(report):
     for i in range(1, len(report)):
         if record == report[i]:
             record.size += report[i].size
-            record.count += 1
+            record.count += report[i].count
+            if record.total is not None and report[i].total is not None:
+                # peaks of sites merged by their frames need not coincide, the sum is a bound
+                record.total += report[i].total
+                record.peak += report[i].peak
         else:
             merged.append(record)
             record = report[i]
@@ -182,8 +192,8 @@ def parse_report(string):
         stack = []
         for frame in match:
             stack.append(Frame(frame[0], frame[1], frame[2]))
-        match = re.compile(r'(0x[0-9a-f]+),\ (\d+),\ (\d+)$', re.M | re.I).findall(split)
-        report.append(Trace(match[0][0], match[0][1], match[0][2], stack))
+        match = re.compile(r'(0x[0-9a-f]+),\ (\d+),\ (\d+)(?:,\ (\d+),\ (\d+))?$', re.M | re.I).findall(split)
+        report.append(Trace(match[0][0], match[0][1], match[0][2], stack, match[0][3], match[0][4]))
     return report
 
 
@@ -0,0 +1,124 @@
+#
+# Copyright (C) 2021 ByteDance Inc
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+#!/usr/bin/python3
+
+import sys
+import struct
+import bisect
+import argparse
+
+# layout of report.bin, see BinaryReport.h
+__MAGIC__   = b'RPHL'
+__VERSION__ = 2
+__MERGED__  = 0x00000001
+__SITES__   = 0x00000002
+
+
+class Module:
+    def __init__(self, base, size, bias, build_id, path):
+        self.base     = base
+        self.size     = size
+        self.bias     = bias
+        self.build_id = build_id
+        self.path     = path
+
+
+class Reader:
+    def __init__(self, data):
+        self.data   = data
+        self.offset = 0
+
+    def read(self, fmt):
+        values = struct.unpack_from('<' + fmt, self.data, self.offset)
+        self.offset += struct.calcsize('<' + fmt)
+        return values
+
+    def bytes(self, length):
+        value = self.data[self.offset:self.offset + length]
+        self.offset += length
+        return value
+
+
+def find_module(modules, bases, pc):
+    i = bisect.bisect_right(bases, pc) - 1
+    if i >= 0 and pc < modules[i].base + modules[i].size:
+        return modules[i]
+    return None
+
+
+def decode_report(data, writer):
+    reader = Reader(data)
+    magic, version, width, flags, module_count, stack_count, record_count = reader.read('4sHHIIII')
+    if magic != __MAGIC__ or version < 1 or version > __VERSION__:
+        sys.exit('>>>>>>>> not a raphael binary report')
+
+    word = 'Q' if width == 8 else 'I'
+    digits = width * 2
+
+    modules = []
+    for i in range(0, module_count):
+        base, size, bias, id_length, path_length = reader.read(word * 3 + 'HH')
+        build_id = reader.bytes(id_length).hex()
+        path = reader.bytes(path_length).decode('utf-8', 'replace')
+        modules.append(Module(base, size, bias, build_id, path))
+    modules.sort(key=lambda x: x.base)
+    bases = [module.base for module in modules]
+
+    stacks = {}
+    for i in range(0, stack_count):
+        id, depth = reader.read('II')
+        frames = []
+        for pc in reader.read(word * depth):
+            if pc == 0:
+                break
+            module = find_module(modules, bases, pc)
+            if not module or not module.path:
+                frames.append('0x%0*x <unknown>\n' % (digits, pc))
+            else:
+                # relative to the load bias like the text report's dli_fbase, not the first mapping
+                frames.append('0x%0*x %s (unknown)\n' % (digits, pc - module.bias, module.path))
+        stacks.update({id: ''.join(frames)})
+
+    for i in range(0, record_count):
+        if flags & __SITES__:
+            # call sites of the aggregate cache, keyed by stack id like its text report
+            stack, count, size, total, peak = reader.read('IIQQQ')
+            writer.write('\n0x%0*x, %u, %u, %u, %u\n' % (digits, stack, size, count, total, peak))
+        else:
+            addr, stack, count, size = reader.read(word + 'IIQ')
+            writer.write('\n0x%0*x, %u, %u\n' % (digits, addr, size, count))
+        writer.write(stacks.get(stack, ''))
+
+    return flags & __MERGED__
+
+
+if __name__ == '__main__':
+    argParser = argparse.ArgumentParser()
+    argParser.add_argument('-r', '--report', help='binary report, the report.bin written under space')
+    argParser.add_argument('-o', '--output', help='output text report name, the default output name is report')
+    argParams = argParser.parse_args()
+
+    if not argParams.report:
+        sys.exit('>>>>>>>> no report file')
+
+    reader = open(argParams.report, 'rb')
+    data = reader.read()
+    reader.close()
+
+    writer = open(argParams.output if argParams.output else 'report', 'w')
+    decode_report(data, writer)
+    writer.close()
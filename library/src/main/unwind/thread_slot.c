@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <android/api-level.h>
+#include <pthread.h>
+
+#include "xdl_util.h"
+#include "thread_slot.h"
+
+bool thread_slot_ready = false;
+
+static pthread_once_t thread_slot_once = PTHREAD_ONCE_INIT;
+
+static void decide_thread_slot() {
+    thread_slot_ready = xdl_util_get_api_level() >= __ANDROID_API_Q__;
+}
+
+void init_thread_slot() {
+    pthread_once(&thread_slot_once, decide_thread_slot);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THREAD_SLOT_H
+#define THREAD_SLOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * One word of bionic's own TLS for the detector, read without a call on any release. bionic
+ * leaves TLS_SLOT_APP to apps from Q on, before that it held errno, so older devices keep pthread
+ * keys. Bit 0 is the proxies' guard, the other bits point to the thread's stack bounds and the
+ * sampler's countdown.
+ */
+#define THREAD_SLOT_APP   2
+#define THREAD_SLOT_GUARD ((uintptr_t) 1)
+
+// whether this device has the slot, decided by init_thread_slot once for the process
+extern bool thread_slot_ready;
+
+void init_thread_slot();
+
+static inline uintptr_t* thread_slot() {
+    void** tls;
+#if defined(__aarch64__)
+    __asm__("mrs %0, tpidr_el0" : "=r"(tls));
+#else
+    __asm__("mrc p15, 0, %0, c13, c0, 3" : "=r"(tls));
+#endif
+    return (uintptr_t*) &tls[THREAD_SLOT_APP];
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // THREAD_SLOT_H
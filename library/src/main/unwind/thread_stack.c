@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "thread_stack.h"
+
+/*
+ * The host build keeps the bounds in __thread. On Android, devices from Q on keep a pointer to
+ * them in the thread slot, older ones in two pthread keys, the same split as the proxies' guard.
+ * The record behind the slot also holds the sampler's countdown of the thread.
+ */
+#ifndef __ANDROID__
+static __thread uintptr_t thread_stack_top = 0;
+static __thread uintptr_t thread_stack_bottom = 0;
+
+void init_thread_stack() {}
+#else
+typedef union thread_stack_t {
+    struct {
+        uintptr_t top;
+        uintptr_t bottom;
+        intptr_t countdown; // THREAD_STACK_COUNTDOWN
+    } range;
+    union thread_stack_t* next;
+} thread_stack_t;
+
+static pthread_key_t thread_top_key;
+static pthread_key_t thread_bottom_key;
+static bool thread_stack_keyed = false;
+
+// bounds behind the slot come from mmap'ed pages, a thread's are recycled when it exits
+static pthread_key_t thread_exit_key;
+static bool thread_exit_keyed = false;
+static pthread_mutex_t thread_stack_mutex = PTHREAD_MUTEX_INITIALIZER;
+static thread_stack_t* thread_stack_free = NULL;
+
+static void recycle_thread_stack(void* arg) {
+    // the slot of an exiting thread may still be read by a proxy, it must not point here anymore
+    uintptr_t* slot = thread_slot();
+    *slot &= THREAD_SLOT_GUARD;
+
+    thread_stack_t* stack = (thread_stack_t*) arg;
+    pthread_mutex_lock(&thread_stack_mutex);
+    stack->next = thread_stack_free;
+    thread_stack_free = stack;
+    pthread_mutex_unlock(&thread_stack_mutex);
+}
+
+static thread_stack_t* new_thread_stack() {
+    pthread_mutex_lock(&thread_stack_mutex);
+    if (thread_stack_free == NULL) {
+        size_t size = (size_t) getpagesize();
+        void* page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (page != MAP_FAILED) {
+            thread_stack_t* stacks = (thread_stack_t*) page;
+            for (size_t i = 0; i < size / sizeof(thread_stack_t); i++) {
+                stacks[i].next = thread_stack_free;
+                thread_stack_free = &stacks[i];
+            }
+        }
+    }
+    thread_stack_t* stack = thread_stack_free;
+    if (stack != NULL) {
+        thread_stack_free = stack->next;
+    }
+    pthread_mutex_unlock(&thread_stack_mutex);
+    return stack;
+}
+
+/*
+ * The record the slot points to, made on the first use of either part, its bounds are 0 until
+ * they are looked up. It is made under the guard, its page may come from a hooked mmap.
+ */
+static thread_stack_t* slot_thread_stack(uintptr_t* slot) {
+    thread_stack_t* stack = (thread_stack_t*) (*slot & ~THREAD_SLOT_GUARD);
+    if (stack != NULL || !thread_exit_keyed) {
+        return stack;
+    }
+    uintptr_t guard = *slot & THREAD_SLOT_GUARD;
+    *slot |= THREAD_SLOT_GUARD;
+    stack = new_thread_stack();
+    if (stack != NULL) {
+        stack->range.top = 0;
+        stack->range.bottom = 0;
+        stack->range.countdown = 0;
+        pthread_setspecific(thread_exit_key, stack);
+    }
+    *slot = guard | (uintptr_t) stack;
+    return stack;
+}
+
+intptr_t* new_thread_countdown() {
+    thread_stack_t* stack = slot_thread_stack(thread_slot());
+    return stack != NULL ? &stack->range.countdown : NULL;
+}
+
+void init_thread_stack() {
+    init_thread_slot();
+    if (thread_slot_ready) {
+        if (!thread_exit_keyed) {
+            thread_exit_keyed = pthread_key_create(&thread_exit_key, recycle_thread_stack) == 0;
+        }
+        return;
+    }
+    if (thread_stack_keyed) {
+        return;
+    }
+    if (pthread_key_create(&thread_top_key, NULL) != 0) {
+        return;
+    }
+    if (pthread_key_create(&thread_bottom_key, NULL) != 0) {
+        pthread_key_delete(thread_top_key);
+        return;
+    }
+    thread_stack_keyed = true;
+}
+#endif
+
+#if defined(__arm__)
+#define MAIN_THREAD_STACK_SIZE (8 * 1024 * 1024) // bypass RLIMIT check for simple handling
+
+// the main thread's bounds never change, so they are parsed once for the process
+static uintptr_t main_stack_top = 0;
+static uintptr_t main_stack_bottom = 0;
+
+/*
+ * bionic before L doesn't report the main thread's stack through pthread_getattr_np, its top is
+ * the end of [stack] in the maps, or the 28th field of /proc/self/stat.
+ */
+static bool parse_main_thread_stack(uintptr_t* top, uintptr_t* bottom) {
+    char c, line[1024];
+    int i = 0, j = 0, fd = -1;
+    uintptr_t start = 0;
+    void* lib = NULL;
+    int (*close_fptr)(int) = NULL; // use func ptr to avoid open/close rehook deadlock
+    int (*open_fptr)(const char*, int, ...) = NULL;
+
+    lib = dlopen("libc.so", RTLD_NOW | RTLD_GLOBAL);
+    if (lib == NULL) {
+        return false;
+    }
+    close_fptr = (int (*)(int)) dlsym(lib, "close");
+    open_fptr = (int (*)(const char*, int, ...)) dlsym(lib, "open");
+    if (!close_fptr || !open_fptr) {
+        dlclose(lib);
+        return false;
+    }
+
+    snprintf(line, sizeof(line), "/proc/self/task/%d/maps", getpid());
+    fd = open_fptr(line, O_RDONLY);
+    if (fd >= 0) {
+        while (start == 0 && read(fd, &c, 1) == 1) {
+            if (c != '\n') {
+                if (i < (int) sizeof(line) - 1) {
+                    line[i++] = c;
+                }
+                continue;
+            }
+            line[i] = '\0';
+            // becd7000-becf8000 rw-p 00000000 00:00 0          [stack]
+            if (i >= 7 && strncmp(&line[i - 7], "[stack]", 7) == 0) {
+                char* end = strchr(line, '-');
+                if (end != NULL) {
+                    start = strtoul(end + 1, NULL, 16);
+                }
+            }
+            i = 0;
+        }
+        close_fptr(fd);
+    }
+
+    if (start == 0) {
+        // stack is 28th parameter from /proc/self/stat
+        fd = open_fptr("/proc/self/stat", O_RDONLY);
+        if (fd >= 0) {
+            i = j = 0;
+            line[0] = '\0';
+            while (read(fd, &c, 1) == 1) {
+                if (c == ' ') {
+                    if (++j == 28) {
+                        break;
+                    }
+                } else if (j == 27 && i < (int) sizeof(line) - 1) {
+                    line[i++] = c;
+                }
+            }
+            line[i] = '\0';
+            start = strtoul(line, NULL, 10);
+            close_fptr(fd);
+        }
+    }
+    dlclose(lib);
+
+    if (start == 0) {
+        return false;
+    }
+    *top = start;
+    *bottom = start - MAIN_THREAD_STACK_SIZE;
+    return true;
+}
+
+static bool lookup_main_thread_stack(uintptr_t* top, uintptr_t* bottom) {
+    if (main_stack_top == 0) {
+        uintptr_t parsed_top, parsed_bottom;
+        if (!parse_main_thread_stack(&parsed_top, &parsed_bottom)) {
+            return false;
+        }
+        main_stack_bottom = parsed_bottom;
+        main_stack_top = parsed_top;
+    }
+    *top = main_stack_top;
+    *bottom = main_stack_bottom;
+    return true;
+}
+#endif
+
+static bool lookup_thread_stack(uintptr_t* top, uintptr_t* bottom) {
+#if defined(__arm__)
+    if (gettid() == getpid()) {
+        return lookup_main_thread_stack(top, bottom);
+    }
+#endif
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+        return false;
+    }
+    void* address;
+    size_t size;
+    int result = pthread_attr_getstack(&attr, &address, &size);
+    pthread_attr_destroy(&attr);
+    if (result != 0) {
+        return false;
+    }
+    *top = (uintptr_t) address + size;
+    *bottom = (uintptr_t) address;
+    return true;
+}
+
+bool get_thread_stack_range(uintptr_t* top, uintptr_t* bottom) {
+#ifndef __ANDROID__
+    if (thread_stack_top == 0 && !lookup_thread_stack(&thread_stack_top, &thread_stack_bottom)) {
+        *top = *bottom = 0;
+        return false;
+    }
+    *top = thread_stack_top;
+    *bottom = thread_stack_bottom;
+    return true;
+#else
+    if (thread_slot_ready) {
+        thread_stack_t* stack = (thread_stack_t*) (*thread_slot() & ~THREAD_SLOT_GUARD);
+        if (stack == NULL || stack->range.top == 0) {
+            if (!lookup_thread_stack(top, bottom)) {
+                *top = *bottom = 0;
+                return false;
+            }
+            // without a record the bounds are looked up again next time, nothing else changes
+            stack = slot_thread_stack(thread_slot());
+            if (stack != NULL) {
+                stack->range.top = *top;
+                stack->range.bottom = *bottom;
+            }
+            return true;
+        }
+        *top = stack->range.top;
+        *bottom = stack->range.bottom;
+        return true;
+    }
+    if (thread_stack_keyed) {
+        *top = (uintptr_t) pthread_getspecific(thread_top_key);
+        *bottom = (uintptr_t) pthread_getspecific(thread_bottom_key);
+        if (*top != 0) {
+            return true;
+        }
+    }
+    if (!lookup_thread_stack(top, bottom)) {
+        *top = *bottom = 0;
+        return false;
+    }
+    if (thread_stack_keyed) {
+        pthread_setspecific(thread_top_key, (void*) *top);
+        pthread_setspecific(thread_bottom_key, (void*) *bottom);
+    }
+    return true;
+#endif
+}
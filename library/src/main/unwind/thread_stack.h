@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THREAD_STACK_H
+#define THREAD_STACK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __ANDROID__
+#include "thread_slot.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bounds of the calling thread's stack, top is the highest address. They are looked up once per
+ * thread and kept in TLS, the lookup itself may parse /proc/self/maps. Returns false when the
+ * bounds can't be found, both are 0 then.
+ */
+bool get_thread_stack_range(uintptr_t* top, uintptr_t* bottom);
+
+/* Creates the TLS slots on builds without ELF TLS, until then every call looks the bounds up. */
+void init_thread_stack();
+
+#ifdef __ANDROID__
+// word of the record behind the thread slot that holds the sampler's countdown, after the bounds
+#define THREAD_STACK_COUNTDOWN 2
+
+/* Makes the record of a thread that has none yet, NULL if it can't. */
+intptr_t* new_thread_countdown();
+
+/*
+ * The sampler's countdown of the calling thread, next to its bounds behind the thread slot. Only
+ * from Q on, before that the sampler keeps a pthread key. NULL before init_thread_stack.
+ */
+static inline intptr_t* get_thread_countdown() {
+    uintptr_t stack = *thread_slot() & ~THREAD_SLOT_GUARD;
+    return stack != 0 ? (intptr_t*) stack + THREAD_STACK_COUNTDOWN : new_thread_countdown();
+}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // THREAD_STACK_H
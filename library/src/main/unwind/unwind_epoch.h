@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UNWIND_EPOCH_H
+#define UNWIND_EPOCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Tells when blocks an unwinder may still read can be unmapped, shared by both unwinders. An
+ * unwind enters the current epoch and leaves it when done, replacing a cache advances the epoch.
+ * Blocks retired by an advance are only read by unwinds of the epoch before, they are freed once
+ * none is left. Unwinds of at most two epochs are in progress, so readers are counted by parity.
+ */
+typedef struct {
+    uint32_t current;
+    uint32_t readers[2];
+} unwind_epoch_t;
+
+static inline uint32_t unwind_epoch_enter(unwind_epoch_t* epoch) {
+    for (;;) {
+        uint32_t current = __atomic_load_n(&epoch->current, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&epoch->readers[current & 1], 1, __ATOMIC_SEQ_CST);
+        // an advance in between, it may have missed the count and freed what this one would read
+        if (__atomic_load_n(&epoch->current, __ATOMIC_SEQ_CST) == current) {
+            return current;
+        }
+        __atomic_fetch_sub(&epoch->readers[current & 1], 1, __ATOMIC_RELEASE);
+    }
+}
+
+static inline void unwind_epoch_leave(unwind_epoch_t* epoch, uint32_t entered) {
+    __atomic_fetch_sub(&epoch->readers[entered & 1], 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Under the lock of the cache: whether the unwinds of the epoch before are done. Only then are
+ * the blocks retired by the last advance free, and may the epoch advance again, the next one
+ * would count its unwinds with theirs.
+ */
+static inline bool unwind_epoch_quiet(unwind_epoch_t* epoch) {
+    uint32_t current = __atomic_load_n(&epoch->current, __ATOMIC_RELAXED);
+    return __atomic_load_n(&epoch->readers[(current - 1) & 1], __ATOMIC_SEQ_CST) == 0;
+}
+
+// under the lock of the cache, once the replacement is published
+static inline void unwind_epoch_advance(unwind_epoch_t* epoch) {
+    __atomic_fetch_add(&epoch->current, 1, __ATOMIC_SEQ_CST);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // UNWIND_EPOCH_H
@@ -29,12 +29,19 @@ extern "C" {
 #endif
 
 /* Rewind the program counter by one instruction. */
-uintptr_t rewind_pc_arch(const memory_t* memory, uintptr_t pc);
+uintptr_t rewind_pc_arch(memory_t* memory, uintptr_t pc);
 
 ssize_t unwind_backtrace_signal_arch(siginfo_t* siginfo, void* sigcontext,
         const map_info_t* map_info_list,
         backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth);
 
+ssize_t unwind_backtrace_signal_arch_selfnogcc(const map_info_t* map_info_list,
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth);
+
+ssize_t unwind_backtrace_copy_arch(const map_info_t* map_info_list, const uint32_t* regs,
+        const void* stack, size_t size,
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth);
+
 ssize_t unwind_backtrace_ptrace_arch(pid_t tid, const ptrace_context_t* context,
         backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth);
 
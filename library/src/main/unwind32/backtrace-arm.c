@@ -49,6 +49,7 @@
 //#define LOG_NDEBUG 0
 
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <limits.h>
@@ -60,6 +61,8 @@
 #include "backtrace-helper.h"
 #include "ptrace-arch.h"
 #include "ptrace.h"
+#include "thread_stack.h"
+#include "exidx_cache.h"
 
 
 #if !defined(__BIONIC_HAVE_UCONTEXT_T)
@@ -118,7 +121,7 @@ static uintptr_t prel_to_absolute(uintptr_t place, uint32_t prel_offset) {
     return place + (((int32_t)(prel_offset << 1)) >> 1);
 }
 
-static uintptr_t get_exception_handler(const memory_t* memory,
+static uintptr_t get_exception_handler(memory_t* memory,
         const map_info_t* map_info_list, uintptr_t pc) {
     if (!pc) {
       LIBUDF_LOG("get_exception_handler: pc is zero, no handler");
@@ -129,6 +132,10 @@ static uintptr_t get_exception_handler(const memory_t* memory,
     size_t exidx_size;
     const map_info_t* mi;
     if (memory->tid < 0) {
+        uintptr_t handler;
+        if (exidx_cache_find(pc, &handler)) {
+            return handler;
+        }
         mi = NULL;
         exidx_start = find_exidx(pc, &exidx_size);
     } else {
@@ -207,7 +214,7 @@ typedef struct {
     uint32_t word;
 } byte_stream_t;
 
-static bool try_next_byte(const memory_t* memory, byte_stream_t* stream, uint8_t* out_value) {
+static bool try_next_byte(memory_t* memory, byte_stream_t* stream, uint8_t* out_value) {
     uint8_t result;
     switch (stream->ptr & 3) {
     case 0:
@@ -241,13 +248,13 @@ static void set_reg(unwind_state_t* state, uint32_t reg, uint32_t value) {
     state->gregs[reg] = value;
 }
 
-static bool try_pop_registers(unwind_state_t* state, uint32_t mask) {
+static bool try_pop_registers(const memory_t* memory, unwind_state_t* state, uint32_t mask) {
     uint32_t sp = state->gregs[R_SP];
     bool sp_updated = false;
     for (int i = 0; i < 16; i++) {
         if (mask & (1 << i)) {
             uint32_t value;
-            if (!try_get_word_stack(sp, &value)) {
+            if (!try_get_word_stack(memory, sp, &value)) {
                 return false;
             }
             if (i == R_SP) {
@@ -263,13 +270,13 @@ static bool try_pop_registers(unwind_state_t* state, uint32_t mask) {
     return true;
 }
 
-static bool try_pop_Stack_ForNotSaveInASM(unwind_state_t* state,size_t frames __attribute__((unused))) 
+static bool try_pop_Stack_ForNotSaveInASM(const memory_t* memory, unwind_state_t* state,size_t frames __attribute__((unused))) 
 {
     uint32_t sp = state->gregs[R_SP];
     bool sp_updated = false;
     uint32_t TempValue = 0;
 
-    if (!try_get_word_stack(state->gregs[R_SP]-4, &TempValue))
+    if (!try_get_word_stack(memory, state->gregs[R_SP]-4, &TempValue))
     {
         return false;
     }
@@ -284,7 +291,7 @@ static bool try_pop_Stack_ForNotSaveInASM(unwind_state_t* state,size_t frames __
     for (int i = 0; i < 16; i++)
     {
         uint32_t value;
-        if (!try_get_word_stack(sp, &value))
+        if (!try_get_word_stack(memory, sp, &value))
         {
             return false;
         }
@@ -318,7 +325,7 @@ static bool try_pop_Stack_ForNotSaveInASM(unwind_state_t* state,size_t frames __
  * virtual register state (including the stack pointer) such that
  * the call frame is unwound and the PC register points to the call site.
  */
-static bool execute_personality_routine(const memory_t* memory,
+static bool execute_personality_routine(memory_t* memory,
     unwind_state_t* state, byte_stream_t* stream, int pr_index) {
     size_t size;
     switch (pr_index) {
@@ -358,7 +365,7 @@ static bool execute_personality_routine(const memory_t* memory,
             uint32_t mask = (((uint32_t)op & 0x0f) << 12) | ((uint32_t)op2 << 4);
             if (mask) {
                 // "Pop up to 12 integer registers under masks {r15-r12}, {r11-r4}"
-                if (!try_pop_registers(state, mask)) {
+                if (!try_pop_registers(memory, state, mask)) {
                     return false;
                 }
                 if (mask & (1 << R_PC)) {
@@ -386,13 +393,13 @@ static bool execute_personality_routine(const memory_t* memory,
         } else if ((op & 0xf8) == 0xa0) {
             // "Pop r4-r[4+nnn]"
             uint32_t mask = (0x0ff0 >> (7 - (op & 0x07))) & 0x0ff0;
-            if (!try_pop_registers(state, mask)) {
+            if (!try_pop_registers(memory, state, mask)) {
                 return false;
             }
         } else if ((op & 0xf8) == 0xa8) {
             // "Pop r4-r[4+nnn], r14"
             uint32_t mask = ((0x0ff0 >> (7 - (op & 0x07))) & 0x0ff0) | 0x4000;
-            if (!try_pop_registers(state, mask)) {
+            if (!try_pop_registers(memory, state, mask)) {
                 return false;
             }
         } else if (op == 0xb0) {
@@ -405,7 +412,7 @@ static bool execute_personality_routine(const memory_t* memory,
             }
             if (op2 != 0x00 && (op2 & 0xf0) == 0x00) {
                 // "Pop integer registers under mask {r3, r2, r1, r0}"
-                if (!try_pop_registers(state, op2)) {
+                if (!try_pop_registers(memory, state, op2)) {
                     return false;
                 }
             } else {
@@ -486,7 +493,7 @@ static bool execute_personality_routine(const memory_t* memory,
     return true;
 }
 
-static bool try_get_half_word(const memory_t* memory, uint32_t pc, uint16_t* out_value) {
+static bool try_get_half_word(memory_t* memory, uint32_t pc, uint16_t* out_value) {
     uint32_t word;
     if (try_get_word(memory, pc & ~2, &word)) {
         *out_value = pc & 2 ? word >> 16 : word & 0xffff;
@@ -495,7 +502,7 @@ static bool try_get_half_word(const memory_t* memory, uint32_t pc, uint16_t* out
     return false;
 }
 
-uintptr_t rewind_pc_arch(const memory_t* memory, uintptr_t pc) {
+uintptr_t rewind_pc_arch(memory_t* memory, uintptr_t pc) {
     if (pc & 1) {
         /* Thumb mode - need to check whether the bl(x) has long offset or not.
          * Examples:
@@ -531,7 +538,7 @@ uintptr_t rewind_pc_arch(const memory_t* memory, uintptr_t pc) {
     return pc;
 }
 
-static ssize_t unwind_backtrace_common(const memory_t* memory,
+static ssize_t unwind_backtrace_common(memory_t* memory,
         const map_info_t* map_info_list,
         unwind_state_t* state, backtrace_frame_t* backtrace,
         size_t ignore_depth, size_t max_depth) {
@@ -583,7 +590,7 @@ static ssize_t unwind_backtrace_common(const memory_t* memory,
             break;
         }
         if(returned_frames==1)//only for the second layer backtrace
-                try_pop_Stack_ForNotSaveInASM(state,returned_frames);
+                try_pop_Stack_ForNotSaveInASM(memory, state,returned_frames);
         if (!state->gregs[R_PC]) {
             break;
         }
@@ -632,6 +639,47 @@ ssize_t unwind_backtrace_signal_arch_selfnogcc(
             backtrace, ignore_depth, max_depth);
 }
 
+size_t libudf_capture_stack(uint32_t* regs, void* buffer, size_t size) {
+    int loop = 0;
+    asm ("mov %0, r0;" :"=r"(regs[loop++]) : : );
+    asm ("mov %0, r1;" :"=r"(regs[loop++]) : : );
+    asm ("mov %0, r2;" :"=r"(regs[loop++]) : : );
+    asm ("mov %0, r3;" :"=r"(regs[loop++]) : : );
+    asm ("mov %0, r4;" :"=r"(regs[loop++]) : : );
+    asm ("mov %0, r5;" :"=r"(regs[loop++]) : : );
+    asm ("mov %0, r6;" :"=r"(regs[loop++]) : : );
+    asm ("mov %0, r7;" :"=r"(regs[loop++]) : : );
+    asm ("mov %0, r8;" :"=r"(regs[loop++]) : : );
+    asm ("mov %0, r9;" :"=r"(regs[loop++]) : : );
+    asm ("mov %0, r10;" :"=r"(regs[loop++]) : : );
+    asm ("mov %0, r11;" :"=r"(regs[loop++]) : : );
+    asm ("mov %0, r12;" :"=r"(regs[loop++]) : : );
+    asm ("mov %0, sp;" :"=r"(regs[loop++]) : : );
+    asm ("mov %0, lr;" :"=r"(regs[loop++]) : : );
+    asm ("mov %0, pc;" :"=r"(regs[loop++]) : : );
+
+    // the frames of this function and its callers are all above sp, copy as many as fit
+    uintptr_t start = 0, end = 0;
+    if (!get_thread_stack_range(&start, &end) || regs[R_SP] < end || regs[R_SP] >= start) {
+        return 0;
+    }
+    size_t length = start - regs[R_SP] < size ? start - regs[R_SP] : size;
+    memcpy(buffer, (const void*) regs[R_SP], length);
+    return length;
+}
+
+ssize_t unwind_backtrace_copy_arch(const map_info_t* map_info_list, const uint32_t* regs,
+        const void* stack, size_t size,
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth) {
+    unwind_state_t state;
+    memcpy(state.gregs, regs, sizeof(state.gregs));
+
+    memory_t memory;
+    init_memory_copy(&memory, map_info_list, stack, regs[R_SP], size);
+    return unwind_backtrace_common(&memory, map_info_list, &state,
+            backtrace, ignore_depth, max_depth);
+}
+
 ssize_t unwind_backtrace_signal_arch(siginfo_t* siginfo __attribute__ ((unused)), void* sigcontext,
         const map_info_t* map_info_list,
         backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth) {
@@ -29,12 +29,32 @@
 #include "ptrace-arch.h"
 #include "map_info.h"
 #include "ptrace.h"
+#include "exidx_cache.h"
 
 ssize_t libudf_unwind_backtrace(backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth) 
 {
     ssize_t frames = -1;
     map_info_t* milist = acquire_my_map_info_list();
+    uint32_t epoch = exidx_cache_enter();
     frames = unwind_backtrace_signal_arch_selfnogcc(milist, backtrace, ignore_depth, max_depth);
+    exidx_cache_leave(epoch);
     release_my_map_info_list(milist);
     return frames;
-}
\ No newline at end of file
+}
+
+void libudf_invalidate_modules()
+{
+    exidx_cache_invalidate();
+}
+
+ssize_t libudf_unwind_backtrace_copy(const uint32_t* regs, const void* stack, size_t size,
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth)
+{
+    ssize_t frames = -1;
+    map_info_t* milist = acquire_my_map_info_list();
+    uint32_t epoch = exidx_cache_enter();
+    frames = unwind_backtrace_copy_arch(milist, regs, stack, size, backtrace, ignore_depth, max_depth);
+    exidx_cache_leave(epoch);
+    release_my_map_info_list(milist);
+    return frames;
+}
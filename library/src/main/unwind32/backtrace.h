@@ -40,6 +40,26 @@ typedef uintptr_t backtrace_frame_t;
 __attribute__((visibility("default")))
 ssize_t libudf_unwind_backtrace(backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth);
 
+/*
+ * Saves r0-r15 of the calling thread into regs and copies up to size bytes of its stack,
+ * starting at the saved sp, into buffer. Returns the number of bytes copied, 0 if the
+ * stack couldn't be found. The frame of this function is the first one of the copy.
+ */
+size_t libudf_capture_stack(uint32_t* regs, void* buffer, size_t size);
+
+/*
+ * Unwinds a copy taken by libudf_capture_stack, possibly on another thread, as long as
+ * the modules it refers to are still loaded. Frames beyond the copy are not found.
+ */
+ssize_t libudf_unwind_backtrace_copy(const uint32_t* regs, const void* stack, size_t size,
+        backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth);
+
+/*
+ * Forgets the unwind tables cached for the modules of this process, call it after a dlclose.
+ * Modules that are still loaded keep their tables.
+ */
+void libudf_invalidate_modules();
+
 ssize_t libudf_unwind_backtrace_gcc(backtrace_frame_t* backtrace, size_t ignore_depth, size_t max_depth);
 
 /*
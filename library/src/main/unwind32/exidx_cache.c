@@ -0,0 +1,437 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "xdl.h"
+#include "libudf_unwind_p.h"
+#include "exidx_cache.h"
+#include "unwind_epoch.h"
+
+#ifndef PT_ARM_EXIDX
+#define PT_ARM_EXIDX 0x70000001
+#endif
+
+/* Special EXIDX value that indicates that a frame cannot be unwound. */
+#define EXIDX_CANTUNWIND 1
+
+#define EXIDX_MAX_MODULES 1024
+#define EXIDX_MAX_SEGMENTS 4
+#define EXIDX_MAX_RANGES 4096
+#define EXIDX_PC_CACHE_BITS 11
+#define EXIDX_PC_CACHE_SIZE (1 << EXIDX_PC_CACHE_BITS)
+/* Lookups that miss the answers check at most this often whether cached modules were unloaded. */
+#define EXIDX_CHECK_INTERVAL_MS 500
+
+/* Everything is mmap'ed, so building the cache never goes through the allocation proxies. */
+typedef struct exidx_block {
+    struct exidx_block* next;
+    size_t size;
+} exidx_block_t;
+
+typedef struct {
+    uintptr_t start;
+    uintptr_t end;
+} exidx_range_t;
+
+typedef struct {
+    uint32_t pc;        // first pc the entry covers
+    uint32_t handler;   // unwind instructions, 0 for EXIDX_CANTUNWIND
+} exidx_entry_t;
+
+/* EXIDX section of one module with absolute addresses, sorted by pc like the section. */
+typedef struct {
+    exidx_block_t block;
+    uintptr_t start;    // executable segment the entries cover
+    uintptr_t end;
+    uint32_t segments;  // loaded segments, readable as long as the module is loaded
+    exidx_range_t readable[EXIDX_MAX_SEGMENTS];
+    size_t count;
+    exidx_entry_t entries[];
+} exidx_module_t;
+
+/*
+ * Modules are only appended, count is published after the module, so lookups take no lock.
+ * A slot of pcs is handler << 32 | pc, one 64-bit store, so a reader never sees a torn pair.
+ */
+typedef struct {
+    exidx_block_t block;
+    uint64_t pcs[EXIDX_PC_CACHE_SIZE];
+    uint32_t count;
+    exidx_module_t* modules[EXIDX_MAX_MODULES];
+} exidx_cache_t;
+
+typedef struct {
+    uintptr_t pc;
+    exidx_module_t* module;
+    bool found;
+    uint32_t segments;
+    exidx_range_t readable[EXIDX_MAX_SEGMENTS];
+} exidx_search_t;
+
+typedef struct {
+    exidx_range_t* ranges;
+    size_t count;
+    bool overflow;
+} exidx_alive_t;
+
+static exidx_cache_t* exidx_cache = NULL;
+static pthread_mutex_t exidx_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Monotonic time of the last check for unloaded modules, in milliseconds. */
+static uint64_t exidx_checked = 0;
+
+/*
+ * Blocks replaced by the last exidx_cache_invalidate that dropped a module. Unwinds that entered
+ * before may still read them, they are unmapped once exidx_epoch says none is left.
+ */
+static exidx_block_t* exidx_retired = NULL;
+static unwind_epoch_t exidx_epoch;
+
+static void* exidx_alloc(size_t size) {
+    void* block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) {
+        return NULL;
+    }
+    ((exidx_block_t*) block)->next = NULL;
+    ((exidx_block_t*) block)->size = size;
+    return block;
+}
+
+static void exidx_free(void* block) {
+    munmap(block, ((exidx_block_t*) block)->size);
+}
+
+static void exidx_retire(void* block) {
+    ((exidx_block_t*) block)->next = exidx_retired;
+    exidx_retired = (exidx_block_t*) block;
+}
+
+// under exidx_mutex, whether the cache may be replaced, blocks retired last time are freed then
+static bool exidx_reclaim() {
+    if (!unwind_epoch_quiet(&exidx_epoch)) {
+        return false;
+    }
+    while (exidx_retired != NULL) {
+        exidx_block_t* block = exidx_retired;
+        exidx_retired = block->next;
+        exidx_free(block);
+    }
+    return true;
+}
+
+static uint64_t exidx_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static inline uint32_t exidx_pc_hash(uintptr_t pc) {
+    return ((uint32_t) (pc >> 1) * 0x9E3779B1u) >> (32 - EXIDX_PC_CACHE_BITS);
+}
+
+/* Transforms a 31-bit place-relative offset to an absolute address. */
+static inline uint32_t exidx_prel_to_absolute(uintptr_t place, uint32_t prel_offset) {
+    return place + (((int32_t)(prel_offset << 1)) >> 1);
+}
+
+static exidx_module_t* exidx_decode(const exidx_search_t* search, uintptr_t start, uintptr_t end,
+        uintptr_t exidx, size_t count) {
+    exidx_module_t* module = (exidx_module_t*) exidx_alloc(sizeof(exidx_module_t) + count * sizeof(exidx_entry_t));
+    if (module == NULL) {
+        return NULL;
+    }
+    module->start = start;
+    module->end = end;
+    module->segments = search->segments;
+    memcpy(module->readable, search->readable, sizeof(module->readable));
+    module->count = count;
+    // the module is loaded and its section mapped, so it is read with plain loads
+    const uint32_t* entry = (const uint32_t*) exidx;
+    for (size_t i = 0; i < count; i++, entry += 2) {
+        module->entries[i].pc = exidx_prel_to_absolute((uintptr_t) &entry[0], entry[0]);
+        if (entry[1] == EXIDX_CANTUNWIND) {
+            module->entries[i].handler = 0;
+        } else if (entry[1] & (1UL << 31)) {
+            module->entries[i].handler = (uintptr_t) &entry[1]; // in-place handler data
+        } else {
+            module->entries[i].handler = exidx_prel_to_absolute((uintptr_t) &entry[1], entry[1]);
+        }
+    }
+    return module;
+}
+
+static int exidx_search_callback(struct dl_phdr_info* info, size_t size __attribute__((unused)), void* data) {
+    exidx_search_t* search = (exidx_search_t*) data;
+    uintptr_t start = 0, end = 0, exidx = 0;
+    size_t count = 0;
+    uint32_t segments = 0;
+    exidx_range_t readable[EXIDX_MAX_SEGMENTS];
+    for (size_t i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        uintptr_t address = info->dlpi_addr + phdr->p_vaddr;
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X)) {
+            if (search->pc >= address && search->pc < address + phdr->p_memsz) {
+                start = address;
+                end = address + phdr->p_memsz;
+            }
+        }
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_R) && segments < EXIDX_MAX_SEGMENTS) {
+            readable[segments].start = address;
+            readable[segments].end = address + phdr->p_memsz;
+            segments++;
+        } else if (phdr->p_type == PT_ARM_EXIDX) {
+            exidx = address;
+            count = phdr->p_memsz / 8;
+        }
+    }
+    if (start == 0) {
+        return 0;
+    }
+    // a module without a section still gets an empty entry, so its pcs are answered from now on
+    search->found = true;
+    search->segments = segments;
+    memcpy(search->readable, readable, segments * sizeof(exidx_range_t));
+    search->module = exidx_decode(search, start, end, exidx, exidx != 0 ? count : 0);
+    return 1;
+}
+
+static int exidx_alive_callback(struct dl_phdr_info* info, size_t size __attribute__((unused)), void* data) {
+    exidx_alive_t* alive = (exidx_alive_t*) data;
+    for (size_t i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X)) {
+            continue;
+        }
+        if (alive->count == EXIDX_MAX_RANGES) {
+            alive->overflow = true;
+            return 1;
+        }
+        alive->ranges[alive->count].start = info->dlpi_addr + phdr->p_vaddr;
+        alive->ranges[alive->count].end = info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz;
+        alive->count++;
+    }
+    return 0;
+}
+
+static exidx_cache_t* exidx_current() {
+    exidx_cache_t* cache = __atomic_load_n(&exidx_cache, __ATOMIC_ACQUIRE);
+    if (cache != NULL) {
+        return cache;
+    }
+    pthread_mutex_lock(&exidx_mutex);
+    cache = exidx_cache;
+    if (cache == NULL) {
+        cache = (exidx_cache_t*) exidx_alloc(sizeof(exidx_cache_t));
+        __atomic_store_n(&exidx_checked, exidx_now_ms(), __ATOMIC_RELAXED);
+        __atomic_store_n(&exidx_cache, cache, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&exidx_mutex);
+    return cache;
+}
+
+static exidx_module_t* exidx_find_module(exidx_cache_t* cache, uintptr_t pc) {
+    uint32_t count = __atomic_load_n(&cache->count, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < count; i++) {
+        exidx_module_t* module = cache->modules[i];
+        if (pc >= module->start && pc < module->end) {
+            return module;
+        }
+    }
+    return NULL;
+}
+
+static uint32_t exidx_search_module(const exidx_module_t* module, uintptr_t pc) {
+    size_t low = 0;
+    size_t high = module->count;
+    while (low < high) {
+        size_t index = (low + high) / 2;
+        if (pc < module->entries[index].pc) {
+            high = index;
+        } else {
+            low = index + 1;
+        }
+    }
+    // low is the first entry past pc, the one before covers it
+    return low == 0 ? 0 : module->entries[low - 1].handler;
+}
+
+/*
+ * Builds the module of pc and answers from it. The linker lock is held while the modules are
+ * iterated and a dlopen holds it while constructors allocate, so exidx_mutex is only taken
+ * afterwards to publish the module.
+ */
+static bool exidx_load_module(exidx_cache_t* cache, uintptr_t pc, uint32_t* handler) {
+    exidx_search_t search;
+    memset(&search, 0, sizeof(search));
+    search.pc = pc;
+    xdl_iterate_phdr(exidx_search_callback, &search, XDL_DEFAULT);
+    if (!search.found) {
+        *handler = 0; // JIT code or a mapping the linker doesn't know
+        return true;
+    }
+    if (search.module == NULL) {
+        return false;
+    }
+    *handler = exidx_search_module(search.module, pc);
+
+    bool published = false;
+    pthread_mutex_lock(&exidx_mutex);
+    if (cache == exidx_cache && cache->count < EXIDX_MAX_MODULES && exidx_find_module(cache, pc) == NULL) {
+        cache->modules[cache->count] = search.module;
+        __atomic_store_n(&cache->count, cache->count + 1, __ATOMIC_RELEASE);
+        published = true;
+    }
+    pthread_mutex_unlock(&exidx_mutex);
+
+    // another thread was first, or the table was replaced meanwhile, no one else saw this copy
+    if (!published) {
+        exidx_free(search.module);
+    }
+    return true;
+}
+
+/*
+ * A dlclose is only seen by the proxy when its caller is hooked, so a lookup that misses the
+ * answers checks now and then whether a cached module is gone, one thread at a time.
+ */
+static bool exidx_check_due() {
+    uint64_t now = exidx_now_ms();
+    uint64_t checked = __atomic_load_n(&exidx_checked, __ATOMIC_RELAXED);
+    return now - checked >= EXIDX_CHECK_INTERVAL_MS
+            && __atomic_compare_exchange_n(&exidx_checked, &checked, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+bool exidx_cache_find(uintptr_t pc, uintptr_t* handler) {
+    exidx_cache_t* cache = exidx_current();
+    if (cache == NULL) {
+        return false;
+    }
+
+    uint64_t* slot = &cache->pcs[exidx_pc_hash(pc)];
+    uint64_t value = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    if (value != 0 && (uint32_t) value == pc) {
+        *handler = (uintptr_t) (value >> 32);
+        return true;
+    }
+
+    if (exidx_check_due()) {
+        exidx_cache_invalidate();
+        cache = __atomic_load_n(&exidx_cache, __ATOMIC_ACQUIRE);
+        if (cache == NULL) {
+            return false;
+        }
+        slot = &cache->pcs[exidx_pc_hash(pc)];
+    }
+
+    uint32_t found;
+    exidx_module_t* module = exidx_find_module(cache, pc);
+    if (module != NULL) {
+        found = exidx_search_module(module, pc);
+    } else if (!exidx_load_module(cache, pc, &found)) {
+        return false;
+    }
+    __atomic_store_n(slot, ((uint64_t) found << 32) | (uint32_t) pc, __ATOMIC_RELAXED);
+    LIBUDF_LOG("exidx_cache_find: pc=0x%08x, handler=0x%08x", pc, found);
+    *handler = found;
+    return true;
+}
+
+bool exidx_cache_readable(uintptr_t ptr, uintptr_t* start, uintptr_t* end) {
+    exidx_cache_t* cache = __atomic_load_n(&exidx_cache, __ATOMIC_ACQUIRE);
+    if (cache == NULL) {
+        return false;
+    }
+    uint32_t count = __atomic_load_n(&cache->count, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < count; i++) {
+        const exidx_module_t* module = cache->modules[i];
+        for (uint32_t j = 0; j < module->segments; j++) {
+            if (ptr >= module->readable[j].start && ptr < module->readable[j].end) {
+                *start = module->readable[j].start;
+                *end = module->readable[j].end;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+uint32_t exidx_cache_enter() {
+    return unwind_epoch_enter(&exidx_epoch);
+}
+
+void exidx_cache_leave(uint32_t epoch) {
+    unwind_epoch_leave(&exidx_epoch, epoch);
+}
+
+void exidx_cache_invalidate() {
+    if (__atomic_load_n(&exidx_cache, __ATOMIC_ACQUIRE) == NULL) {
+        return;
+    }
+    __atomic_store_n(&exidx_checked, exidx_now_ms(), __ATOMIC_RELAXED);
+
+    // the ranges still loaded, collected before exidx_mutex is taken, see exidx_load_module
+    exidx_alive_t alive = {NULL, 0, false};
+    void* ranges = exidx_alloc(sizeof(exidx_block_t) + EXIDX_MAX_RANGES * sizeof(exidx_range_t));
+    if (ranges == NULL) {
+        return;
+    }
+    alive.ranges = (exidx_range_t*) ((exidx_block_t*) ranges + 1);
+    xdl_iterate_phdr(exidx_alive_callback, &alive, XDL_DEFAULT);
+
+    pthread_mutex_lock(&exidx_mutex);
+    exidx_cache_t* cache = exidx_cache;
+    bool loaded[EXIDX_MAX_MODULES];
+    uint32_t unloaded = 0;
+    for (uint32_t i = 0; i < cache->count; i++) {
+        const exidx_module_t* module = cache->modules[i];
+        loaded[i] = false;
+        for (size_t j = 0; !alive.overflow && j < alive.count; j++) {
+            if (alive.ranges[j].start == module->start && alive.ranges[j].end == module->end) {
+                loaded[i] = true;
+                break;
+            }
+        }
+        unloaded += !loaded[i];
+    }
+
+    // nothing to drop keeps the cache and its answers, an unwind of the epoch before defers it
+    exidx_cache_t* fresh = NULL;
+    if (exidx_reclaim() && unloaded != 0) {
+        fresh = (exidx_cache_t*) exidx_alloc(sizeof(exidx_cache_t));
+    }
+    if (fresh != NULL) {
+        for (uint32_t i = 0; i < cache->count; i++) {
+            if (loaded[i]) {
+                fresh->modules[fresh->count++] = cache->modules[i];
+            } else {
+                exidx_retire(cache->modules[i]);
+            }
+        }
+        // answers are dropped with the old table, a lookup still using it only writes to it
+        __atomic_store_n(&exidx_cache, fresh, __ATOMIC_RELEASE);
+        exidx_retire(cache);
+        unwind_epoch_advance(&exidx_epoch);
+    }
+    pthread_mutex_unlock(&exidx_mutex);
+
+    exidx_free(ranges);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Per-module cache of the EXIDX sections of this process. */
+
+#ifndef _EXIDX_CACHE_H
+#define _EXIDX_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Finds the unwind instructions for a pc of this process, handler is 0 when the pc has none,
+ * because its entry is EXIDX_CANTUNWIND or it is in no module with an EXIDX section.
+ * Returns false only when the cache can't answer, the caller then searches the section itself.
+ *
+ * The EXIDX section of a module is decoded into a flat array the first time one of its pcs is
+ * looked up, answers are kept in a direct-mapped table by pc, so repeated stacks neither take
+ * the linker lock nor read the section again. Lookups that miss the table drop the modules
+ * that were unloaded meanwhile, at most every EXIDX_CHECK_INTERVAL_MS.
+ */
+bool exidx_cache_find(uintptr_t pc, uintptr_t* handler);
+
+/*
+ * Finds a segment of a cached module that contains ptr. The module may have been unloaded
+ * since it was cached, so the caller reads from the segment directly only after a read that
+ * can't fault succeeded in it. Modules are cached by exidx_cache_find.
+ */
+bool exidx_cache_readable(uintptr_t ptr, uintptr_t* start, uintptr_t* end);
+
+/*
+ * An unwind that uses the cache enters it first and leaves it when done, so blocks it may read
+ * are not unmapped meanwhile. Returns the epoch to leave.
+ */
+uint32_t exidx_cache_enter();
+
+void exidx_cache_leave(uint32_t epoch);
+
+/*
+ * Drops the modules that are no longer loaded and every answer with them, a module that was
+ * dlclosed may be replaced at its address. The cache is kept when no module was unloaded.
+ * Called by the dlclose proxy, lookups call it themselves as well.
+ */
+void exidx_cache_invalidate();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _EXIDX_CACHE_H
@@ -21,7 +21,9 @@ b * limitations under the License.
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/ptrace.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
@@ -29,41 +31,91 @@ b * limitations under the License.
 #include "ptrace-arch.h"
 #include "libudf_unwind_p.h"
 #include "ptrace.h"
-
-uint32_t d15_get_word(void *addr) __attribute__((noinline));
-
-uint32_t d15_get_word(void *addr) {
-#if defined(__arm__)
-  int val = 0xdeadaee0;
-  asm volatile ("ldr     %0, [%1, #0]\n"
-		"b       1f\n"
-		".long   0x75666475\n"
-		".long   0x00006477\n"
-		"1:\n"
-		:"+r"(val):"r"(addr):"memory");
-  return val;
-#else
-  return *(uint32_t *)addr;
-#endif
-}
-
-#if 0
-uint32_t d15_get_word_wo(void *addr) {
-  return *(uint32_t *)addr;
+#include "thread_stack.h"
+#include "exidx_cache.h"
+
+static void init_probe(memory_t* memory) {
+    memory->window_start = 0;
+    memory->window_end = 0;
+    memset(memory->confirmed, 0, sizeof(memory->confirmed));
+    memory->confirmed_next = 0;
+    memory->line_base = 0;
 }
-#endif
 
 void init_memory(memory_t* memory, const map_info_t* map_info_list) {
     memory->tid = -1;
     memory->map_info_list = map_info_list;
+    memory->stack_copy = NULL;
+    memory->stack_base = 0;
+    memory->stack_size = 0;
+    init_probe(memory);
 }
 
 void init_memory_ptrace(memory_t* memory, pid_t tid) {
     memory->tid = tid;
     memory->map_info_list = NULL;
+    memory->stack_copy = NULL;
+    memory->stack_base = 0;
+    memory->stack_size = 0;
+    init_probe(memory);
 }
 
-bool try_get_word(const memory_t* memory, uintptr_t ptr, uint32_t* out_value)
+void init_memory_copy(memory_t* memory, const map_info_t* map_info_list,
+        const void* stack_copy, uintptr_t stack_base, size_t stack_size) {
+    memory->tid = -1;
+    memory->map_info_list = map_info_list;
+    memory->stack_copy = (const uint8_t*) stack_copy;
+    memory->stack_base = stack_base;
+    memory->stack_size = stack_size;
+    init_probe(memory);
+}
+
+/*
+ * Readable range of this process around ptr: the stack of the thread, whose bounds are cached,
+ * or a segment of a module a line was already read from during this unwind.
+ */
+static bool find_readable(const memory_t* memory, uintptr_t ptr, uintptr_t* start, uintptr_t* end)
+{
+    uintptr_t top, bottom;
+    if (get_thread_stack_range(&top, &bottom) && ptr >= bottom && ptr < top) {
+        *start = bottom;
+        *end = top;
+        return true;
+    }
+    for (uint32_t i = 0; i < PROBE_CONFIRMED_SEGMENTS; i++) {
+        if (ptr >= memory->confirmed[i][0] && ptr < memory->confirmed[i][1]) {
+            *start = memory->confirmed[i][0];
+            *end = memory->confirmed[i][1];
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Reads the line around ptr with process_vm_readv, which fails instead of faulting. */
+static bool try_get_word_line(memory_t* memory, uintptr_t ptr, uint32_t* out_value)
+{
+    uintptr_t base = ptr & ~(uintptr_t)(PROBE_LINE_SIZE - 1);
+    if (memory->line_base != base) {
+        memory->line_base = 0;
+#ifdef __NR_process_vm_readv
+        struct iovec local = {memory->line, PROBE_LINE_SIZE};
+        struct iovec remote = {(void*)base, PROBE_LINE_SIZE};
+        if (syscall(__NR_process_vm_readv, getpid(), &local, 1, &remote, 1, 0) == PROBE_LINE_SIZE) {
+            memory->line_base = base;
+        }
+#endif
+        if (memory->line_base != base) {
+            LIBUDF_LOG("try_get_word: invalid pointer %p", (void*) ptr);
+            *out_value = 0xffffffffL;
+            return false;
+        }
+    }
+    *out_value = memory->line[(ptr - base) / 4];
+    return true;
+}
+
+bool try_get_word_slow(memory_t* memory, uintptr_t ptr, uint32_t* out_value)
 {
     LIBUDF_LOG("try_get_word: reading word at %p", (void*) ptr);
     if (ptr & 3) {
@@ -72,19 +124,25 @@ bool try_get_word(const memory_t* memory, uintptr_t ptr, uint32_t* out_value)
         return false;
     }
     if (memory->tid < 0) {
-#if 0
-        *out_value = *(uint32_t*)ptr;
-        return true;
-#else
-        uint32_t out = d15_get_word((void *)ptr);
-        if (out != 0xdeadaee0) {
-          *out_value = out;
-          return true;
-        } else {
-          *out_value = 0xffffffffL;
-          return false;
+        uintptr_t start, end;
+        if (find_readable(memory, ptr, &start, &end)) {
+            memory->window_start = start;
+            memory->window_end = end;
+            *out_value = *(const uint32_t*)ptr;
+            return true;
         }
-#endif
+        if (!try_get_word_line(memory, ptr, out_value)) {
+            return false;
+        }
+        // the cached module may have been unloaded since, the line just read shows it is not
+        if (exidx_cache_readable(ptr, &start, &end)) {
+            uint32_t next = memory->confirmed_next++ % PROBE_CONFIRMED_SEGMENTS;
+            memory->confirmed[next][0] = start;
+            memory->confirmed[next][1] = end;
+            memory->window_start = start;
+            memory->window_end = end;
+        }
+        return true;
     } else {
         // ptrace() returns -1 and sets errno when the operation fails.
         // To disambiguate -1 from a valid result, we clear errno beforehand.
@@ -99,157 +157,20 @@ bool try_get_word(const memory_t* memory, uintptr_t ptr, uint32_t* out_value)
     }
 }
 
-static size_t _main_thread_stack_start = 0;
-static size_t _main_thread_stack_size = 0;
-static pid_t ubrd_pid;
-
-static int ubrd_get_main_thread_stack(pid_t pid)
+bool try_get_word_stack(const memory_t* memory, uintptr_t ptr, uint32_t* out_value)
 {
-    char c, line[1024];
-    int i = 0, j = 0, fd = -1;
-    void* lib = NULL;
-	int (*close_fptr)(int) = NULL; //use func ptr to avoid open/close rehook deadlock
-	int (*open_fptr)(const char *, int, ...) = NULL;
-
-	lib = dlopen("libc.so", RTLD_NOW|RTLD_GLOBAL);
-	if (lib == NULL) {
-		LIBUDF_LOG("Could not open libc.so: %s\n", dlerror());
-		return -1;
-	}
-
-	close_fptr = (int (*)(int))dlsym(lib, "close");
-	open_fptr = (int (*)(const char *, int, ...))dlsym(lib, "open");
-	if (!close_fptr || !open_fptr) {
-		LIBUDF_LOG("invalid open/close: %s\n", dlerror());
-		dlclose(lib);
-		return -1;
-	}
-
-	snprintf(line, sizeof(line), "/proc/self/task/%d/maps", pid);
-
-	fd = open_fptr(line, O_RDONLY);
-	if (fd < 0) {
-		LIBUDF_LOG("/proc/%d/task/%d/maps open fail\n", pid, pid);
-		dlclose(lib);
-		return -1;
-	}
-
-	while (1) {
-		if (!read(fd, &c, 1)) break;
-		if (c == '\n') {
-			line[i] = '\0';
-			if (strncmp((const char *)&line[i-7], "[stack]", 7) == 0) {
-				const char* stack_start;
-				LIBUDF_LOG("stack:%s\n", line);
-			#if defined(__LP64__)
-				//64bit main stack format
-				//7ff1bf1000-7ff1c12000 rw-p 00000000 00:00 0                              [stack]
-				line[9] = '0';
-				line[10] = 'x';
-				line[21] = '\0'; //line[11~20] stack start
-				stack_start = (const char*)&line[9];
-			#else
-				//32bit main stack format
-				//becd7000-becf8000 rw-p 00000000 00:00 0          [stack]
-				line[7] = '0';
-				line[8] = 'x';
-				line[17] = '\0'; //line[9~16] 32bit main thread stack start
-				stack_start = (const char*)&line[7];
-			#endif
-				_main_thread_stack_start = strtoul(stack_start, (char **)NULL, 16);
-				_main_thread_stack_size = 8 * 1024 * 1024; //bypass RLIMIT check for simple handling
-				LIBUDF_LOG("[LCH_DEBUG]main_thread_stack_start:%p, main_thread_stack_size:%p\n",
-					   (void *)_main_thread_stack_start, (void *)_main_thread_stack_size);
-				close_fptr(fd);
-				dlclose(lib);
-				return 0;
-			}
-			else {
-				i = 0;
-			}
-		}
-		else {
-			line[i++] = c;
-		}
-	}
-    close_fptr(fd);
-
-    // stack is 28th parameter from /proc/self/stat
-    fd = open_fptr("/proc/self/stat", O_RDONLY);
-    if (fd < 0) {
-         LIBUDF_LOG("/proc/self/stat open fail\n");
-        dlclose(lib);
-        return -1;
-    }
-
-    i = j = 0;
-    line[0] = '\0';
-    while (1) {
-        if (!read(fd, &c, 1)) break;
-        if (c == ' ') {
-            j++;
-            if (j == 28) {
-                line[i] = '\0';
-                break;
-            }
-        }
-        else if (j == 27) {
-            line[i++] = c;
+    if (memory->stack_copy != NULL) {
+        if (ptr >= memory->stack_base && ptr - memory->stack_base + 4 <= memory->stack_size) {
+            memcpy(out_value, memory->stack_copy + (ptr - memory->stack_base), 4);
+            return true;
         }
+        return false;
     }
-
-    if (line[0] != '\0') {
-        _main_thread_stack_start =  strtoul(line, (char **)NULL, 10);
-        _main_thread_stack_size = 8 * 1024 * 1024;  // bypass RLIMIT check for simple handling
-        LIBUDF_LOG("[LCH_DEBUG]main_thread_stack_start:%p, main_thread_stack_size:%p\n",
-                (void *)_main_thread_stack_start, (void *)_main_thread_stack_size);
-        close_fptr(fd);
-        dlclose(lib);
-        return 0;
-    }
-
-	close_fptr(fd);
-	dlclose(lib);
-	return -1;
-}
-
-//return 0: success, -1 fail
-static int ubrd_get_stack(size_t* pthread_stack_start, size_t* pthread_stack_end) {
-	pid_t pid = getpid();
-
-	if (pid != ubrd_pid) {
-		LIBUDF_LOG("old pid:%d, new pid:%d\n", ubrd_pid, pid);
-		ubrd_pid = pid;
-		_main_thread_stack_start = 0; // reset for new process
-		_main_thread_stack_size = 0;
-	}
-
-	if (gettid() == pid) {
-		if (!_main_thread_stack_start) {
-			if (ubrd_get_main_thread_stack(pid)) {
-				LIBUDF_LOG("get_main_thread_stack fail\n");
-				return -1;
-			}
-		}
-		*pthread_stack_start = _main_thread_stack_start;
-		*pthread_stack_end = _main_thread_stack_start - _main_thread_stack_size;
-	}
-	else {
-		pthread_attr_t attr;
-		pthread_getattr_np(pthread_self(), &attr);
-		*pthread_stack_start = (size_t)attr.stack_base + attr.stack_size;
-		*pthread_stack_end = (size_t)attr.stack_base;
-	}
-	return 0;
-}
-
-bool try_get_word_stack(uintptr_t ptr, uint32_t* out_value)
-{
-    size_t sstart = 0, send = 0;
-    ubrd_get_stack(&sstart, &send);
-    if ((ptr >= send) && (ptr <= sstart)) {
+    // bounds are cached per thread, so this costs two TLS loads instead of a pthread_getattr_np
+    uintptr_t top, bottom;
+    if (get_thread_stack_range(&top, &bottom) && ptr >= bottom && ptr + 4 <= top) {
         *out_value = *(uint32_t*)ptr;
-	return true;
+        return true;
     }
     return false;
 }
@@ -36,10 +36,29 @@ typedef struct {
     map_info_t* map_info_list;
 } ptrace_context_t;
 
+/* Words read at once by process_vm_readv, a line never crosses a page. */
+#define PROBE_LINE_WORDS 16
+#define PROBE_LINE_SIZE (PROBE_LINE_WORDS * 4)
+/* Segments of modules remembered as loaded by one unwind, the oldest is replaced. */
+#define PROBE_CONFIRMED_SEGMENTS 4
+
 /* Describes how to access memory from a process. */
 typedef struct {
     pid_t tid;
     const map_info_t* map_info_list;
+    /* Copy of the stack taken at stack_base, when unwinding after the fact. */
+    const uint8_t* stack_copy;
+    uintptr_t stack_base;
+    size_t stack_size;
+    /* Range of this process last found mapped, words in it are loaded directly. */
+    uintptr_t window_start;
+    uintptr_t window_end;
+    /* Module segments a line was read from during this unwind, so they are still loaded. */
+    uintptr_t confirmed[PROBE_CONFIRMED_SEGMENTS][2];
+    uint32_t confirmed_next;
+    /* Line last read by process_vm_readv, for words outside of the stack and known modules. */
+    uintptr_t line_base;
+    uint32_t line[PROBE_LINE_WORDS];
 } memory_t;
 
 #if __i386__
@@ -89,14 +108,29 @@ void init_memory(memory_t* memory, const map_info_t* map_info_list);
  */
 void init_memory_ptrace(memory_t* memory, pid_t tid);
 
+/* Stack words are read from the copy instead, words outside of it can't be read. */
+void init_memory_copy(memory_t* memory, const map_info_t* map_info_list,
+        const void* stack_copy, uintptr_t stack_base, size_t stack_size);
+
+/* Reads a word that is outside of the window, the window moves to its range if it has one. */
+bool try_get_word_slow(memory_t* memory, uintptr_t ptr, uint32_t* out_value);
+
 /*
  * Reads a word of memory safely.
- * If the memory is local, ensures that the address is readable before dereferencing it.
+ * If the memory is local, ensures that the address is readable before dereferencing it:
+ * the stack of the thread and the segments of modules the unwinder has seen still mapped are
+ * loaded directly, anything else is read through process_vm_readv, so a bad pointer never faults.
  * Returns false and a value of 0xffffffff if the word could not be read.
  */
-bool try_get_word(const memory_t* memory, uintptr_t ptr, uint32_t* out_value);
+static inline bool try_get_word(memory_t* memory, uintptr_t ptr, uint32_t* out_value) {
+    if (ptr >= memory->window_start && ptr + 4 <= memory->window_end && !(ptr & 3)) {
+        *out_value = *(const uint32_t*)ptr;
+        return true;
+    }
+    return try_get_word_slow(memory, ptr, out_value);
+}
 
-bool try_get_word_stack(uintptr_t ptr, uint32_t* out_value);
+bool try_get_word_stack(const memory_t* memory, uintptr_t ptr, uint32_t* out_value);
 
 #ifdef __cplusplus
 }
@@ -15,52 +15,28 @@
  */
 
 #include "backtrace_64.h"
+#include "thread_stack.h"
+#include "cfi_64.h"
 #include <sys/resource.h>
+#include <atomic>
 #include <cinttypes>
 #include <cstring>
 #include <unistd.h>
 
-static uintptr_t fp_main_thread_stack_low = 0;
-static uintptr_t fp_main_thread_stack_high = 0;
-
-static pthread_key_t thread_t_key;
-static pthread_key_t thread_b_key;
-static bool use_thread_local = false;
+static std::atomic<uint64_t> sFpFrames(0);
+static std::atomic<uint64_t> sCfiFrames(0);
+static std::atomic<uint64_t> sFallbacks(0);
+static std::atomic<uint64_t> sStops(0);
 
 void init_arm64_unwind() {
-    if (pthread_key_create(&thread_t_key, nullptr) != 0) {
-        return;
-    }
-    if (pthread_key_create(&thread_b_key, nullptr) != 0) {
-        pthread_key_delete(thread_t_key);
-        return;
-    }
-    use_thread_local = true;
+    init_thread_stack();
 }
 
 size_t unwind_backtrace(uintptr_t *stack, size_t max_depth) {
     uintptr_t st; // stack top
     uintptr_t sb; // stack bottom
-    if (use_thread_local) {
-        if ((st = (uintptr_t) pthread_getspecific(thread_t_key)) == 0 ||
-            (sb = (uintptr_t) pthread_getspecific(thread_b_key)) == 0) {
-            GetStackRange(&st, &sb);
-            pthread_setspecific(thread_t_key, (void *) st);
-            pthread_setspecific(thread_b_key, (void *) sb);
-        }
-    } else {
-        if (gettid() == getpid()) {
-            if (fp_main_thread_stack_low == 0 || fp_main_thread_stack_high == 0) {
-                GetStackRange(&st, &sb);
-                fp_main_thread_stack_high = st;
-                fp_main_thread_stack_low = sb;
-            } else {
-                st = fp_main_thread_stack_high;
-                sb = fp_main_thread_stack_low;
-            }
-        } else {
-            GetStackRange(&st, &sb);
-        }
+    if (!get_thread_stack_range(&st, &sb)) {
+        return 0;
     }
 
     auto fp = (uintptr_t) __builtin_frame_address(0);
@@ -81,4 +57,216 @@ size_t unwind_backtrace(uintptr_t *stack, size_t max_depth) {
         fp = pre;
     }
     return depth;
-}
\ No newline at end of file
+}
+
+size_t capture_stack(uintptr_t *fp, void *buffer, size_t size) {
+    uintptr_t st;
+    uintptr_t sb;
+    if (!get_thread_stack_range(&st, &sb)) {
+        return 0;
+    }
+
+    *fp = (uintptr_t) __builtin_frame_address(0);
+    if (!isValid(*fp, st, sb)) {
+        return 0;
+    }
+    size_t length = st - *fp < size ? st - *fp : size;
+    memcpy(buffer, (const void *) *fp, length);
+    return length;
+}
+
+size_t unwind_backtrace_copy(uintptr_t fp, const void *buffer, size_t size, uintptr_t *stack, size_t max_depth) {
+    // the copy stands in for the stack between fp and fp + size
+    uintptr_t start = fp;
+    uintptr_t sb = fp - 1;
+    uintptr_t st = fp + size;
+
+    size_t depth = 0;
+    uintptr_t pc = 0;
+    while (fp > sb && fp + kFrameSize <= st && depth < max_depth) {
+        auto record = (const uintptr_t *) ((const uint8_t *) buffer + (fp - start));
+        uintptr_t tt = record[1];
+        uintptr_t pre = record[0];
+        if (pre & 0xfu || pre < fp + kFrameSize) {
+            break;
+        }
+        if (tt != pc) {
+            stack[depth++] = tt;
+        }
+        pc = tt;
+        sb = fp;
+        fp = pre;
+    }
+    return depth;
+}
+
+// registers at this point of the caller, the rules of its pc apply to them
+static inline __attribute__((always_inline)) void capture_regs(CfiRegs *regs) {
+#if defined(__aarch64__)
+    __asm__ volatile("adr %0, .\n mov %1, sp\n mov %2, x29\n mov %3, x30\n"
+                     : "=r"(regs->pc), "=r"(regs->sp), "=r"(regs->fp), "=r"(regs->lr));
+#else
+    __asm__ volatile("lea 0(%%rip), %0\n mov %%rsp, %1\n mov %%rbp, %2\n"
+                     : "=r"(regs->pc), "=r"(regs->sp), "=r"(regs->fp));
+    regs->lr = 0;
+#endif
+}
+
+/*
+ * Steps over the frame record fp points to. The record is only at the top of its frame when the
+ * frame holds nothing above it, so the caller's sp is left unknown and sb is raised to the record
+ * instead, a later CFI step takes a rule based on fp or recovers sp by cfi_step_after.
+ */
+static inline bool step_frame_record(CfiRegs *regs, CfiRegs *callee, uintptr_t st, uintptr_t *sb) {
+    uintptr_t fp = regs->fp;
+    if (fp & 0xfu || !isValid(fp, st, *sb) || fp < regs->sp) {
+        return false;
+    }
+    *callee = *regs;
+    regs->pc = *((uintptr_t *) fp + 1);
+    regs->fp = *((uintptr_t *) fp);
+    regs->lr = regs->pc;
+    regs->sp = 0;
+    *sb = fp;
+    return regs->pc != 0;
+}
+
+/*
+ * A CFI step of a caller whose sp was left unknown by a frame record step. A rule based on sp
+ * takes the cfa of the callee by the callee's own rule, only done once a plain step failed.
+ */
+static inline bool cfi_step_after(CfiRegs *regs, const CfiRegs *callee, bool exact, bool callee_exact,
+                                  uintptr_t st, uintptr_t sb, bool any_module) {
+    if (cfi_step(regs, exact, st, sb, any_module)) {
+        return true;
+    }
+    if (regs->sp != 0 || (!any_module && !cfi_is_selected(exact ? regs->pc : regs->pc - 1))) {
+        return false;
+    }
+    CfiRegs step = *callee;
+    if (!cfi_step(&step, callee_exact, st, sb, true) || step.pc != regs->pc || step.fp != regs->fp) {
+        return false;
+    }
+    regs->sp = step.sp;
+    if (cfi_step(regs, exact, st, sb, any_module)) {
+        return true;
+    }
+    regs->sp = 0;
+    return false;
+}
+
+size_t unwind_backtrace_cfi(uintptr_t *stack, size_t max_depth) {
+    uintptr_t st;
+    uintptr_t sb;
+    if (!get_thread_stack_range(&st, &sb)) {
+        return 0;
+    }
+
+    CfiRegs regs;
+    capture_regs(&regs);
+
+    uint32_t epoch = cfi_enter();
+    size_t depth = 0;
+    uintptr_t pc = 0;
+    bool exact = true;
+    CfiRegs callee = regs;
+    bool callee_exact = false;
+    while (depth < max_depth) {
+        if (!cfi_step_after(&regs, &callee, exact, callee_exact, st, sb, false)) {
+            if (!step_frame_record(&regs, &callee, st, &sb)) {
+                break;
+            }
+            callee_exact = exact;
+        }
+        exact = false;
+        if (regs.pc != pc) {
+            stack[depth++] = regs.pc;
+        }
+        pc = regs.pc;
+    }
+    cfi_leave(epoch);
+    return depth;
+}
+
+// a step of unwind_backtrace, which also checks that the caller is code, regs is unchanged on a break
+static inline bool step_frame_checked(CfiRegs *regs, CfiRegs *callee, uintptr_t st, uintptr_t *sb) {
+    uintptr_t fp = regs->fp;
+    if (fp & 0xfu || !isValid(fp, st, *sb) || fp < regs->sp) {
+        return false;
+    }
+    uintptr_t tt = *((uintptr_t *) fp + 1);
+    uintptr_t pre = *((uintptr_t *) fp);
+    if (pre & 0xfu || pre < fp + kFrameSize || !cfi_is_code(tt - 1)) {
+        return false;
+    }
+    *callee = *regs;
+    regs->pc = tt;
+    regs->lr = tt;
+    regs->fp = pre;
+    regs->sp = 0;
+    *sb = fp;
+    return true;
+}
+
+size_t unwind_backtrace_hybrid(uintptr_t *stack, size_t max_depth, bool selected) {
+    uintptr_t st;
+    uintptr_t sb;
+    if (!get_thread_stack_range(&st, &sb)) {
+        return 0;
+    }
+
+    CfiRegs regs;
+    capture_regs(&regs);
+
+    size_t depth = 0;
+    uintptr_t pc = 0;
+    bool exact = true;
+    uint64_t fp_frames = 0;
+    uint64_t cfi_frames = 0;
+    uint64_t fallbacks = 0;
+    CfiRegs callee = regs;
+    bool callee_exact = false;
+    uint32_t epoch = cfi_enter();
+    while (depth < max_depth) {
+        if (selected && cfi_step_after(&regs, &callee, exact, callee_exact, st, sb, false)) {
+            cfi_frames++;
+        } else if (step_frame_checked(&regs, &callee, st, &sb)) {
+            fp_frames++;
+            callee_exact = exact;
+        } else if (cfi_step_after(&regs, &callee, exact, callee_exact, st, sb, true)) {
+            cfi_frames++;
+            fallbacks++;
+        } else {
+            sStops.fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+        exact = false;
+        if (regs.pc != pc) {
+            stack[depth++] = regs.pc;
+        }
+        pc = regs.pc;
+    }
+    cfi_leave(epoch);
+
+    // once per walk, the counters are shared by all threads
+    sFpFrames.fetch_add(fp_frames, std::memory_order_relaxed);
+    if (cfi_frames != 0) {
+        sCfiFrames.fetch_add(cfi_frames, std::memory_order_relaxed);
+        sFallbacks.fetch_add(fallbacks, std::memory_order_relaxed);
+    }
+    return depth;
+}
+
+void get_unwind_counters(UnwindCounters *counters) {
+    counters->fp_frames = sFpFrames.load(std::memory_order_relaxed);
+    counters->cfi_frames = sCfiFrames.load(std::memory_order_relaxed);
+    counters->fallbacks = sFallbacks.load(std::memory_order_relaxed);
+    counters->stops = sStops.load(std::memory_order_relaxed);
+}
+
+void reset_unwind_counters() {
+    sFpFrames.store(0, std::memory_order_relaxed);
+    sCfiFrames.store(0, std::memory_order_relaxed);
+    sFallbacks.store(0, std::memory_order_relaxed);
+    sStops.store(0, std::memory_order_relaxed);
+}
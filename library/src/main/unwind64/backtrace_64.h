@@ -22,6 +22,7 @@ extern "C" {
 #endif
 
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 static const uintptr_t kFrameSize = 2 * sizeof(uintptr_t);
@@ -30,22 +31,37 @@ static inline bool isValid(uintptr_t fp, uintptr_t st, uintptr_t sb) {
     return fp > sb && fp < st - kFrameSize;
 }
 
-static inline void GetStackRange(uintptr_t *st, uintptr_t *sb) {
-    void *address;
-    size_t size;
+__attribute__((visibility("default")))
+size_t unwind_backtrace(uintptr_t *stack, size_t max_depth);
 
-    pthread_attr_t attr;
-    pthread_getattr_np(pthread_self(), &attr);
-    pthread_attr_getstack(&attr, &address, &size);
+// copies up to size bytes of the stack, from the frame of this function up, fp is where it starts
+size_t capture_stack(uintptr_t *fp, void *buffer, size_t size);
 
-    pthread_attr_destroy(&attr);
+// walks the frame records of a copy taken by capture_stack, its first frame is the caller's
+size_t unwind_backtrace_copy(uintptr_t fp, const void *buffer, size_t size, uintptr_t *stack, size_t max_depth);
 
-    *st = (uintptr_t) address + size;
-    *sb = (uintptr_t) address;
-}
+// unwinds frames of modules selected by cfi_select_modules by their CFI, the others by frame records
+size_t unwind_backtrace_cfi(uintptr_t *stack, size_t max_depth);
 
-__attribute__((visibility("default")))
-size_t unwind_backtrace(uintptr_t *stack, size_t max_depth);
+// frames of unwind_backtrace_hybrid by how they were unwound
+typedef struct {
+    uint64_t fp_frames;
+    uint64_t cfi_frames;
+    uint64_t fallbacks; // breaks of the frame chain that CFI continued
+    uint64_t stops;     // breaks CFI could not continue either, the end of a stack is one
+} UnwindCounters;
+
+/*
+ * Follows frame records like unwind_backtrace, a record that is broken or returns to no module is
+ * stepped over by the CFI of its module instead, selected or not. An omitted frame pointer skips
+ * frames without breaking the chain, so with selected the modules of cfi_select_modules always
+ * go by CFI.
+ */
+size_t unwind_backtrace_hybrid(uintptr_t *stack, size_t max_depth, bool selected);
+
+void get_unwind_counters(UnwindCounters *counters);
+
+void reset_unwind_counters();
 
 void init_arm64_unwind();
 
@@ -0,0 +1,1168 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <cstring>
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <time.h>
+
+#include "xdl.h"
+#include "cfi_64.h"
+#include "unwind_epoch.h"
+
+#ifndef PT_GNU_EH_FRAME
+#define PT_GNU_EH_FRAME 0x6474e550
+#endif
+
+// DWARF numbers of the registers the rules are kept for
+#if defined(__aarch64__)
+#define CFI_REG_FP 29
+#define CFI_REG_RA 30
+#define CFI_REG_SP 31
+#define CFI_HAS_LR 1
+#else
+#define CFI_REG_FP 6
+#define CFI_REG_SP 7
+#define CFI_REG_RA 16
+#define CFI_HAS_LR 0
+#endif
+
+#define CFI_MAX_MODULES 1024
+#define CFI_MAX_RANGES 4096
+#define CFI_MAX_PATH 256
+#define CFI_PAGE_CACHE_BITS 12
+#define CFI_PAGE_CACHE_SIZE (1 << CFI_PAGE_CACHE_BITS)
+#define CFI_MISS_CACHE_BITS 8
+#define CFI_MISS_CACHE_SIZE (1 << CFI_MISS_CACHE_BITS)
+#define CFI_STATE_DEPTH 8
+// steps that miss the page answers check at most this often whether cached modules were unloaded
+#define CFI_CHECK_INTERVAL_MS 500
+
+#define DW_EH_PE_absptr   0x00
+#define DW_EH_PE_uleb128  0x01
+#define DW_EH_PE_udata2   0x02
+#define DW_EH_PE_udata4   0x03
+#define DW_EH_PE_udata8   0x04
+#define DW_EH_PE_sleb128  0x09
+#define DW_EH_PE_sdata2   0x0a
+#define DW_EH_PE_sdata4   0x0b
+#define DW_EH_PE_sdata8   0x0c
+#define DW_EH_PE_pcrel    0x10
+#define DW_EH_PE_datarel  0x30
+#define DW_EH_PE_indirect 0x80
+#define DW_EH_PE_omit     0xff
+
+// rule of one pc range, the cfa is a register plus an offset, fp and ra are saved relative to it
+#define CFI_CFA_NONE 0
+#define CFI_CFA_SP   1
+#define CFI_CFA_FP   2
+
+#define CFI_FP_SAVED     0x01
+#define CFI_RA_SAVED     0x02
+#define CFI_RA_UNDEFINED 0x04
+#define CFI_RA_SIGNED    0x08
+
+typedef struct {
+    uint32_t pc;          // offset from the load bias, the rule holds up to the next row
+    int32_t  cfa_offset;
+    int16_t  fp_offset;
+    int16_t  ra_offset;
+    uint8_t  cfa;
+    uint8_t  flags;
+    uint16_t reserved;
+} CfiRow;
+
+// everything is mmap'ed, so compiling a module never goes through the allocation proxies
+typedef struct CfiBlock {
+    struct CfiBlock *next;
+    size_t size;
+} CfiBlock;
+
+typedef struct {
+    CfiBlock block;
+    size_t   count;
+    CfiRow   rows[];
+} CfiTable;
+
+typedef struct {
+    uintptr_t bias;
+    uintptr_t start;      // executable segment
+    uintptr_t end;
+    uintptr_t eh_frame_hdr;
+    size_t    eh_frame_hdr_size;
+    bool      selected;
+    std::atomic<CfiTable *> table;
+} CfiModule;
+
+/*
+ * Modules are only appended, count is published after the module, so lookups take no lock.
+ * pages remembers the module of a page of code, a module's segments start on pages of their own.
+ * misses remembers pages of no module, a walk that ends in garbage would search them each time.
+ */
+typedef struct {
+    CfiBlock block;
+    std::atomic<CfiModule *> pages[CFI_PAGE_CACHE_SIZE];
+    std::atomic<uintptr_t> misses[CFI_MISS_CACHE_SIZE];
+    std::atomic<uint32_t> count;
+    CfiModule modules[CFI_MAX_MODULES];
+} CfiCache;
+
+typedef struct {
+    uintptr_t pc;
+    bool      found;
+    uintptr_t bias;
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t eh_frame_hdr;
+    size_t    eh_frame_hdr_size;
+    char      path[CFI_MAX_PATH];
+} CfiSearch;
+
+typedef struct {
+    uintptr_t start;
+    uintptr_t end;
+} CfiRange;
+
+typedef struct {
+    CfiRange *ranges;
+    size_t count;
+    bool overflow;
+} CfiAlive;
+
+typedef struct {
+    const CfiModule *module;
+    CfiTable *table;
+} CfiCompile;
+
+static std::atomic<CfiCache *> sCache(nullptr);
+static pthread_mutex_t sMutex = PTHREAD_MUTEX_INITIALIZER;
+static regex_t sRegex;
+static bool sSelecting = false;
+
+// answer of a module without usable CFI, so it is compiled only once
+static CfiTable sNoRules;
+
+/*
+ * Blocks replaced by the last selection or unload, unwinds that entered before may still read
+ * them, they are unmapped once sEpoch says none is left.
+ */
+static CfiBlock *sRetired = nullptr;
+static unwind_epoch_t sEpoch;
+
+// monotonic time of the last check for unloaded modules, in milliseconds
+static std::atomic<uint64_t> sChecked(0);
+
+static void *cfi_alloc(size_t size) {
+    void *block = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) {
+        return nullptr;
+    }
+    ((CfiBlock *) block)->next = nullptr;
+    ((CfiBlock *) block)->size = size;
+    return block;
+}
+
+static void cfi_free(void *block) {
+    munmap(block, ((CfiBlock *) block)->size);
+}
+
+static void cfi_retire(void *block) {
+    if (block == nullptr || block == &sNoRules) {
+        return;
+    }
+    ((CfiBlock *) block)->next = sRetired;
+    sRetired = (CfiBlock *) block;
+}
+
+// must hold sMutex, whether the cache may be replaced, blocks retired last time are freed then
+static bool cfi_reclaim() {
+    if (!unwind_epoch_quiet(&sEpoch)) {
+        return false;
+    }
+    while (sRetired != nullptr) {
+        CfiBlock *block = sRetired;
+        sRetired = block->next;
+        cfi_free(block);
+    }
+    return true;
+}
+
+static uint64_t now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//**************************************************************************************************
+typedef struct {
+    const uint8_t *instructions;
+    const uint8_t *end;
+    uint64_t code_align;
+    int64_t  data_align;
+    uint8_t  fde_encoding;
+    bool     augmented;
+} CfiCie;
+
+typedef struct {
+    uint8_t type;
+    int64_t offset;
+} CfiRule;
+
+#define CFI_RULE_SAME      0
+#define CFI_RULE_UNDEFINED 1
+#define CFI_RULE_OFFSET    2
+#define CFI_RULE_OTHER     3
+
+typedef struct {
+    uint64_t cfa_reg;
+    int64_t  cfa_offset;
+    bool     cfa_other;
+    bool     ra_signed;
+    CfiRule  fp;
+    CfiRule  ra;
+} CfiFrame;
+
+// rows of all FDEs, a counting pass runs with rows null and sizes the table for the second
+typedef struct {
+    CfiRow *rows;
+    size_t capacity;
+    size_t count;
+    CfiRow last;
+    uintptr_t bias;
+} CfiEmitter;
+
+template<typename T>
+static inline T read_raw(const uint8_t **p) {
+    T value;
+    memcpy(&value, *p, sizeof(T));
+    *p += sizeof(T);
+    return value;
+}
+
+static uint64_t read_uleb(const uint8_t **p) {
+    uint64_t value = 0;
+    uint32_t shift = 0;
+    uint8_t byte;
+    do {
+        byte = *(*p)++;
+        if (shift < 64) {
+            value |= (uint64_t) (byte & 0x7f) << shift;
+        }
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+static int64_t read_sleb(const uint8_t **p) {
+    int64_t value = 0;
+    uint32_t shift = 0;
+    uint8_t byte;
+    do {
+        byte = *(*p)++;
+        if (shift < 64) {
+            value |= (int64_t) (byte & 0x7f) << shift;
+        }
+        shift += 7;
+    } while (byte & 0x80);
+    if (shift < 64 && (byte & 0x40)) {
+        value |= -((int64_t) 1 << shift);
+    }
+    return value;
+}
+
+static bool read_format(const uint8_t **p, uint8_t format, uintptr_t *out) {
+    switch (format & 0x0f) {
+        case DW_EH_PE_absptr:
+            *out = read_raw<uintptr_t>(p);
+            return true;
+        case DW_EH_PE_uleb128:
+            *out = (uintptr_t) read_uleb(p);
+            return true;
+        case DW_EH_PE_udata2:
+            *out = read_raw<uint16_t>(p);
+            return true;
+        case DW_EH_PE_udata4:
+            *out = read_raw<uint32_t>(p);
+            return true;
+        case DW_EH_PE_udata8:
+            *out = (uintptr_t) read_raw<uint64_t>(p);
+            return true;
+        case DW_EH_PE_sleb128:
+            *out = (uintptr_t) read_sleb(p);
+            return true;
+        case DW_EH_PE_sdata2:
+            *out = (uintptr_t) (intptr_t) read_raw<int16_t>(p);
+            return true;
+        case DW_EH_PE_sdata4:
+            *out = (uintptr_t) (intptr_t) read_raw<int32_t>(p);
+            return true;
+        case DW_EH_PE_sdata8:
+            *out = (uintptr_t) read_raw<int64_t>(p);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool read_encoded(const uint8_t **p, uint8_t encoding, uintptr_t datarel, uintptr_t *out) {
+    if (encoding == DW_EH_PE_omit) {
+        return false;
+    }
+    uintptr_t place = (uintptr_t) *p;
+    uintptr_t value;
+    if (!read_format(p, encoding, &value)) {
+        return false;
+    }
+    switch (encoding & 0x70) {
+        case 0:
+            break;
+        case DW_EH_PE_pcrel:
+            value += place;
+            break;
+        case DW_EH_PE_datarel:
+            value += datarel;
+            break;
+        default:
+            return false;
+    }
+    if (encoding & DW_EH_PE_indirect) {
+        value = *(const uintptr_t *) value;
+    }
+    *out = value;
+    return true;
+}
+
+static bool parse_cie(const uint8_t *cie, CfiCie *out) {
+    const uint8_t *p = cie;
+    uint64_t length = read_raw<uint32_t>(&p);
+    bool wide = length == 0xffffffff;
+    if (wide) {
+        length = read_raw<uint64_t>(&p);
+    }
+    if (length == 0) {
+        return false;
+    }
+    const uint8_t *end = p + length;
+    uint64_t id = wide ? read_raw<uint64_t>(&p) : read_raw<uint32_t>(&p);
+    if (id != 0) {
+        return false;
+    }
+    uint8_t version = *p++;
+    const char *augmentation = (const char *) p;
+    p += strlen(augmentation) + 1;
+    if (version >= 4) {
+        p += 2; // address_size, segment_size
+    }
+    out->code_align = read_uleb(&p);
+    out->data_align = read_sleb(&p);
+    if (version == 1) {
+        p++;
+    } else {
+        read_uleb(&p);
+    }
+    out->fde_encoding = DW_EH_PE_absptr;
+    out->augmented = augmentation[0] == 'z';
+    if (out->augmented) {
+        uint64_t size = read_uleb(&p);
+        const uint8_t *data = p;
+        for (const char *c = augmentation + 1; *c != '\0'; c++) {
+            if (*c == 'R') {
+                out->fde_encoding = *p++;
+            } else if (*c == 'P') {
+                uintptr_t personality;
+                uint8_t encoding = *p++;
+                if (!read_format(&p, encoding, &personality)) {
+                    return false;
+                }
+            } else if (*c == 'L') {
+                p++;
+            } else if (*c != 'S' && *c != 'B' && *c != 'G') {
+                break;
+            }
+        }
+        p = data + size;
+    } else if (augmentation[0] != '\0') {
+        return false;
+    }
+    out->instructions = p;
+    out->end = end;
+    return p <= end;
+}
+
+static void set_rule(CfiFrame *frame, uint64_t reg, uint8_t type, int64_t offset) {
+    if (reg == CFI_REG_FP) {
+        frame->fp.type = type;
+        frame->fp.offset = offset;
+    } else if (reg == CFI_REG_RA) {
+        frame->ra.type = type;
+        frame->ra.offset = offset;
+    }
+}
+
+static void restore_rule(CfiFrame *frame, const CfiFrame *initial, uint64_t reg) {
+    if (reg == CFI_REG_FP) {
+        frame->fp = initial->fp;
+    } else if (reg == CFI_REG_RA) {
+        frame->ra = initial->ra;
+    }
+}
+
+static CfiRow to_row(const CfiFrame *frame, uintptr_t pc, uintptr_t bias) {
+    CfiRow row;
+    memset(&row, 0, sizeof(row));
+    row.pc = (uint32_t) (pc - bias);
+    if (frame->cfa_other || frame->cfa_offset != (int32_t) frame->cfa_offset) {
+        return row;
+    }
+    if (frame->cfa_reg == CFI_REG_SP) {
+        row.cfa = CFI_CFA_SP;
+    } else if (frame->cfa_reg == CFI_REG_FP) {
+        row.cfa = CFI_CFA_FP;
+    } else {
+        return row;
+    }
+    row.cfa_offset = (int32_t) frame->cfa_offset;
+
+    if (frame->ra.type == CFI_RULE_UNDEFINED) {
+        row.flags |= CFI_RA_UNDEFINED;
+    } else if (frame->ra.type == CFI_RULE_OFFSET && frame->ra.offset == (int16_t) frame->ra.offset) {
+        row.flags |= CFI_RA_SAVED;
+        row.ra_offset = (int16_t) frame->ra.offset;
+    } else if (frame->ra.type != CFI_RULE_SAME) {
+        row.cfa = CFI_CFA_NONE;
+    }
+    if (frame->fp.type == CFI_RULE_OFFSET && frame->fp.offset == (int16_t) frame->fp.offset) {
+        row.flags |= CFI_FP_SAVED;
+        row.fp_offset = (int16_t) frame->fp.offset;
+    } else if (frame->fp.type == CFI_RULE_OTHER || frame->fp.type == CFI_RULE_OFFSET) {
+        row.cfa = CFI_CFA_NONE;
+    }
+    if (frame->ra_signed) {
+        row.flags |= CFI_RA_SIGNED;
+    }
+    return row;
+}
+
+static void emit(CfiEmitter *emitter, const CfiRow &row) {
+    if (emitter->count > 0) {
+        const CfiRow &last = emitter->last;
+        if (row.pc < last.pc) {
+            return; // FDEs overlap, keep the first
+        }
+        if (row.pc == last.pc) {
+            emitter->count--; // a rule for nothing, like the end marker of the previous FDE
+        } else if (row.cfa == last.cfa && row.cfa_offset == last.cfa_offset && row.flags == last.flags
+                   && row.fp_offset == last.fp_offset && row.ra_offset == last.ra_offset) {
+            return;
+        }
+    }
+    if (emitter->rows != nullptr) {
+        if (emitter->count >= emitter->capacity) {
+            return;
+        }
+        emitter->rows[emitter->count] = row;
+    }
+    emitter->count++;
+    emitter->last = row;
+}
+
+/*
+ * Runs a CFA program, rows are emitted at each advance when an emitter is given. Returns false
+ * at an instruction it doesn't know, the rest of the FDE has no rule then.
+ */
+static bool execute(const uint8_t *p, const uint8_t *end, const CfiCie *cie, CfiFrame *frame,
+                    const CfiFrame *initial, uintptr_t *loc, CfiEmitter *emitter) {
+    CfiFrame stack[CFI_STATE_DEPTH];
+    uint32_t depth = 0;
+    while (p < end) {
+        uint8_t op = *p++;
+        uint64_t reg;
+        uint64_t delta = 0;
+        bool advance = false;
+        switch (op & 0xc0) {
+            case 0x40:
+                delta = op & 0x3f;
+                advance = true;
+                break;
+            case 0x80:
+                set_rule(frame, op & 0x3f, CFI_RULE_OFFSET, (int64_t) read_uleb(&p) * cie->data_align);
+                continue;
+            case 0xc0:
+                restore_rule(frame, initial, op & 0x3f);
+                continue;
+            default:
+                break;
+        }
+        if (!advance) {
+            switch (op) {
+                case 0x00: // nop
+                    break;
+                case 0x01: { // set_loc
+                    uintptr_t target;
+                    if (!read_encoded(&p, cie->fde_encoding, 0, &target)) {
+                        return false;
+                    }
+                    if (emitter != nullptr) {
+                        emit(emitter, to_row(frame, *loc, emitter->bias));
+                    }
+                    *loc = target;
+                    break;
+                }
+                case 0x02:
+                    delta = read_raw<uint8_t>(&p);
+                    advance = true;
+                    break;
+                case 0x03:
+                    delta = read_raw<uint16_t>(&p);
+                    advance = true;
+                    break;
+                case 0x04:
+                    delta = read_raw<uint32_t>(&p);
+                    advance = true;
+                    break;
+                case 0x05: // offset_extended
+                    reg = read_uleb(&p);
+                    set_rule(frame, reg, CFI_RULE_OFFSET, (int64_t) read_uleb(&p) * cie->data_align);
+                    break;
+                case 0x06: // restore_extended
+                    restore_rule(frame, initial, read_uleb(&p));
+                    break;
+                case 0x07: // undefined
+                    set_rule(frame, read_uleb(&p), CFI_RULE_UNDEFINED, 0);
+                    break;
+                case 0x08: // same_value
+                    set_rule(frame, read_uleb(&p), CFI_RULE_SAME, 0);
+                    break;
+                case 0x09: // register
+                    reg = read_uleb(&p);
+                    read_uleb(&p);
+                    set_rule(frame, reg, CFI_RULE_OTHER, 0);
+                    break;
+                case 0x0a: // remember_state
+                    if (depth == CFI_STATE_DEPTH) {
+                        return false;
+                    }
+                    stack[depth++] = *frame;
+                    break;
+                case 0x0b: // restore_state, the cfa is part of the state as well
+                    if (depth == 0) {
+                        return false;
+                    }
+                    *frame = stack[--depth];
+                    break;
+                case 0x0c: // def_cfa
+                    frame->cfa_reg = read_uleb(&p);
+                    frame->cfa_offset = (int64_t) read_uleb(&p);
+                    frame->cfa_other = false;
+                    break;
+                case 0x0d: // def_cfa_register
+                    frame->cfa_reg = read_uleb(&p);
+                    frame->cfa_other = false;
+                    break;
+                case 0x0e: // def_cfa_offset
+                    frame->cfa_offset = (int64_t) read_uleb(&p);
+                    break;
+                case 0x0f: // def_cfa_expression
+                    p += read_uleb(&p);
+                    frame->cfa_other = true;
+                    break;
+                case 0x10: // expression
+                    reg = read_uleb(&p);
+                    p += read_uleb(&p);
+                    set_rule(frame, reg, CFI_RULE_OTHER, 0);
+                    break;
+                case 0x11: // offset_extended_sf
+                    reg = read_uleb(&p);
+                    set_rule(frame, reg, CFI_RULE_OFFSET, read_sleb(&p) * cie->data_align);
+                    break;
+                case 0x12: // def_cfa_sf
+                    frame->cfa_reg = read_uleb(&p);
+                    frame->cfa_offset = read_sleb(&p) * cie->data_align;
+                    frame->cfa_other = false;
+                    break;
+                case 0x13: // def_cfa_offset_sf
+                    frame->cfa_offset = read_sleb(&p) * cie->data_align;
+                    break;
+                case 0x14: // val_offset
+                    reg = read_uleb(&p);
+                    read_uleb(&p);
+                    set_rule(frame, reg, CFI_RULE_OTHER, 0);
+                    break;
+                case 0x15: // val_offset_sf
+                    reg = read_uleb(&p);
+                    read_sleb(&p);
+                    set_rule(frame, reg, CFI_RULE_OTHER, 0);
+                    break;
+                case 0x16: // val_expression
+                    reg = read_uleb(&p);
+                    p += read_uleb(&p);
+                    set_rule(frame, reg, CFI_RULE_OTHER, 0);
+                    break;
+                case 0x2d: // AArch64 negate_ra_state, the return address is signed from here on
+#if defined(__aarch64__)
+                    frame->ra_signed = !frame->ra_signed;
+#endif
+                    break;
+                case 0x2e: // GNU_args_size
+                    read_uleb(&p);
+                    break;
+                case 0x2f: // GNU_negative_offset_extended
+                    reg = read_uleb(&p);
+                    set_rule(frame, reg, CFI_RULE_OFFSET, -(int64_t) read_uleb(&p) * cie->data_align);
+                    break;
+                default:
+                    return false;
+            }
+        }
+        if (advance) {
+            if (emitter != nullptr) {
+                emit(emitter, to_row(frame, *loc, emitter->bias));
+            }
+            *loc += delta * cie->code_align;
+        }
+    }
+    return true;
+}
+
+static void compile_fde(const uint8_t *fde, CfiEmitter *emitter, const uint8_t **cached, CfiCie *cie,
+                        CfiFrame *initial) {
+    const uint8_t *p = fde;
+    uint64_t length = read_raw<uint32_t>(&p);
+    bool wide = length == 0xffffffff;
+    if (wide) {
+        length = read_raw<uint64_t>(&p);
+    }
+    if (length == 0) {
+        return;
+    }
+    const uint8_t *end = p + length;
+    const uint8_t *place = p;
+    uint64_t pointer = wide ? read_raw<uint64_t>(&p) : read_raw<uint32_t>(&p);
+    if (pointer == 0) {
+        return; // a CIE
+    }
+
+    // FDEs of one object share their CIE, it is parsed once for a run of them
+    const uint8_t *address = place - pointer;
+    if (address != *cached) {
+        *cached = nullptr;
+        if (!parse_cie(address, cie)) {
+            return;
+        }
+        memset(initial, 0, sizeof(CfiFrame));
+        uintptr_t ignored = 0;
+        if (!execute(cie->instructions, cie->end, cie, initial, initial, &ignored, nullptr)) {
+            return;
+        }
+        *cached = address;
+    }
+
+    uintptr_t begin;
+    uintptr_t range;
+    if (!read_encoded(&p, cie->fde_encoding, 0, &begin) || !read_format(&p, cie->fde_encoding, &range)) {
+        return;
+    }
+    if (cie->augmented) {
+        uint64_t size = read_uleb(&p);
+        p += size;
+    }
+
+    CfiFrame frame = *initial;
+    uintptr_t loc = begin;
+    if (execute(p, end, cie, &frame, initial, &loc, emitter)) {
+        emit(emitter, to_row(&frame, loc, emitter->bias));
+    } else {
+        CfiRow none = to_row(&frame, loc, emitter->bias);
+        none.cfa = CFI_CFA_NONE;
+        emit(emitter, none);
+    }
+    // nothing holds past the function, unless the next FDE starts right there
+    CfiRow none;
+    memset(&none, 0, sizeof(none));
+    none.pc = (uint32_t) (begin + range - emitter->bias);
+    emit(emitter, none);
+}
+
+static void compile_module(const CfiModule *module, CfiEmitter *emitter) {
+    const uint8_t *hdr = (const uint8_t *) module->eh_frame_hdr;
+    if (hdr == nullptr || module->eh_frame_hdr_size < 4 || hdr[0] != 1) {
+        return;
+    }
+    const uint8_t *end = hdr + module->eh_frame_hdr_size;
+    const uint8_t *p = hdr + 4;
+    uintptr_t eh_frame;
+    uintptr_t count;
+    if (!read_encoded(&p, hdr[1], (uintptr_t) hdr, &eh_frame) || !read_encoded(&p, hdr[2], (uintptr_t) hdr, &count)) {
+        return;
+    }
+    // every linker in use writes the search table as pairs of datarel sdata4, within the segment
+    if (hdr[3] != (DW_EH_PE_datarel | DW_EH_PE_sdata4) || p > end || count > (uintptr_t) (end - p) / 8) {
+        return;
+    }
+
+    const uint8_t *cached = nullptr;
+    CfiCie cie;
+    CfiFrame initial;
+    for (uintptr_t i = 0; i < count; i++) {
+        const uint8_t *entry = p + i * 8 + 4;
+        int32_t offset = read_raw<int32_t>(&entry);
+        compile_fde(hdr + offset, emitter, &cached, &cie, &initial);
+    }
+}
+
+static CfiTable *compile_table(const CfiModule *module) {
+    CfiEmitter emitter;
+    memset(&emitter, 0, sizeof(emitter));
+    emitter.bias = module->bias;
+    compile_module(module, &emitter);
+    if (emitter.count == 0) {
+        return &sNoRules;
+    }
+
+    size_t capacity = emitter.count;
+    CfiTable *table = (CfiTable *) cfi_alloc(sizeof(CfiTable) + capacity * sizeof(CfiRow));
+    if (table == nullptr) {
+        return nullptr;
+    }
+    memset(&emitter, 0, sizeof(emitter));
+    emitter.rows = table->rows;
+    emitter.capacity = capacity;
+    emitter.bias = module->bias;
+    compile_module(module, &emitter);
+    table->count = emitter.count;
+    return table;
+}
+
+//**************************************************************************************************
+static inline uint32_t page_hash(uintptr_t pc, uint32_t bits) {
+    return (uint32_t) (((pc >> 12) * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+}
+
+static CfiCache *current_cache() {
+    CfiCache *cache = sCache.load(std::memory_order_acquire);
+    if (cache != nullptr) {
+        return cache;
+    }
+    pthread_mutex_lock(&sMutex);
+    cache = sCache.load(std::memory_order_relaxed);
+    if (cache == nullptr) {
+        cache = (CfiCache *) cfi_alloc(sizeof(CfiCache));
+        sChecked.store(now_ms(), std::memory_order_relaxed);
+        sCache.store(cache, std::memory_order_release);
+    }
+    pthread_mutex_unlock(&sMutex);
+    return cache;
+}
+
+static CfiModule *find_module(CfiCache *cache, uintptr_t pc) {
+    std::atomic<CfiModule *> &page = cache->pages[page_hash(pc, CFI_PAGE_CACHE_BITS)];
+    CfiModule *module = page.load(std::memory_order_acquire);
+    if (module != nullptr && pc >= module->start && pc < module->end) {
+        return module;
+    }
+    uint32_t count = cache->count.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i < count; i++) {
+        module = &cache->modules[i];
+        if (pc >= module->start && pc < module->end) {
+            page.store(module, std::memory_order_release);
+            return module;
+        }
+    }
+    return nullptr;
+}
+
+static int search_callback(struct dl_phdr_info *info, size_t, void *data) {
+    auto *search = (CfiSearch *) data;
+    uintptr_t start = 0, end = 0, hdr = 0;
+    size_t hdr_size = 0;
+    for (size_t i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        uintptr_t address = info->dlpi_addr + phdr->p_vaddr;
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X)) {
+            if (search->pc >= address && search->pc < address + phdr->p_memsz) {
+                start = address;
+                end = address + phdr->p_memsz;
+            }
+        } else if (phdr->p_type == PT_GNU_EH_FRAME) {
+            hdr = address;
+            hdr_size = phdr->p_memsz;
+        }
+    }
+    if (start == 0) {
+        return 0;
+    }
+    search->found = true;
+    search->bias = info->dlpi_addr;
+    search->start = start;
+    search->end = end;
+    search->eh_frame_hdr = hdr;
+    search->eh_frame_hdr_size = hdr_size;
+    if (info->dlpi_name != nullptr) {
+        strncpy(search->path, info->dlpi_name, CFI_MAX_PATH - 1);
+    }
+    return 1;
+}
+
+static int alive_callback(struct dl_phdr_info *info, size_t, void *data) {
+    auto *alive = (CfiAlive *) data;
+    for (size_t i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X)) {
+            continue;
+        }
+        if (alive->count == CFI_MAX_RANGES) {
+            alive->overflow = true;
+            return 1;
+        }
+        alive->ranges[alive->count].start = info->dlpi_addr + phdr->p_vaddr;
+        alive->ranges[alive->count].end = info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz;
+        alive->count++;
+    }
+    return 0;
+}
+
+/*
+ * Adds the module of pc. The linker lock is held while the modules are iterated and a dlopen
+ * holds it while constructors allocate, so sMutex is only taken afterwards to publish it.
+ */
+static CfiModule *load_module(CfiCache *cache, uintptr_t pc) {
+    // pages are kept plus one, so an empty entry matches none
+    std::atomic<uintptr_t> &miss = cache->misses[page_hash(pc, CFI_MISS_CACHE_BITS)];
+    if (miss.load(std::memory_order_relaxed) == (pc >> 12) + 1) {
+        return nullptr;
+    }
+    CfiSearch search;
+    memset(&search, 0, sizeof(search));
+    search.pc = pc;
+    xdl_iterate_phdr(search_callback, &search, XDL_DEFAULT);
+    if (!search.found) {
+        miss.store((pc >> 12) + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    CfiModule *module = nullptr;
+    pthread_mutex_lock(&sMutex);
+    if (cache == sCache.load(std::memory_order_relaxed)) {
+        module = find_module(cache, pc);
+        uint32_t count = cache->count.load(std::memory_order_relaxed);
+        if (module == nullptr && count < CFI_MAX_MODULES) {
+            module = &cache->modules[count];
+            module->bias = search.bias;
+            module->start = search.start;
+            module->end = search.end;
+            module->eh_frame_hdr = search.eh_frame_hdr;
+            module->eh_frame_hdr_size = search.eh_frame_hdr_size;
+            module->selected = (search.start <= (uintptr_t) cfi_step && (uintptr_t) cfi_step < search.end)
+                               || (sSelecting && regexec(&sRegex, search.path, 0, nullptr, 0) == 0);
+            module->table.store(nullptr, std::memory_order_relaxed);
+            cache->count.store(count + 1, std::memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&sMutex);
+    return module;
+}
+
+// the linker lock is held meanwhile, so the module can't be unloaded while its CFI is read
+static int compile_callback(struct dl_phdr_info *info, size_t, void *data) {
+    auto *compile = (CfiCompile *) data;
+    for (size_t i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        uintptr_t address = info->dlpi_addr + phdr->p_vaddr;
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X)
+            && address == compile->module->start && address + phdr->p_memsz == compile->module->end) {
+            compile->table = compile_table(compile->module);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Tables are compiled on first use, a thread that loses the race drops its own. A module that
+ * is gone by then gets no rules, the next check drops it.
+ */
+static const CfiTable *table_of(CfiModule *module) {
+    CfiTable *table = module->table.load(std::memory_order_acquire);
+    if (table != nullptr) {
+        return table;
+    }
+    CfiCompile compile = {module, &sNoRules};
+    xdl_iterate_phdr(compile_callback, &compile, XDL_DEFAULT);
+    CfiTable *compiled = compile.table;
+    if (compiled == nullptr) {
+        return nullptr;
+    }
+    if (!module->table.compare_exchange_strong(table, compiled, std::memory_order_acq_rel)) {
+        if (compiled != &sNoRules) {
+            cfi_free(compiled);
+        }
+        return table;
+    }
+    return compiled;
+}
+
+// the last row at or below offset, without branches on the rows, which a walk can't predict
+static const CfiRow *find_row(const CfiTable *table, uintptr_t offset) {
+    const CfiRow *base = table->rows;
+    size_t count = table->count;
+    if (count == 0 || offset < base->pc) {
+        return nullptr;
+    }
+    while (count > 1) {
+        size_t half = count / 2;
+        base = base[half].pc <= offset ? base + half : base;
+        count -= half;
+    }
+    return base;
+}
+
+static inline bool read_stack(uintptr_t address, uintptr_t st, uintptr_t sb, uintptr_t *out) {
+    if (address < sb || address + sizeof(uintptr_t) > st || (address & (sizeof(uintptr_t) - 1))) {
+        return false;
+    }
+    *out = *(const uintptr_t *) address;
+    return true;
+}
+
+static inline uintptr_t strip_signature(uintptr_t ra) {
+#if defined(__aarch64__)
+    // xpaclri, a hint, so it is a nop on cores without pointer authentication
+    register uintptr_t x30 __asm__("x30") = ra;
+    __asm__("hint #7" : "+r"(x30));
+    return x30;
+#else
+    return ra;
+#endif
+}
+
+static bool check_unloaded();
+
+/*
+ * A dlclose is only seen by the proxy when its caller is hooked, so a step that misses the page
+ * answers checks now and then whether a cached module is gone, one thread at a time.
+ */
+static bool check_due() {
+    uint64_t now = now_ms();
+    uint64_t checked = sChecked.load(std::memory_order_relaxed);
+    return now - checked >= CFI_CHECK_INTERVAL_MS
+           && sChecked.compare_exchange_strong(checked, now, std::memory_order_relaxed);
+}
+
+static __attribute__((noinline)) CfiModule *lookup_module_slow(CfiCache *cache, uintptr_t pc) {
+    if (check_due() && check_unloaded() && (cache = current_cache()) == nullptr) {
+        return nullptr;
+    }
+    CfiModule *module = find_module(cache, pc);
+    return module != nullptr ? module : load_module(cache, pc);
+}
+
+static inline CfiModule *lookup_module(uintptr_t pc) {
+    CfiCache *cache = current_cache();
+    if (cache == nullptr) {
+        return nullptr;
+    }
+    CfiModule *module = cache->pages[page_hash(pc, CFI_PAGE_CACHE_BITS)].load(std::memory_order_acquire);
+    if (module != nullptr && pc >= module->start && pc < module->end) {
+        return module;
+    }
+    return lookup_module_slow(cache, pc);
+}
+
+bool cfi_step(CfiRegs *regs, bool exact, uintptr_t st, uintptr_t sb, bool any_module) {
+    // a return address may be just past the last instruction of its function
+    uintptr_t pc = exact ? regs->pc : regs->pc - 1;
+    CfiModule *module = lookup_module(pc);
+    if (module == nullptr) {
+        return false;
+    }
+    if (!module->selected && !any_module) {
+        return false;
+    }
+    const CfiTable *table = table_of(module);
+    if (table == nullptr) {
+        return false;
+    }
+    const CfiRow *row = find_row(table, pc - module->bias);
+    if (row == nullptr || row->cfa == CFI_CFA_NONE || (row->flags & CFI_RA_UNDEFINED)) {
+        return false;
+    }
+
+    uintptr_t base = row->cfa == CFI_CFA_SP ? regs->sp : regs->fp;
+    if (base == 0) {
+        return false;
+    }
+    uintptr_t cfa = base + row->cfa_offset;
+    if (cfa > st || cfa <= (regs->sp != 0 ? regs->sp : sb)) {
+        return false;
+    }
+    uintptr_t ra;
+    if (row->flags & CFI_RA_SAVED) {
+        if (!read_stack(cfa + row->ra_offset, st, sb, &ra)) {
+            return false;
+        }
+    } else {
+#if CFI_HAS_LR
+        ra = regs->lr;
+#else
+        return false;
+#endif
+    }
+    uintptr_t fp = regs->fp;
+    if ((row->flags & CFI_FP_SAVED) && !read_stack(cfa + row->fp_offset, st, sb, &fp)) {
+        return false;
+    }
+    if (row->flags & CFI_RA_SIGNED) {
+        ra = strip_signature(ra);
+    }
+    regs->pc = ra;
+    regs->lr = ra;
+    regs->sp = cfa;
+    regs->fp = fp;
+    return true;
+}
+
+bool cfi_is_code(uintptr_t pc) {
+    return lookup_module(pc) != nullptr;
+}
+
+bool cfi_is_selected(uintptr_t pc) {
+    CfiModule *module = lookup_module(pc);
+    return module != nullptr && module->selected;
+}
+
+uint32_t cfi_enter() {
+    return unwind_epoch_enter(&sEpoch);
+}
+
+void cfi_leave(uint32_t epoch) {
+    unwind_epoch_leave(&sEpoch, epoch);
+}
+
+//**************************************************************************************************
+/*
+ * Must hold sMutex, modules of the old cache whose segment is in ranges are carried over, all
+ * are dropped without ranges. Returns whether the cache was replaced: it is kept when no module
+ * is dropped, and while unwinds of the epoch before are left.
+ */
+static bool replace_cache(const CfiRange *ranges, size_t count) {
+    CfiCache *cache = sCache.load(std::memory_order_relaxed);
+    if (cache == nullptr) {
+        return true;
+    }
+    uint32_t modules = cache->count.load(std::memory_order_relaxed);
+    bool loaded[CFI_MAX_MODULES];
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < modules; i++) {
+        loaded[i] = false;
+        for (size_t j = 0; ranges != nullptr && j < count; j++) {
+            if (ranges[j].start == cache->modules[i].start && ranges[j].end == cache->modules[i].end) {
+                loaded[i] = true;
+                break;
+            }
+        }
+        kept += loaded[i];
+    }
+    if (!cfi_reclaim() || (ranges != nullptr && kept == modules)) {
+        return false;
+    }
+
+    CfiCache *fresh = ranges != nullptr ? (CfiCache *) cfi_alloc(sizeof(CfiCache)) : nullptr;
+    kept = 0;
+    for (uint32_t i = 0; i < modules; i++) {
+        CfiModule *module = &cache->modules[i];
+        CfiTable *table = module->table.load(std::memory_order_acquire);
+        if (fresh != nullptr && loaded[i]) {
+            CfiModule *copy = &fresh->modules[kept++];
+            copy->bias = module->bias;
+            copy->start = module->start;
+            copy->end = module->end;
+            copy->eh_frame_hdr = module->eh_frame_hdr;
+            copy->eh_frame_hdr_size = module->eh_frame_hdr_size;
+            copy->selected = module->selected;
+            copy->table.store(table, std::memory_order_relaxed);
+        } else {
+            cfi_retire(table);
+        }
+    }
+    if (fresh != nullptr) {
+        fresh->count.store(kept, std::memory_order_relaxed);
+    }
+    // page answers are dropped with the old cache, a step still using it only writes to it
+    sCache.store(fresh, std::memory_order_release);
+    cfi_retire(cache);
+    unwind_epoch_advance(&sEpoch);
+    return true;
+}
+
+bool cfi_select_modules(const char *regex) {
+    regex_t compiled;
+    if (regex != nullptr && regcomp(&compiled, regex, REG_EXTENDED | REG_NOSUB) != 0) {
+        return false;
+    }
+    pthread_mutex_lock(&sMutex);
+    if (sSelecting) {
+        regfree(&sRegex);
+    }
+    sSelecting = regex != nullptr;
+    if (sSelecting) {
+        sRegex = compiled;
+    }
+    pthread_mutex_unlock(&sMutex);
+
+    // a module is matched when it is cached, so all of them are matched again. No unwind is in
+    // progress here, the ones of the epoch before are short, and may need sMutex to finish
+    for (;;) {
+        pthread_mutex_lock(&sMutex);
+        bool replaced = replace_cache(nullptr, 0);
+        pthread_mutex_unlock(&sMutex);
+        if (replaced) {
+            return true;
+        }
+        sched_yield();
+    }
+}
+
+// returns whether the cache was replaced
+static bool check_unloaded() {
+    if (sCache.load(std::memory_order_acquire) == nullptr) {
+        return false;
+    }
+    sChecked.store(now_ms(), std::memory_order_relaxed);
+    // the ranges still loaded, collected before sMutex is taken, see load_module
+    CfiAlive alive = {nullptr, 0, false};
+    void *ranges = cfi_alloc(sizeof(CfiBlock) + CFI_MAX_RANGES * sizeof(CfiRange));
+    if (ranges == nullptr) {
+        return false;
+    }
+    alive.ranges = (CfiRange *) ((CfiBlock *) ranges + 1);
+    xdl_iterate_phdr(alive_callback, &alive, XDL_DEFAULT);
+
+    pthread_mutex_lock(&sMutex);
+    bool replaced = replace_cache(alive.overflow ? nullptr : alive.ranges, alive.count);
+    pthread_mutex_unlock(&sMutex);
+
+    cfi_free(ranges);
+    return replaced;
+}
+
+void cfi_invalidate_modules() {
+    check_unloaded();
+}
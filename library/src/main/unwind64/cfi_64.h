@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2021 ByteDance Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CFI_64_H
+#define CFI_64_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Registers of a frame while it is unwound, pc and sp are those right after the call it made
+ * returned, fp and lr the values of x29 and x30 there. sp is 0 when it isn't known.
+ */
+typedef struct {
+    uintptr_t pc;
+    uintptr_t sp;
+    uintptr_t fp;
+    uintptr_t lr;
+} CfiRegs;
+
+/*
+ * Modules whose path matches regex are unwound by their .eh_frame from now on, this library
+ * always is. nullptr selects none. Returns false, and keeps the selection, if regex is invalid.
+ */
+bool cfi_select_modules(const char *regex);
+
+/*
+ * Unwinds one frame by the CFI of the module of regs->pc into the caller's registers. pc is a
+ * return address unless exact, any_module ignores the selection. The stack is [sb, st). Only
+ * between cfi_enter and cfi_leave, like cfi_is_code.
+ * Returns false if the module isn't selected or has no rule for pc, regs is unchanged then.
+ */
+bool cfi_step(CfiRegs *regs, bool exact, uintptr_t st, uintptr_t sb, bool any_module);
+
+// whether pc is in an executable segment of a loaded module, a cheap check of a return address
+bool cfi_is_code(uintptr_t pc);
+
+// whether pc is in a module that cfi_step unwinds without any_module
+bool cfi_is_selected(uintptr_t pc);
+
+/*
+ * An unwind enters before its first step and leaves after its last, so the tables it may read
+ * are not unmapped meanwhile. Returns the epoch to leave.
+ */
+uint32_t cfi_enter();
+
+void cfi_leave(uint32_t epoch);
+
+/*
+ * Drops the tables of modules that are no longer loaded, nothing when all still are. Called by
+ * the dlclose proxy, steps call it themselves as well, at most every CFI_CHECK_INTERVAL_MS.
+ */
+void cfi_invalidate_modules();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CFI_64_H